@@ -41,6 +41,15 @@ static inline void print_log(Log_Level level, char *fmt, char *filename, int lin
 #define virtual_alloc(x) mmap(0, x, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)
 #endif
 
+// Both return the value *dst held before the operation.
+#if defined(_WIN32)
+#define atomic_compare_exchange_u64(dst, expected, desired) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(dst), (LONG64)(desired), (LONG64)(expected)))
+#define atomic_add_u64(dst, value) ((uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)(dst), (LONG64)(value)))
+#elif defined(__linux__)
+#define atomic_compare_exchange_u64(dst, expected, desired) __sync_val_compare_and_swap((dst), (expected), (desired))
+#define atomic_add_u64(dst, value) __sync_fetch_and_add((dst), (value))
+#endif
+
 #define offset_of(t, m) (&((t *)(0)->m))
 
 #define array_count(x) ((sizeof(x)/sizeof(*(x))))
@@ -150,6 +159,24 @@ static inline void arena_end_scratch(Scratch_Arena *scratch) {
 }
 
 int get_max_thread_count();
+uint64_t get_time_ns();
+// Converts a raw reading of the clock behind get_time_ns (CLOCK_MONOTONIC,
+// QueryPerformanceCounter) to get_time_ns nanoseconds.
+uint64_t host_clock_to_ns(uint64_t value);
+void sleep_ns(uint64_t ns);
+bool get_executable_directory(char *buffer, size_t size);
+bool replace_file(const char *src, const char *dst);
+
+// Watches the files directly inside a directory, never blocks.
+typedef struct {
+    void *handle;
+} File_Watch;
+bool file_watch_open(File_Watch *watch, const char *directory);
+// True when a file was written or moved in since the last call.
+bool file_watch_changed(File_Watch *watch);
+void file_watch_close(File_Watch *watch);
+// Client area in pixels as of the last process_events.
+void window_get_size(void *window, int *width, int *height);
 
 typedef void *Thread;
 
@@ -246,5 +273,6 @@ typedef struct {
     xcb_connection_t *connection;
     xcb_window_t handle;
     xcb_key_symbols_t *symbols;
+    int width, height;
 } XCB_Window;
 #endif
@@ -1,5 +1,7 @@
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/inotify.h>
+#include <time.h>
 #include <X11/keysym.h>
 
 
@@ -13,6 +15,8 @@ void *window_init(char *title, int width, int height) {
     xcb_screen_t *screen = it.data;
     xcb_window_t root = screen->root;
     window->handle = xcb_generate_id(window->connection);
+    window->width = width;
+    window->height = height;
 
     uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
 
@@ -84,6 +88,7 @@ Key_Code get_key_code(xcb_key_symbols_t *syms, uint8_t code) {
 
 void process_events(Controller *cont, void *data, bool *window_should_close) {
     XCB_Window *window = (XCB_Window *)data;
+    *window_should_close = false;
 
     Controller temp = {0};
     memcpy(&temp, cont, sizeof(Controller));
@@ -93,7 +98,8 @@ void process_events(Controller *cont, void *data, bool *window_should_close) {
     }
 
     for (;;) {
-        xcb_generic_event_t *event = xcb_wait_for_event(window->connection);
+        // Polling so that an idle window doesn't block the frame loop.
+        xcb_generic_event_t *event = xcb_poll_for_event(window->connection);
         if (!event) break;
 
         switch (event->response_type & ~0x80) {
@@ -119,17 +125,25 @@ void process_events(Controller *cont, void *data, bool *window_should_close) {
             case XCB_MOTION_NOTIFY: {
             } break;
             case XCB_CONFIGURE_NOTIFY: {
+                // Also sent for moves, the size is what matters.
                 xcb_configure_notify_event_t *e = (void *)event;
-                // resize: e->width, e->height 
+                window->width = e->width;
+                window->height = e->height;
             } break;
             case XCB_CLIENT_MESSAGE: {
                 // WM close button usually lands here
             } break;
-            free(event);
         }
+        free(event);
     }
 }
 
+void window_get_size(void *data, int *width, int *height) {
+    XCB_Window *window = (XCB_Window *)data;
+    *width = window->width;
+    *height = window->height;
+}
+
 int get_max_thread_count() {
     long online = sysconf(_SC_NPROCESSORS_ONLN); 
     long total = sysconf(_SC_NPROCESSORS_CONF);
@@ -137,6 +151,61 @@ int get_max_thread_count() {
     return online;
 }
 
+uint64_t get_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t host_clock_to_ns(uint64_t value) {
+    return value;
+}
+
+void sleep_ns(uint64_t ns) {
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    while (nanosleep(&ts, &ts) != 0) {}
+}
+
+bool get_executable_directory(char *buffer, size_t size) {
+    ssize_t len = readlink("/proc/self/exe", buffer, size - 1);
+    if (len <= 0) return false;
+    buffer[len] = 0;
+    char *slash = strrchr(buffer, '/');
+    if (slash) *slash = 0;
+    return true;
+}
+
+// rename() replaces dst atomically.
+bool replace_file(const char *src, const char *dst) {
+    return rename(src, dst) == 0;
+}
+
+// Only files that were closed after writing or renamed into place count, so
+// nothing is reported while a file is half written.
+bool file_watch_open(File_Watch *watch, const char *directory) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return false;
+    if (inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        return false;
+    }
+    watch->handle = (void *)(intptr_t)fd;
+    return true;
+}
+
+bool file_watch_changed(File_Watch *watch) {
+    int fd = (int)(intptr_t)watch->handle;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (read(fd, events, sizeof(events)) > 0) changed = true;
+    return changed;
+}
+
+void file_watch_close(File_Watch *watch) {
+    close((int)(intptr_t)watch->handle);
+    watch->handle = 0;
+}
+
 Thread create_thread(pfn_thread_func entry_point, void *params) {
     pthread_t result;
     int rc = pthread_create(&result, NULL, entry_point, params);
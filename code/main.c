@@ -25,6 +25,7 @@ static int window_width = 800;
 static int window_height = 600;
 static Controller controller;
 static bool running = true;
+static bool frame_failed = false;
 
 static Thread_Context *threads;
 static uint32_t thread_count;
@@ -39,7 +40,7 @@ THREAD_RETURN_TYPE thread_entry_point(void *data) {
     if (thread_index == 0) {
         window = window_init("Boxel", window_width, window_height);
         renderer = virtual_alloc(renderer_size);
-        if (!renderer_init(renderer, renderer_size, window, window_width, window_height)) {
+        if (!renderer_init(renderer, renderer_size, window, window_width, window_height, thread_count)) {
             print_error("Renderer failed to initialize!");
             running = false;
         } else {
@@ -47,20 +48,49 @@ THREAD_RETURN_TYPE thread_entry_point(void *data) {
         }
     }
 
+    // Every lane helps build the startup pipelines.
+    barrier_wait(&barrier);
+    if (running) renderer_compile_pipelines(renderer, thread_index);
+
+    barrier_wait(&barrier);
+    if (thread_index == 0 && running && !renderer_finish_init(renderer)) {
+        print_error("Renderer failed to compile its pipelines!");
+        running = false;
+    }
+
     barrier_wait(&barrier);
     while (running) {
 
         barrier_wait(&barrier);
         if (thread_index == 0) {
             bool window_should_close;
+            renderer_wait_for_frame(renderer);
             process_events(&controller, window, &window_should_close);
-            running = !window_should_close;
+            running = !window_should_close && !frame_failed;
+            if (running) {
+                int width, height;
+                window_get_size(window, &width, &height);
+                renderer_resize(renderer, width, height);
+                renderer_begin_frame(renderer);
+            }
         }
 
         barrier_wait(&barrier);
         if (button_pressed(&controller, Key_Code_Space)) {
             print_info("Thread %d: space bar pressed.", thread_index);
         }
+        if (running) renderer_record(renderer, thread_index);
+
+        barrier_wait(&barrier);
+        // The loop stops at the top of the next frame, where every lane sees it.
+        if (thread_index == 0 && running && !renderer_end_frame(renderer)) {
+            print_error("Renderer failed to present a frame!");
+            frame_failed = true;
+        }
+    }
+
+    if (thread_index == 0 && renderer) {
+        renderer_shutdown(renderer);
     }
     return 0;
 }
@@ -12,16 +12,346 @@
 //  - compute passes: particles, raymarching
 
 
-bool renderer_init(void *memory, size_t size, void *window, int width, int height) {
+// Column major, same layout as a glsl mat4.
+void renderer_set_camera(Renderer_State *renderer, float view_proj[16]) {
+    memcpy(renderer->vk.view_proj, view_proj, sizeof(renderer->vk.view_proj));
+}
+
+// Lane 0 only, between renderer_begin_frame and renderer_record. Returns false
+// when this frame has no upload space left, try again next frame.
+bool renderer_set_chunk_mesh(Renderer_State *renderer, uint32_t chunk_index, int32_t position[3], Vulkan_Chunk_Quad *quads, uint32_t quad_count) {
+    if (!renderer->frame_active) return false;
+    return vulkan_chunk_mesh_upload(&renderer->vk, chunk_index, position, quads, quad_count);
+}
+
+void renderer_remove_chunk_mesh(Renderer_State *renderer, uint32_t chunk_index) {
+    if (renderer->frame_active) vulkan_chunk_mesh_remove(&renderer->vk, chunk_index);
+}
+
+// Lane 0 only, between renderer_begin_frame and renderer_record. Chunks past
+// the mesh radius go here instead of being meshed, voxels holds 32^3 colors
+// in the chunk quad material format, x fastest then y then z, 0 for air.
+// Returns false when this frame has no upload space left.
+bool renderer_set_far_chunk(Renderer_State *renderer, int32_t position[3], const uint16_t *voxels) {
+    if (!renderer->frame_active) return false;
+    return vulkan_far_chunk_upload(&renderer->vk, position, voxels);
+}
+
+void renderer_remove_far_chunk(Renderer_State *renderer, int32_t position[3]) {
+    if (renderer->frame_active) vulkan_far_chunk_remove(&renderer->vk, position);
+}
+
+// Lane 0 only, between renderer_begin_frame and renderer_record. rgba holds
+// width*height RGBA8 texels. A zero handle means the texture wasn't created.
+Texture_Handle renderer_create_texture(Renderer_State *renderer, uint32_t width, uint32_t height, const uint8_t *rgba) {
+    Texture_Handle result = {};
+    if (!renderer->frame_active) return result;
+    Vulkan_Handle handle = vulkan_texture_create(&renderer->vk, width, height, rgba);
+    result.index = handle.index;
+    result.generation = handle.generation;
+    return result;
+}
+
+void renderer_destroy_texture(Renderer_State *renderer, Texture_Handle texture) {
+    vulkan_texture_destroy(&renderer->vk, (Vulkan_Handle){ texture.index, texture.generation });
+}
+
+// Lane 0 only, same as renderer_create_texture. The data lands in a storage
+// buffer that shaders reach through the bindless buffer array.
+Buffer_Handle renderer_create_mesh(Renderer_State *renderer, const void *data, size_t size) {
+    Buffer_Handle result = {};
+    if (!renderer->frame_active) return result;
+    Vulkan_Handle handle = vulkan_storage_buffer_create(&renderer->vk, data, size);
+    result.index = handle.index;
+    result.generation = handle.generation;
+    return result;
+}
+
+void renderer_destroy_mesh(Renderer_State *renderer, Buffer_Handle mesh) {
+    vulkan_storage_buffer_destroy(&renderer->vk, (Vulkan_Handle){ mesh.index, mesh.generation });
+}
+
+// Lane 0 only, any time after renderer_init. The emitter spawns every frame
+// from then on, its particles never cost the CPU anything.
+bool renderer_set_particle_emitter(Renderer_State *renderer, uint32_t emitter_index, Vulkan_Particle_Emitter *emitter) {
+    return vulkan_particle_emitter_set(&renderer->vk, emitter_index, emitter);
+}
+
+void renderer_remove_particle_emitter(Renderer_State *renderer, uint32_t emitter_index) {
+    vulkan_particle_emitter_remove(&renderer->vk, emitter_index);
+}
+
+// A grid of fountains that together keep about particle_count particles
+// alive, their lifetimes average 7/8 of the emitter's.
+void renderer_create_bench_particles(Renderer_State *renderer, uint32_t particle_count) {
+    uint32_t emitter_count = 64;
+    Vulkan_Particle_Emitter emitter = {};
+    emitter.velocity[1] = 12.0f;
+    emitter.spread = 6.0f;
+    emitter.color[0] = 1.0f;
+    emitter.color[1] = 0.6f;
+    emitter.color[2] = 0.2f;
+    emitter.color[3] = 0.8f;
+    emitter.lifetime = 4.0f;
+    emitter.size = 0.5f;
+    emitter.gravity = 9.8f;
+    emitter.rate = (float)particle_count / ((float)emitter_count*emitter.lifetime*0.875f);
+    for (uint32_t emitter_idx = 0; emitter_idx < emitter_count; ++emitter_idx) {
+        emitter.position[0] = (float)(emitter_idx % 8)*64.0f;
+        emitter.position[1] = 40.0f;
+        emitter.position[2] = (float)(emitter_idx / 8)*64.0f;
+        renderer_set_particle_emitter(renderer, emitter_idx, &emitter);
+    }
+}
+
+// Lane 0 only, any time after renderer_init. The light shines until it is
+// removed, culled on the GPU against the clusters every frame.
+bool renderer_set_light(Renderer_State *renderer, uint32_t light_index, Vulkan_Light *light) {
+    return vulkan_light_set(&renderer->vk, light_index, light);
+}
+
+void renderer_remove_light(Renderer_State *renderer, uint32_t light_index) {
+    vulkan_light_remove(&renderer->vk, light_index);
+}
+
+// Warm lights of mixed sizes scattered over a square of 1024 blocks just
+// above the ground, the same every run.
+void renderer_create_bench_lights(Renderer_State *renderer, uint32_t light_count) {
+    uint32_t seed = 0x1234567u;
+    for (uint32_t light_idx = 0; light_idx < light_count; ++light_idx) {
+        float random[5];
+        for (uint32_t random_idx = 0; random_idx < array_count(random); ++random_idx) {
+            seed = seed*1664525u + 1013904223u;
+            random[random_idx] = (float)(seed >> 8) / (float)(1u << 24);
+        }
+        Vulkan_Light light = {};
+        light.position[0] = random[0]*1024.0f;
+        light.position[1] = 2.0f + random[1]*16.0f;
+        light.position[2] = random[2]*1024.0f;
+        light.radius = 6.0f + random[3]*18.0f;
+        light.color[0] = 1.0f;
+        light.color[1] = 0.5f + random[4]*0.4f;
+        light.color[2] = 0.2f + random[4]*0.2f;
+        renderer_set_light(renderer, light_idx, &light);
+    }
+}
+
+void renderer_upload_bench_chunks(Renderer_State *renderer) {
+    Vulkan_Chunk_Quad cube[6];
+    for (uint32_t face = 0; face < 6; ++face) {
+        uint32_t positive = (face & 1) == 0;
+        uint32_t axis = face >> 1;
+        uint32_t coords[3] = { 0, 0, 0 };
+        coords[axis] = positive;
+        cube[face].a = coords[0] | (coords[1] << 6) | (coords[2] << 12) | (face << 18);
+        cube[face].b = 0x7fff;
+    }
+    while (renderer->bench_chunks_uploaded < renderer->bench_chunk_count) {
+        uint32_t index = renderer->bench_chunks_uploaded;
+        int32_t position[3] = { (int32_t)(index % 128), 0, (int32_t)(index / 128) };
+        if (!renderer_set_chunk_mesh(renderer, index, position, cube, array_count(cube))) break;
+        renderer->bench_chunks_uploaded += 1;
+    }
+}
+
+// Rolling hills in a square of far chunks around the origin, at most 256 a
+// frame so the upload ring keeps up.
+void renderer_upload_bench_far_chunks(Renderer_State *renderer) {
+    if (renderer->bench_far_uploaded >= renderer->bench_far_count) return;
+    Scratch_Arena scratch = arena_begin_scratch(&renderer->transient_arena);
+    uint16_t *voxels = push_array(&renderer->transient_arena, uint16_t, VULKAN_CHUNK_SIZE*VULKAN_CHUNK_SIZE*VULKAN_CHUNK_SIZE);
+    if (!voxels) {
+        arena_end_scratch(&scratch);
+        return;
+    }
+    uint16_t grass = 6 | (20 << 5) | (4 << 10);
+    uint16_t dirt = 14 | (9 << 5) | (5 << 10);
+    uint32_t side = 1;
+    while (side*side < renderer->bench_far_count) side += 1;
+    for (uint32_t uploads = 0; uploads < 256 && renderer->bench_far_uploaded < renderer->bench_far_count; ++uploads) {
+        uint32_t index = renderer->bench_far_uploaded;
+        int32_t position[3] = { (int32_t)(index % side) - (int32_t)side/2, 0, (int32_t)(index / side) - (int32_t)side/2 };
+        for (uint32_t z = 0; z < VULKAN_CHUNK_SIZE; ++z) {
+            for (uint32_t x = 0; x < VULKAN_CHUNK_SIZE; ++x) {
+                float world_x = (float)(position[0]*VULKAN_CHUNK_SIZE + (int32_t)x);
+                float world_z = (float)(position[2]*VULKAN_CHUNK_SIZE + (int32_t)z);
+                uint32_t height = (uint32_t)(16.0f + 7.0f*sinf(world_x*0.013f) + 7.0f*cosf(world_z*0.017f));
+                for (uint32_t y = 0; y < VULKAN_CHUNK_SIZE; ++y) {
+                    uint16_t color = y > height ? 0 : y == height ? grass : dirt;
+                    voxels[x + VULKAN_CHUNK_SIZE*(y + VULKAN_CHUNK_SIZE*z)] = color;
+                }
+            }
+        }
+        if (!renderer_set_far_chunk(renderer, position, voxels)) break;
+        renderer->bench_far_uploaded += 1;
+    }
+    arena_end_scratch(&scratch);
+}
+
+bool renderer_init(void *memory, size_t size, void *window, int width, int height, uint32_t lane_count) {
     assert(sizeof(Renderer_State) < size);
     Renderer_State *renderer = (Renderer_State *)memory;
+    renderer->init_begin_ns = get_time_ns();
     size_t remaining_size = size - sizeof(Renderer_State);
     renderer->transient_arena = arena_init((uint8_t *)memory + sizeof(Renderer_State), remaining_size);
-    if (!vulkan_backend_init(&renderer->vk, &renderer->transient_arena, window, width, height)) return false;
+    renderer->width = width;
+    renderer->height = height;
+
+    // BOXEL_PRESENT_MODE=fifo|fifo_relaxed|mailbox|immediate is tried first,
+    // BOXEL_SWAPCHAIN_IMAGES=N overrides the image count and BOXEL_LOW_LATENCY=1
+    // paces frames on present waits, keeping BOXEL_LATENCY_SLACK_US for the GPU.
+    Vulkan_Present_Config present_config = {};
+    present_config.present_mode = VK_PRESENT_MODE_MAX_ENUM_KHR;
+    present_config.latency_slack_ns = 2000000;
+    const char *present_mode = getenv("BOXEL_PRESENT_MODE");
+    if (present_mode) {
+        if (strcmp(present_mode, "fifo") == 0) present_config.present_mode = VK_PRESENT_MODE_FIFO_KHR;
+        else if (strcmp(present_mode, "fifo_relaxed") == 0) present_config.present_mode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+        else if (strcmp(present_mode, "mailbox") == 0) present_config.present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+        else if (strcmp(present_mode, "immediate") == 0) present_config.present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+        else print_error("Unknown BOXEL_PRESENT_MODE %s", present_mode);
+    }
+    const char *image_count = getenv("BOXEL_SWAPCHAIN_IMAGES");
+    if (image_count) present_config.image_count = (uint32_t)strtoul(image_count, 0, 10);
+    const char *low_latency = getenv("BOXEL_LOW_LATENCY");
+    present_config.low_latency = low_latency && strcmp(low_latency, "0") != 0;
+    const char *latency_slack = getenv("BOXEL_LATENCY_SLACK_US");
+    if (latency_slack) present_config.latency_slack_ns = strtoull(latency_slack, 0, 10)*1000ull;
+
+    // BOXEL_DEVICE=N or BOXEL_DEVICE=name picks a GPU from the startup log over the highest scored one.
+    const char *device_override = getenv("BOXEL_DEVICE");
+    if (!vulkan_backend_init(&renderer->vk, &renderer->transient_arena, window, width, height, lane_count, device_override, &present_config)) return false;
+    // SPIR-V comes from BOXEL_SHADER_DIR, the shaders directory next to the
+    // executable by default, and is reloaded when it changes there. An empty
+    // BOXEL_SHADER_DIR keeps the shaders embedded at build time.
+    vulkan_shader_registry_open(&renderer->vk.shaders, getenv("BOXEL_SHADER_DIR"));
+    if (!vulkan_backend_create_render_graph(&renderer->vk)) return false;
+    const char *trace = getenv("BOXEL_TRACE");
+    if (trace) vulkan_profiler_open_trace(&renderer->vk, trace);
+    const char *bench_dispatch = getenv("BOXEL_BENCH_DISPATCH");
+    if (bench_dispatch) vulkan_backend_bench_dispatch(&renderer->vk, (uint32_t)strtoul(bench_dispatch, 0, 10));
     if (!vulkan_backend_create_final_stage(&renderer->vk, &renderer->transient_arena)) return false;
+
+    if (!vulkan_backend_create_chunk_stage(&renderer->vk, &renderer->transient_arena)) return false;
+    if (!vulkan_backend_create_light_stage(&renderer->vk, &renderer->transient_arena)) return false;
+    if (!vulkan_backend_create_shadow_stage(&renderer->vk, &renderer->transient_arena)) return false;
+    if (!vulkan_backend_create_far_field_stage(&renderer->vk, &renderer->transient_arena)) return false;
+
+    // The scene renders at whatever fraction of the window holds the GPU frame
+    // time at BOXEL_DYNRES_TARGET_MS, the refresh interval by default, between
+    // BOXEL_DYNRES_MIN and BOXEL_DYNRES_MAX. BOXEL_DYNRES=0 keeps it at the
+    // maximum, BOXEL_SHARPNESS sets how hard the upscale sharpens.
+    Vulkan_Resolution_Config resolution_config = {};
+    const char *dynres = getenv("BOXEL_DYNRES");
+    resolution_config.enabled = !dynres || strcmp(dynres, "0") != 0;
+    resolution_config.min_scale = 0.5f;
+    resolution_config.max_scale = 1.0f;
+    resolution_config.sharpness = 0.5f;
+    const char *dynres_target = getenv("BOXEL_DYNRES_TARGET_MS");
+    if (dynres_target) resolution_config.target_ms = strtof(dynres_target, 0);
+    const char *dynres_min = getenv("BOXEL_DYNRES_MIN");
+    if (dynres_min) resolution_config.min_scale = strtof(dynres_min, 0);
+    const char *dynres_max = getenv("BOXEL_DYNRES_MAX");
+    if (dynres_max) resolution_config.max_scale = strtof(dynres_max, 0);
+    const char *sharpness = getenv("BOXEL_SHARPNESS");
+    if (sharpness) resolution_config.sharpness = strtof(sharpness, 0);
+    if (resolution_config.max_scale > 1.0f || resolution_config.max_scale < 0.25f) resolution_config.max_scale = 1.0f;
+    if (resolution_config.min_scale < 0.25f) resolution_config.min_scale = 0.25f;
+    if (resolution_config.min_scale > resolution_config.max_scale) resolution_config.min_scale = resolution_config.max_scale;
+    if (!vulkan_backend_create_upscale_stage(&renderer->vk, &renderer->transient_arena, &resolution_config)) return false;
+    if (!vulkan_backend_create_hiz_stage(&renderer->vk, &renderer->transient_arena)) return false;
+    if (!vulkan_backend_create_particle_stage(&renderer->vk, &renderer->transient_arena)) return false;
+
+    float identity[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+    renderer_set_camera(renderer, identity);
+
+    // BOXEL_BENCH_DRAWS=N uploads N single cube chunks to load the GPU culling and chunk draws.
+    const char *bench_draws = getenv("BOXEL_BENCH_DRAWS");
+    if (bench_draws) {
+        renderer->bench_chunk_count = (uint32_t)strtoul(bench_draws, 0, 10);
+        if (renderer->bench_chunk_count > VULKAN_MAX_CHUNKS) renderer->bench_chunk_count = VULKAN_MAX_CHUNKS;
+    }
+
+    // BOXEL_BENCH_FAR=N raymarches N far chunks of hills, up to VULKAN_FAR_MAX_CHUNKS.
+    const char *bench_far = getenv("BOXEL_BENCH_FAR");
+    if (bench_far) {
+        renderer->bench_far_count = (uint32_t)strtoul(bench_far, 0, 10);
+        if (renderer->bench_far_count > VULKAN_FAR_MAX_CHUNKS) renderer->bench_far_count = VULKAN_FAR_MAX_CHUNKS;
+    }
+
+    // BOXEL_BENCH_PARTICLES=N keeps about N particles alive, up to VULKAN_MAX_PARTICLES.
+    const char *bench_particles = getenv("BOXEL_BENCH_PARTICLES");
+    if (bench_particles) {
+        uint32_t particle_count = (uint32_t)strtoul(bench_particles, 0, 10);
+        renderer_create_bench_particles(renderer, particle_count < VULKAN_MAX_PARTICLES ? particle_count : VULKAN_MAX_PARTICLES);
+    }
+
+    // BOXEL_BENCH_LIGHTS=N scatters N point lights, up to VULKAN_MAX_LIGHTS.
+    const char *bench_lights = getenv("BOXEL_BENCH_LIGHTS");
+    if (bench_lights) {
+        uint32_t light_count = (uint32_t)strtoul(bench_lights, 0, 10);
+        renderer_create_bench_lights(renderer, light_count < VULKAN_MAX_LIGHTS ? light_count : VULKAN_MAX_LIGHTS);
+    }
     return true;
 }
 
+// Every lane, after renderer_init succeeded on lane 0.
+void renderer_compile_pipelines(Renderer_State *renderer, uint32_t lane_index) {
+    vulkan_pipeline_batch_compile(&renderer->vk, lane_index);
+}
+
+// Lane 0 only, after every lane has finished renderer_compile_pipelines. The
+// renderer can draw once this returns true.
+bool renderer_finish_init(Renderer_State *renderer) {
+    if (!vulkan_pipeline_batch_finish(&renderer->vk)) return false;
+    print_info("Renderer initialized in %.2f ms with a %s pipeline cache",
+               (double)(get_time_ns() - renderer->init_begin_ns) / 1000000.0, renderer->vk.pipeline_cache_warm ? "warm" : "cold");
+    return true;
+}
+
+// Lane 0 only, before the platform samples input for the next frame. Blocks
+// in low latency mode so the frame starts just in time for its vblank.
+void renderer_wait_for_frame(Renderer_State *renderer) {
+    vulkan_backend_pace_frame(&renderer->vk);
+}
+
+// Lane 0 only, with the window's client size. The swapchain follows at the
+// next renderer_begin_frame, a zero size skips frames until it grows again.
+void renderer_resize(Renderer_State *renderer, int width, int height) {
+    if (width == renderer->width && height == renderer->height) return;
+    renderer->width = width;
+    renderer->height = height;
+    renderer->vk.swapchain_dirty = true;
+}
+
+// Lane 0 only.
+void renderer_begin_frame(Renderer_State *renderer) {
+    renderer->frame_active = vulkan_backend_begin_frame(&renderer->vk, renderer->width, renderer->height);
+    if (renderer->frame_active) {
+        renderer_upload_bench_chunks(renderer);
+        renderer_upload_bench_far_chunks(renderer);
+    }
+}
+
+// Every lane, after renderer_begin_frame.
+void renderer_record(Renderer_State *renderer, uint32_t lane_index) {
+    if (renderer->frame_active) vulkan_backend_record_lane(&renderer->vk, lane_index);
+}
+
+// Lane 0 only, after every lane has finished renderer_record. Returns false
+// when the frame couldn't be submitted, its swapchain image is never presented
+// then, or when the swapchain can't be recreated. Rendering can't go on.
+bool renderer_end_frame(Renderer_State *renderer) {
+    Vulkan_State *vk = &renderer->vk;
+    if (!renderer->frame_active) return !vk->swapchain_failed;
+    vulkan_backend_record_final_stage(vk, &renderer->transient_arena, vk->frames[vk->frame_index].command_buffer);
+    return vulkan_backend_end_frame(vk);
+}
+
+void renderer_shutdown(Renderer_State *renderer) {
+    vulkan_backend_shutdown(&renderer->vk);
+}
+
 #if 0
 
 void draw_circle();
@@ -29,8 +359,4 @@ void draw_line();
 void draw_rectangle();
 void draw_mesh();
 
-Texture_Handle create_texture();
-
-Buffer_Handle create_mesh();
-
 #endif
\ No newline at end of file
@@ -1,8 +1,26 @@
 #if !defined(RENDERER_FRONTEND_H)
 #define RENDERER_FRONTEND_H
 
+// Index into the bindless tables plus the generation it was created with.
+// Shaders take the index, the generation only guards the CPU side.
+typedef struct {
+    uint32_t index;
+    uint32_t generation;
+} Texture_Handle;
+typedef struct {
+    uint32_t index;
+    uint32_t generation;
+} Buffer_Handle;
+
 typedef struct {
     Fixed_Arena transient_arena;
+    int width, height;
+    bool frame_active;
+    uint64_t init_begin_ns;
+    uint32_t bench_chunk_count;
+    uint32_t bench_chunks_uploaded;
+    uint32_t bench_far_count;
+    uint32_t bench_far_uploaded;
     union {
         Vulkan_State vk;
     };
@@ -0,0 +1,109 @@
+#version 450
+
+layout(location = 0) in vec3 frag_color;
+layout(location = 1) in vec3 frag_normal;
+layout(location = 2) in vec3 frag_world;
+
+// Must match Vulkan_Light in vulkan_backend.h
+struct Light {
+    vec3 position;
+    float radius;
+    vec3 color;
+    float pad;
+};
+
+// Must match the VULKAN_LIGHT_ defines.
+const uint CLUSTERS_X = 16;
+const uint CLUSTERS_Y = 9;
+const uint CLUSTERS_Z = 24;
+const uint CLUSTER_COUNT = CLUSTERS_X*CLUSTERS_Y*CLUSTERS_Z;
+const float DEPTH_NEAR = 0.5;
+const float DEPTH_FAR = 1024.0;
+
+layout(set = 0, binding = 6) uniform sampler2DShadow shadow_atlas;
+layout(std430, set = 0, binding = 7) readonly buffer Lights { Light lights[]; };
+// Must match Vulkan_Light_Clusters in vulkan_backend.h
+layout(std430, set = 0, binding = 8) readonly buffer Light_Clusters {
+    uint index_count;
+    uint dropped;
+    uint pad0;
+    uint pad1;
+    uvec2 clusters[CLUSTER_COUNT];      // first index, light count
+    uint indices[];
+};
+
+// Must match Vulkan_Chunk_Constants in vulkan_backend.h
+layout(push_constant) uniform Push {
+    mat4 view_proj;
+    ivec2 shadow_origins[4];
+    vec2 cluster_scale;
+} push;
+
+layout(location = 0) out vec4 final_color;
+
+// Must match the VULKAN_SHADOW_ defines and the basis vulkan_backend_create_shadow_stage builds.
+const int SHADOW_CASCADES = 4;
+const int SHADOW_TILES = 4;
+const float SHADOW_TILE_TEXELS = 512.0;
+const float SHADOW_ATLAS_TEXELS = 4096.0;
+const float SHADOW_TILE_WORLD = 32.0;
+const float SHADOW_DEPTH_RANGE = 16384.0;
+const vec3 LIGHT_DIR = normalize(vec3(0.4, 1.0, 0.3));
+const vec3 LIGHT_RIGHT = normalize(vec3(LIGHT_DIR.z, 0.0, -LIGHT_DIR.x));
+const vec3 LIGHT_UP = cross(LIGHT_DIR, LIGHT_RIGHT);
+
+// The first cascade with a tile under the point decides. The point is pushed
+// out along the normal by a bit more than a texel instead of biasing depth.
+float shadow(vec3 world, vec3 normal) {
+    for (int cascade = 0; cascade < SHADOW_CASCADES; ++cascade) {
+        float tile_world = SHADOW_TILE_WORLD*float(1 << (2*cascade));
+        vec3 position = world + normal*(tile_world / SHADOW_TILE_TEXELS)*1.5;
+        vec2 light_tiles = vec2(dot(position, LIGHT_RIGHT), dot(position, LIGHT_UP)) / tile_world;
+        ivec2 tile = ivec2(floor(light_tiles));
+        ivec2 offset = tile - push.shadow_origins[cascade];
+        if (any(lessThan(offset, ivec2(0))) || any(greaterThanEqual(offset, ivec2(SHADOW_TILES)))) continue;
+
+        // Neighbouring tiles aren't neighbours in the atlas once they wrap,
+        // so the filter stays half a texel inside.
+        ivec2 slot = tile & (SHADOW_TILES - 1);
+        vec2 local = clamp((light_tiles - vec2(tile))*SHADOW_TILE_TEXELS, vec2(0.5), vec2(SHADOW_TILE_TEXELS - 0.5));
+        vec2 quadrant = vec2(cascade & 1, cascade >> 1)*float(SHADOW_TILES)*SHADOW_TILE_TEXELS;
+        vec2 texel = quadrant + vec2(slot)*SHADOW_TILE_TEXELS + local;
+        float depth = 0.5 - dot(position, LIGHT_DIR) / (2.0*SHADOW_DEPTH_RANGE);
+        return texture(shadow_atlas, vec3(texel / SHADOW_ATLAS_TEXELS, depth));
+    }
+    return 1.0;
+}
+
+// Same as in light_cull.comp.
+uint depth_slice(float depth) {
+    if (depth < DEPTH_NEAR) return 0;
+    float slice = log(depth / DEPTH_NEAR) / log(DEPTH_FAR / DEPTH_NEAR)*float(CLUSTERS_Z - 2);
+    return min(1 + uint(slice), CLUSTERS_Z - 1);
+}
+
+// Only the lights light_cull.comp listed for this fragment's cluster. They
+// fade out smoothly to nothing at their radius and cast no shadows.
+vec3 point_lights(vec3 world, vec3 normal) {
+    uvec2 tile = min(uvec2(gl_FragCoord.xy*push.cluster_scale), uvec2(CLUSTERS_X - 1, CLUSTERS_Y - 1));
+    uint slice = depth_slice(1.0 / gl_FragCoord.w);
+    uvec2 cluster = clusters[(slice*CLUSTERS_Y + tile.y)*CLUSTERS_X + tile.x];
+    vec3 total = vec3(0.0);
+    for (uint entry = 0; entry < cluster.y; ++entry) {
+        Light light = lights[indices[cluster.x + entry]];
+        vec3 to_light = light.position - world;
+        float distance_squared = dot(to_light, to_light);
+        float fade = clamp(1.0 - distance_squared / (light.radius*light.radius), 0.0, 1.0);
+        if (fade == 0.0) continue;
+        float facing = max(dot(normal, to_light*inversesqrt(distance_squared)), 0.0);
+        total += light.color*(fade*fade*facing);
+    }
+    return total;
+}
+
+void main() {
+    float lit = max(dot(frag_normal, LIGHT_DIR), 0.0);
+    if (lit > 0.0) lit *= shadow(frag_world, frag_normal);
+    float diffuse = lit*0.8 + 0.2;
+    final_color = vec4(frag_color*(diffuse + point_lights(frag_world, frag_normal)), 1.0);
+}
@@ -0,0 +1,54 @@
+#version 450
+
+// Must match Vulkan_Chunk_Info in vulkan_backend.h
+struct Chunk_Info {
+    ivec3 position;
+    uint quad_offset;
+    uint quad_count;
+    uint bounds_min;
+    uint bounds_max;
+    uint pad;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Quads { uvec2 quads[]; };
+layout(std430, set = 0, binding = 1) readonly buffer Chunk_Infos { Chunk_Info chunk_infos[]; };
+
+layout(push_constant) uniform Push { mat4 view_proj; } push;
+
+// The depth prepass computes the same position in chunk_depth.vert and the
+// opaque pass tests EQUAL against it.
+invariant gl_Position;
+
+layout(location = 0) out vec3 frag_color;
+layout(location = 1) out vec3 frag_normal;
+layout(location = 2) out vec3 frag_world;
+
+const int CHUNK_SIZE = 32;
+
+// +x -x +y -y +z -z
+const vec3 normals[6] = vec3[](vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1));
+const vec2 corners[6] = vec2[](vec2(0, 0), vec2(1, 0), vec2(0, 1), vec2(0, 1), vec2(1, 0), vec2(1, 1));
+
+void main() {
+    // firstVertex is quad_offset*6 so the vertex index addresses the quad directly.
+    uvec2 quad = quads[gl_VertexIndex / 6];
+    vec2 corner = corners[gl_VertexIndex % 6];
+
+    // x y z is the face's minimum corner, width and height run along the other two axes.
+    vec3 local = vec3(quad.x & 63u, (quad.x >> 6) & 63u, (quad.x >> 12) & 63u);
+    uint face = (quad.x >> 18) & 7u;
+    float width = float(((quad.x >> 21) & 31u) + 1u);
+    float height = float(((quad.x >> 26) & 31u) + 1u);
+    uint axis = face >> 1;
+    vec3 u_axis = axis == 0u ? vec3(0, 1, 0) : axis == 1u ? vec3(0, 0, 1) : vec3(1, 0, 0);
+    vec3 v_axis = axis == 0u ? vec3(0, 0, 1) : axis == 1u ? vec3(1, 0, 0) : vec3(0, 1, 0);
+    vec3 position = local + u_axis*corner.x*width + v_axis*corner.y*height;
+
+    vec3 world = vec3(chunk_infos[gl_InstanceIndex].position*CHUNK_SIZE) + position;
+    gl_Position = push.view_proj*vec4(world, 1.0);
+
+    uint material = quad.y & 0xffffu;
+    frag_color = vec3(float(material & 31u), float((material >> 5) & 31u), float((material >> 10) & 31u)) / 31.0;
+    frag_normal = normals[face];
+    frag_world = world;
+}
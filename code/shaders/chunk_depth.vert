@@ -0,0 +1,41 @@
+#version 450
+
+// Must match Vulkan_Chunk_Info in vulkan_backend.h
+struct Chunk_Info {
+    ivec3 position;
+    uint quad_offset;
+    uint quad_count;
+    uint bounds_min;
+    uint bounds_max;
+    uint pad;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Quads { uvec2 quads[]; };
+layout(std430, set = 0, binding = 1) readonly buffer Chunk_Infos { Chunk_Info chunk_infos[]; };
+
+layout(push_constant) uniform Push { mat4 view_proj; } push;
+
+// Has to come out bit for bit the same as chunk.vert, the opaque pass tests EQUAL.
+invariant gl_Position;
+
+const int CHUNK_SIZE = 32;
+
+const vec2 corners[6] = vec2[](vec2(0, 0), vec2(1, 0), vec2(0, 1), vec2(0, 1), vec2(1, 0), vec2(1, 1));
+
+// Position only version of chunk.vert, the material half of the quad is never read.
+void main() {
+    uint quad = quads[gl_VertexIndex / 6].x;
+    vec2 corner = corners[gl_VertexIndex % 6];
+
+    vec3 local = vec3(quad & 63u, (quad >> 6) & 63u, (quad >> 12) & 63u);
+    uint face = (quad >> 18) & 7u;
+    float width = float(((quad >> 21) & 31u) + 1u);
+    float height = float(((quad >> 26) & 31u) + 1u);
+    uint axis = face >> 1;
+    vec3 u_axis = axis == 0u ? vec3(0, 1, 0) : axis == 1u ? vec3(0, 0, 1) : vec3(1, 0, 0);
+    vec3 v_axis = axis == 0u ? vec3(0, 0, 1) : axis == 1u ? vec3(1, 0, 0) : vec3(0, 1, 0);
+    vec3 position = local + u_axis*corner.x*width + v_axis*corner.y*height;
+
+    vec3 world = vec3(chunk_infos[gl_InstanceIndex].position*CHUNK_SIZE) + position;
+    gl_Position = push.view_proj*vec4(world, 1.0);
+}
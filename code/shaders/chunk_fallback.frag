@@ -0,0 +1,11 @@
+#version 450
+
+layout(location = 0) in vec3 frag_color;
+layout(location = 1) in vec3 frag_normal;
+
+layout(location = 0) out vec4 final_color;
+
+// Drawn while the real chunk pipeline is still compiling.
+void main() {
+    final_color = vec4(frag_color*0.5, 1.0);
+}
@@ -0,0 +1,15 @@
+#version 450
+
+layout(set = 0, binding = 6) uniform sampler2D far_color;
+layout(set = 0, binding = 7) uniform sampler2D far_depth;
+
+layout(location = 0) out vec4 final_color;
+
+// The depth test keeps whatever the meshes drew in front.
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(far_depth, pixel, 0).r;
+    if (depth >= 1.0) discard;
+    gl_FragDepth = depth;
+    final_color = texelFetch(far_color, pixel, 0);
+}
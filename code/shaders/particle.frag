@@ -0,0 +1,12 @@
+#version 450
+
+layout(location = 0) in vec4 frag_color;
+layout(location = 1) in vec2 frag_offset;
+
+layout(location = 0) out vec4 final_color;
+
+void main() {
+    float alpha = frag_color.a*(1.0 - smoothstep(0.5, 1.0, length(frag_offset)));
+    if (alpha < 1.0/255.0) discard;
+    final_color = vec4(frag_color.rgb, alpha);
+}
@@ -0,0 +1,38 @@
+#version 450
+
+layout(std430, set = 0, binding = 0) readonly buffer Positions { vec4 positions[]; };
+layout(std430, set = 0, binding = 1) readonly buffer Velocities { vec4 velocities[]; };
+layout(std430, set = 0, binding = 2) readonly buffer Looks { uvec2 looks[]; };
+layout(std430, set = 0, binding = 4) readonly buffer Alive_Lists { uint alive_lists[]; };
+
+// Must match Vulkan_Particle_Draw_Constants in vulkan_backend.h
+layout(push_constant) uniform Push {
+    mat4 view_proj;
+    uint alive_offset;
+} push;
+
+layout(location = 0) out vec4 frag_color;
+layout(location = 1) out vec2 frag_offset;
+
+const vec2 corners[6] = vec2[](vec2(-1, -1), vec2(1, -1), vec2(-1, 1), vec2(-1, 1), vec2(1, -1), vec2(1, 1));
+
+void main() {
+    // One instance per particle in the list the simulation compacted into.
+    uint index = alive_lists[push.alive_offset + uint(gl_InstanceIndex)];
+    vec4 position = positions[index];
+    vec2 corner = corners[gl_VertexIndex];
+
+    // The first two rows of view_proj point along the screen's x and y in
+    // world space, so the quad always faces the camera.
+    vec3 right = normalize(vec3(push.view_proj[0][0], push.view_proj[1][0], push.view_proj[2][0]));
+    vec3 up = normalize(vec3(push.view_proj[0][1], push.view_proj[1][1], push.view_proj[2][1]));
+    vec3 world = position.xyz + (right*corner.x + up*corner.y)*position.w*0.5;
+    gl_Position = push.view_proj*vec4(world, 1.0);
+
+    // Fades out over the last quarter of its life.
+    uvec2 look = looks[index];
+    float life = velocities[index].w*unpackHalf2x16(look.y).y;
+    frag_color = unpackUnorm4x8(look.x);
+    frag_color.a *= clamp(life*4.0, 0.0, 1.0);
+    frag_offset = corner;
+}
@@ -0,0 +1,32 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform sampler2D scene_color;
+
+layout(push_constant) uniform Constants {
+    vec2 output_size;
+    float sharpness;
+} constants;
+
+layout(location = 0) out vec4 final_color;
+
+// Bilinear from the render extent, then an unsharp mask against the four
+// neighbours one source texel away. The result is clamped to their range so
+// edges don't ring.
+void main() {
+    vec2 uv = gl_FragCoord.xy / constants.output_size;
+    vec3 center = texture(scene_color, uv).rgb;
+    if (constants.sharpness <= 0.0) {
+        final_color = vec4(center, 1.0);
+        return;
+    }
+    vec2 texel = 1.0 / vec2(textureSize(scene_color, 0));
+    vec3 left = texture(scene_color, uv - vec2(texel.x, 0.0)).rgb;
+    vec3 right = texture(scene_color, uv + vec2(texel.x, 0.0)).rgb;
+    vec3 up = texture(scene_color, uv - vec2(0.0, texel.y)).rgb;
+    vec3 down = texture(scene_color, uv + vec2(0.0, texel.y)).rgb;
+    vec3 lowest = min(center, min(min(left, right), min(up, down)));
+    vec3 highest = max(center, max(max(left, right), max(up, down)));
+    vec3 blurred = (left + right + up + down)*0.25;
+    vec3 sharpened = center + (center - blurred)*constants.sharpness;
+    final_color = vec4(clamp(sharpened, lowest, highest), 1.0);
+}
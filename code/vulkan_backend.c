@@ -1,7 +1,15 @@
 
 bool vulkan_backend_create_instance(Vulkan_State *vk, const char **layers, int layer_count, const char **extensions, int extension_count) {
+    // 1.2 for timeline semaphores
+    VkApplicationInfo app_info = {};
+    app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app_info.pApplicationName = "Boxel";
+    app_info.pEngineName = "Boxel";
+    app_info.apiVersion = VK_API_VERSION_1_2;
+
     VkInstanceCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    create_info.pApplicationInfo = &app_info;
     create_info.enabledLayerCount = layer_count;
     create_info.ppEnabledLayerNames = layers;
     create_info.enabledExtensionCount = extension_count;
@@ -72,6 +80,33 @@ bool vulkan_backend_check_present_mode(Fixed_Arena *arena, VkPhysicalDevice devi
     return result;
 }
 
+// The configured mode first, then the default order for the deployment. Low
+// latency wants FIFO when it can pace on present waits, otherwise a mode that
+// never blocks on the vblank. FIFO is the last resort every device has.
+void vulkan_backend_choose_present_mode(Vulkan_State *vk, Fixed_Arena *arena) {
+    VkPresentModeKHR paced[] = { VK_PRESENT_MODE_FIFO_KHR };
+    VkPresentModeKHR unpaced[] = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_FIFO_KHR };
+    bool pace = vk->present_config.low_latency && vk->pacing.present_wait;
+    VkPresentModeKHR *order = pace ? paced : unpaced;
+    uint32_t order_count = pace ? array_count(paced) : array_count(unpaced);
+
+    vk->present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    VkPresentModeKHR configured = vk->present_config.present_mode;
+    if (configured != VK_PRESENT_MODE_MAX_ENUM_KHR && vulkan_backend_check_present_mode(arena, vk->phys_device, vk->surface, configured)) {
+        vk->present_mode = configured;
+    } else {
+        if (configured != VK_PRESENT_MODE_MAX_ENUM_KHR) print_info("Present mode %d is not supported, falling back", configured);
+        for (uint32_t mode_idx = 0; mode_idx < order_count; ++mode_idx) {
+            if (vulkan_backend_check_present_mode(arena, vk->phys_device, vk->surface, order[mode_idx])) {
+                vk->present_mode = order[mode_idx];
+                break;
+            }
+        }
+    }
+    if (vk->present_config.low_latency && !vk->pacing.present_wait) print_info("No VK_KHR_present_wait, low latency runs without pacing");
+    print_info("Presenting with mode %d%s", vk->present_mode, vk->pacing.present_wait ? ", paced on present waits" : "");
+}
+
 bool vulkan_backend_check_formats(Fixed_Arena *arena, VkPhysicalDevice device, VkSurfaceKHR surface, VkFormat format, VkColorSpaceKHR color_space) {
     Scratch_Arena scratch = arena_begin_scratch(arena);
     bool result = false;
@@ -89,14 +124,142 @@ bool vulkan_backend_check_formats(Fixed_Arena *arena, VkPhysicalDevice device, V
     return result;
 }
 
-bool vulkan_backend_select_device(Vulkan_State *vk, Fixed_Arena *arena, VkFormat image_format, VkColorSpaceKHR color_space, VkPresentModeKHR present_mode) {
+// Fills in everything select_device needs to rank a GPU and create a device
+// on it. Returns false with a reason when the renderer can't run on it.
+bool vulkan_backend_evaluate_device(Vulkan_State *vk, Fixed_Arena *arena, VkPhysicalDevice phys_device, VkFormat image_format, VkColorSpaceKHR color_space,
+                                    Vulkan_Device_Candidate *candidate, const char **reason) {
+    Scratch_Arena scratch = arena_begin_scratch(arena);
+    *candidate = (Vulkan_Device_Candidate){};
+    candidate->phys_device = phys_device;
+    vkGetPhysicalDeviceProperties(phys_device, &candidate->properties);
+
+    uint32_t queue_family_count;
+    vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, 0);
+    VkQueueFamilyProperties *queue_properties = push_array(scratch.arena, VkQueueFamilyProperties, queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, queue_properties);
+
+    // Presenting from the graphics family is preferred, it saves an ownership transfer.
+    candidate->graphics_family = UINT32_MAX;
+    candidate->present_family = UINT32_MAX;
+    candidate->compute_family = UINT32_MAX;
+    candidate->transfer_family = UINT32_MAX;
+    for (uint32_t family_idx = 0; family_idx < queue_family_count; ++family_idx) {
+        VkQueueFlags flags = queue_properties[family_idx].queueFlags;
+        VkBool32 present_support = false;
+        vkGetPhysicalDeviceSurfaceSupportKHR(phys_device, family_idx, vk->surface, &present_support);
+        bool graphics = (flags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        if (graphics && candidate->graphics_family == UINT32_MAX) candidate->graphics_family = family_idx;
+        if (present_support && (candidate->present_family == UINT32_MAX || (graphics && family_idx == candidate->graphics_family))) {
+            candidate->present_family = family_idx;
+        }
+        // Compute without graphics runs next to the graphics queue, transfer
+        // only (and sparse) is usually a dedicated DMA engine.
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !graphics && candidate->compute_family == UINT32_MAX) candidate->compute_family = family_idx;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) && candidate->transfer_family == UINT32_MAX) {
+            candidate->transfer_family = family_idx;
+        }
+    }
+
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(phys_device, &memory_properties);
+    for (uint32_t heap_idx = 0; heap_idx < memory_properties.memoryHeapCount; ++heap_idx) {
+        VkMemoryHeap heap = memory_properties.memoryHeaps[heap_idx];
+        if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && heap.size > candidate->device_local_bytes) candidate->device_local_bytes = heap.size;
+    }
+
+    // Only low latency paces on presents, nothing else needs the extensions.
+    VkPhysicalDevicePresentWaitFeaturesKHR supported_present_wait = {};
+    supported_present_wait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    VkPhysicalDevicePresentIdFeaturesKHR supported_present_id = {};
+    supported_present_id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    supported_present_id.pNext = &supported_present_wait;
+    const char *present_wait_extensions[] = { "VK_KHR_present_id", "VK_KHR_present_wait" };
+    bool has_present_wait_extensions = vk->present_config.low_latency &&
+        vulkan_backend_check_device_extensions(scratch.arena, phys_device, present_wait_extensions, array_count(present_wait_extensions));
+
+    VkPhysicalDeviceVulkan12Features supported_features12 = {};
+    supported_features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    if (has_present_wait_extensions) supported_features12.pNext = &supported_present_id;
+    VkPhysicalDeviceFeatures2 supported_features = {};
+    supported_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features.pNext = &supported_features12;
+    if (candidate->properties.apiVersion >= VK_API_VERSION_1_2) vkGetPhysicalDeviceFeatures2(phys_device, &supported_features);
+    bool has_features = supported_features12.timelineSemaphore &&
+                        supported_features12.runtimeDescriptorArray &&
+                        supported_features12.descriptorBindingPartiallyBound &&
+                        supported_features12.descriptorBindingSampledImageUpdateAfterBind &&
+                        supported_features12.descriptorBindingStorageBufferUpdateAfterBind &&
+                        supported_features12.shaderSampledImageArrayNonUniformIndexing &&
+                        supported_features12.shaderStorageBufferArrayNonUniformIndexing &&
+                        supported_features12.drawIndirectCount &&
+                        supported_features.features.multiDrawIndirect &&
+                        supported_features.features.drawIndirectFirstInstance;
+    candidate->has_present_wait = has_present_wait_extensions && supported_present_id.presentId && supported_present_wait.presentWait;
+    // Lines the GPU zones up with CPU time in traces, they still get measured without it.
+    const char *calibrated_extensions[] = { "VK_EXT_calibrated_timestamps" };
+    candidate->has_calibrated = vulkan_backend_check_device_extensions(scratch.arena, phys_device, calibrated_extensions, array_count(calibrated_extensions));
+
+    const char *required_extensions[] = { "VK_KHR_swapchain" };
+    *reason = 0;
+    if (candidate->properties.apiVersion < VK_API_VERSION_1_2) *reason = "needs Vulkan 1.2";
+    else if (candidate->graphics_family == UINT32_MAX) *reason = "no graphics queue";
+    else if (candidate->present_family == UINT32_MAX) *reason = "can't present to the window";
+    else if (!vulkan_backend_check_device_extensions(scratch.arena, phys_device, required_extensions, array_count(required_extensions))) *reason = "no VK_KHR_swapchain";
+    else if (!vulkan_backend_check_formats(scratch.arena, phys_device, vk->surface, image_format, color_space)) *reason = "no matching surface format";
+    else if (!has_features) *reason = "missing descriptor indexing, timeline or indirect features";
+
+    // The device type decides, everything else only breaks ties between GPUs of the same kind.
+    VkPhysicalDeviceLimits *limits = &candidate->properties.limits;
+    switch (candidate->properties.deviceType) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: candidate->score = 100000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: candidate->score = 50000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: candidate->score = 10000; break;
+        default: candidate->score = 0; break;
+    }
+    uint64_t device_local_mb = candidate->device_local_bytes >> 20;
+    candidate->score += (uint32_t)(device_local_mb < 65536 ? device_local_mb / 64 : 1024);
+    if (candidate->compute_family != UINT32_MAX) candidate->score += 500;
+    if (candidate->transfer_family != UINT32_MAX) candidate->score += 250;
+    if (candidate->present_family == candidate->graphics_family) candidate->score += 100;
+    if (candidate->has_present_wait) candidate->score += 50;
+    if (candidate->has_calibrated) candidate->score += 10;
+    candidate->score += limits->maxImageDimension2D / 1024 + limits->maxComputeSharedMemorySize / 4096;
+
+    arena_end_scratch(&scratch);
+    return *reason == 0;
+}
+
+// strstr ignoring ASCII case, so "nvidia" finds "NVIDIA GeForce RTX 3080".
+bool vulkan_name_contains(const char *name, const char *part) {
+    size_t part_len = strlen(part);
+    for (const char *start = name; ; ++start) {
+        size_t char_idx = 0;
+        while (char_idx < part_len && start[char_idx]) {
+            char a = start[char_idx];
+            char b = part[char_idx];
+            if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+            if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+            if (a != b) break;
+            char_idx += 1;
+        }
+        if (char_idx == part_len) return true;
+        if (!*start) return false;
+    }
+}
+
+// Every GPU is logged with what it offers and its score, the best one that
+// can run the renderer wins unless the override names a different usable one.
+// The override is either the index in this log or part of the device name in
+// any case.
+// The present mode is negotiated later by vulkan_backend_choose_present_mode,
+// FIFO is always there.
+bool vulkan_backend_select_device(Vulkan_State *vk, Fixed_Arena *arena, VkFormat image_format, VkColorSpaceKHR color_space, const char *device_override) {
 
     if (!vk->surface) {
         print_error("Failed to select device. No surface specified.");
         return false;
     }
 
-    bool result = false;
     Scratch_Arena scratch = arena_begin_scratch(arena);
 
     uint32_t device_count = 0;
@@ -104,82 +267,242 @@ bool vulkan_backend_select_device(Vulkan_State *vk, Fixed_Arena *arena, VkFormat
     VkPhysicalDevice *phys_devices = push_array(scratch.arena, VkPhysicalDevice, device_count);
     vkEnumeratePhysicalDevices(vk->instance, &device_count, phys_devices);
 
-    const char *device_extensions[] = { "VK_KHR_swapchain" };
+    uint32_t override_index = UINT32_MAX;
+    char *override_end = 0;
+    if (device_override) {
+        unsigned long index = strtoul(device_override, &override_end, 10);
+        if (override_end != device_override && *override_end == 0) override_index = (uint32_t)index;
+    }
 
+    static const char *device_types[] = { "other", "integrated", "discrete", "virtual", "cpu" };
+    Vulkan_Device_Candidate best = {};
+    Vulkan_Device_Candidate overridden = {};
+    bool found = false;
+    bool found_override = false;
     for (uint32_t device_idx = 0; device_idx < device_count; ++device_idx) {
-        VkPhysicalDevice candidate = phys_devices[device_idx];
-
-        uint32_t queue_family_count;
-        vkGetPhysicalDeviceQueueFamilyProperties(candidate, &queue_family_count, 0);
-        VkQueueFamilyProperties *queue_properties = push_array(scratch.arena, VkQueueFamilyProperties, queue_family_count);
-        vkGetPhysicalDeviceQueueFamilyProperties(candidate, &queue_family_count, queue_properties);
+        Vulkan_Device_Candidate candidate;
+        const char *reason = 0;
+        bool usable = vulkan_backend_evaluate_device(vk, scratch.arena, phys_devices[device_idx], image_format, color_space, &candidate, &reason);
+        VkPhysicalDeviceProperties *properties = &candidate.properties;
+        uint32_t type = properties->deviceType < array_count(device_types) ? properties->deviceType : 0;
+        print_info("GPU %u: %s (%s, Vulkan %u.%u.%u), %llu MB device local, %s compute, %s transfer, %s%sscore %u%s%s",
+                   device_idx, properties->deviceName, device_types[type],
+                   VK_API_VERSION_MAJOR(properties->apiVersion), VK_API_VERSION_MINOR(properties->apiVersion), VK_API_VERSION_PATCH(properties->apiVersion),
+                   (unsigned long long)(candidate.device_local_bytes >> 20),
+                   candidate.compute_family != UINT32_MAX ? "async" : "no async",
+                   candidate.transfer_family != UINT32_MAX ? "dedicated" : "no dedicated",
+                   candidate.has_present_wait ? "present wait, " : "", candidate.has_calibrated ? "calibrated timestamps, " : "",
+                   candidate.score, usable ? "" : ", unusable: ", usable ? "" : reason);
+        if (!usable) continue;
+        if (!found || candidate.score > best.score) best = candidate;
+        found = true;
+        bool matches_override = override_index != UINT32_MAX ? override_index == device_idx :
+                                device_override && vulkan_name_contains(properties->deviceName, device_override);
+        if (matches_override && !found_override) {
+            overridden = candidate;
+            found_override = true;
+        }
+    }
+    if (!found) {
+        print_error("No GPU can run the renderer");
+        arena_end_scratch(&scratch);
+        return false;
+    }
+    if (device_override && !found_override) print_error("No usable GPU matches BOXEL_DEVICE=%s, using the best one", device_override);
+    Vulkan_Device_Candidate *selected = found_override ? &overridden : &best;
 
-        uint32_t graphics_index = UINT32_MAX;
-        uint32_t present_index = UINT32_MAX;
-        VkBool32 present_support = false;
-        for (uint32_t family_idx = 0; family_idx < queue_family_count; ++family_idx) {
-            present_support = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(candidate, family_idx, vk->surface, &present_support);
-            if (queue_properties[family_idx].queueFlags &VK_QUEUE_GRAPHICS_BIT)
-                graphics_index = family_idx;
-            if (present_support)
-                present_index = family_idx;
-            if (graphics_index != UINT32_MAX && present_index != UINT32_MAX)
-                break;
+    float queue_priority = 1.0f;
+    uint32_t families[] = { selected->graphics_family, selected->present_family, selected->transfer_family, selected->compute_family };
+    VkDeviceQueueCreateInfo queue_create_infos[array_count(families)];
+    uint32_t queue_create_info_count = 0;
+    for (uint32_t family_idx = 0; family_idx < array_count(families); ++family_idx) {
+        bool unique = families[family_idx] != UINT32_MAX;
+        for (uint32_t other_idx = 0; other_idx < queue_create_info_count; ++other_idx) {
+            if (queue_create_infos[other_idx].queueFamilyIndex == families[family_idx]) unique = false;
         }
+        if (!unique) continue;
+        queue_create_infos[queue_create_info_count++] = (VkDeviceQueueCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = families[family_idx],
+            .queueCount = 1,
+            .pQueuePriorities = &queue_priority,
+        };
+    }
+
+    VkPhysicalDeviceVulkan12Features device_features12 = {};
+    device_features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    device_features12.timelineSemaphore = VK_TRUE;
+    device_features12.descriptorIndexing = VK_TRUE;
+    device_features12.runtimeDescriptorArray = VK_TRUE;
+    device_features12.descriptorBindingPartiallyBound = VK_TRUE;
+    device_features12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    device_features12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+    device_features12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    device_features12.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+    device_features12.drawIndirectCount = VK_TRUE;
 
-        bool has_queues = graphics_index != UINT32_MAX && present_index != UINT32_MAX;
-        bool has_extensions = vulkan_backend_check_device_extensions(arena, candidate, device_extensions, array_count(device_extensions));
-        bool has_formats = vulkan_backend_check_formats(arena, candidate, vk->surface, image_format, color_space);
-        bool has_present_mode = vulkan_backend_check_present_mode(arena, candidate, vk->surface, present_mode);
-        if (present_support && has_queues && has_extensions && has_formats && has_present_mode) {
-            float queue_priority = 1.0f;
+    const char *device_extensions[4];
+    uint32_t device_extension_count = 0;
+    device_extensions[device_extension_count++] = "VK_KHR_swapchain";
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = {};
+    present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    present_wait_features.presentWait = VK_TRUE;
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features = {};
+    present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_id_features.pNext = &present_wait_features;
+    present_id_features.presentId = VK_TRUE;
+    if (selected->has_present_wait) {
+        device_extensions[device_extension_count++] = "VK_KHR_present_id";
+        device_extensions[device_extension_count++] = "VK_KHR_present_wait";
+        device_features12.pNext = &present_id_features;
+    }
+    if (selected->has_calibrated) device_extensions[device_extension_count++] = "VK_EXT_calibrated_timestamps";
 
-            VkDeviceQueueCreateInfo queue_create_info = {0};
-            queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-            queue_create_info.queueFamilyIndex = graphics_index;
-            queue_create_info.queueCount = 1;
-            queue_create_info.pQueuePriorities = &queue_priority;
+    VkPhysicalDeviceFeatures2 device_features = {};
+    device_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    device_features.pNext = &device_features12;
+    device_features.features.samplerAnisotropy = VK_TRUE;
+    device_features.features.multiDrawIndirect = VK_TRUE;
+    device_features.features.drawIndirectFirstInstance = VK_TRUE;
 
-            VkPhysicalDeviceFeatures device_features = {};
-            device_features.samplerAnisotropy = VK_TRUE;
-            
-            VkDeviceCreateInfo device_create_info = {};
-            device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-            device_create_info.pQueueCreateInfos = &queue_create_info;
-            device_create_info.queueCreateInfoCount = 1;
-            device_create_info.pEnabledFeatures = &device_features;
-            device_create_info.ppEnabledExtensionNames = device_extensions;
-            device_create_info.enabledExtensionCount = array_count(device_extensions);
+    VkDeviceCreateInfo device_create_info = {};
+    device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_create_info.pNext = &device_features;
+    device_create_info.pQueueCreateInfos = queue_create_infos;
+    device_create_info.queueCreateInfoCount = queue_create_info_count;
+    device_create_info.ppEnabledExtensionNames = device_extensions;
+    device_create_info.enabledExtensionCount = device_extension_count;
 
-            if (vkCreateDevice(candidate, &device_create_info, 0, &vk->device) == VK_SUCCESS) {
-                vk->phys_device = candidate;
-                vkGetDeviceQueue(vk->device, graphics_index, 0, &vk->graphics_queue);
-                vkGetDeviceQueue(vk->device, present_index, 0, &vk->present_queue);
-                vk->image_format = image_format;
-                vk->color_space = color_space;
-                vk->present_mode = present_mode;
-                result = true;
-            }
+    if (vkCreateDevice(selected->phys_device, &device_create_info, 0, &vk->device) != VK_SUCCESS) {
+        print_error("Vulkan failed to create a device on %s", selected->properties.deviceName);
+        arena_end_scratch(&scratch);
+        return false;
+    }
+    vk->phys_device = selected->phys_device;
+    vk->graphics_family = selected->graphics_family;
+    vk->present_family = selected->present_family;
+    vk->transfer_family = selected->transfer_family;
+    vkGetDeviceQueue(vk->device, vk->graphics_family, 0, &vk->graphics_queue);
+    vkGetDeviceQueue(vk->device, vk->present_family, 0, &vk->present_queue);
+    vk->transfer_queue = VK_NULL_HANDLE;
+    if (vk->transfer_family != UINT32_MAX) vkGetDeviceQueue(vk->device, vk->transfer_family, 0, &vk->transfer_queue);
+    vk->compute_family = selected->compute_family;
+    vk->compute_queue = VK_NULL_HANDLE;
+    if (vk->compute_family != UINT32_MAX) vkGetDeviceQueue(vk->device, vk->compute_family, 0, &vk->compute_queue);
+    vk->image_format = image_format;
+    vk->color_space = color_space;
+    vk->pacing.present_wait = selected->has_present_wait;
+    vk->profiler.calibrated = selected->has_calibrated;
+    print_info("Selected %s%s", selected->properties.deviceName, found_override ? " from BOXEL_DEVICE" : "");
+
+    arena_end_scratch(&scratch);
+    return true;
+}
 
+// The cache file lives next to the executable. Data written by a different
+// driver or GPU is thrown away instead of being handed to the driver.
+bool vulkan_backend_load_pipeline_cache(Vulkan_State *vk) {
+    char directory[sizeof(vk->pipeline_cache_path) - sizeof(VULKAN_PIPELINE_CACHE_FILENAME) - 1];
+    if (!get_executable_directory(directory, sizeof(directory))) directory[0] = 0;
+    snprintf(vk->pipeline_cache_path, sizeof(vk->pipeline_cache_path), "%s%s" VULKAN_PIPELINE_CACHE_FILENAME,
+             directory, directory[0] ? "/" : "");
+
+    void *data = 0;
+    size_t size = 0;
+    FILE *file = fopen(vk->pipeline_cache_path, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        long file_size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (file_size > 0) {
+            data = malloc(file_size);
+            size = fread(data, 1, file_size, file);
         }
+        fclose(file);
+    }
 
+    vk->pipeline_cache_warm = false;
+    if (data && size >= sizeof(VkPipelineCacheHeaderVersionOne)) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(vk->phys_device, &properties);
+
+        VkPipelineCacheHeaderVersionOne header;
+        memcpy(&header, data, sizeof(header));
+        vk->pipeline_cache_warm =
+            header.headerSize >= sizeof(header) &&
+            header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+            header.vendorID == properties.vendorID &&
+            header.deviceID == properties.deviceID &&
+            memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+        if (!vk->pipeline_cache_warm) print_info("Discarding pipeline cache from another device or driver");
     }
-    arena_end_scratch(&scratch);
-    return result;
+
+    VkPipelineCacheCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    info.initialDataSize = vk->pipeline_cache_warm ? size : 0;
+    info.pInitialData = vk->pipeline_cache_warm ? data : 0;
+    VkResult result = vkCreatePipelineCache(vk->device, &info, 0, &vk->pipeline_cache);
+    free(data);
+    if (result != VK_SUCCESS) {
+        print_error("Vulkan failed to create pipeline cache");
+        return false;
+    }
+    return true;
+}
+
+// Written to a temporary file first so a crash mid write never leaves a
+// truncated cache behind.
+void vulkan_backend_save_pipeline_cache(Vulkan_State *vk) {
+    if (!vk->pipeline_cache) return;
+    size_t size = 0;
+    if (vkGetPipelineCacheData(vk->device, vk->pipeline_cache, &size, 0) != VK_SUCCESS || !size) return;
+    void *data = malloc(size);
+    if (vkGetPipelineCacheData(vk->device, vk->pipeline_cache, &size, data) == VK_SUCCESS) {
+        char temp_path[sizeof(vk->pipeline_cache_path) + 4];
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", vk->pipeline_cache_path);
+        FILE *file = fopen(temp_path, "wb");
+        if (file) {
+            bool written = fwrite(data, 1, size, file) == size;
+            written = fclose(file) == 0 && written;
+            if (written && replace_file(temp_path, vk->pipeline_cache_path)) {
+                print_info("Saved %zu bytes of pipeline cache", size);
+            } else {
+                print_error("Failed to write pipeline cache to %s", vk->pipeline_cache_path);
+                remove(temp_path);
+            }
+        }
+    }
+    free(data);
+    vkDestroyPipelineCache(vk->device, vk->pipeline_cache, 0);
+    vk->pipeline_cache = VK_NULL_HANDLE;
 }
 
+// Destroyed by vulkan_retired_destroy once the timeline reaches release_value.
+void vulkan_retire(Vulkan_State *vk, Vulkan_Retired retired) {
+    kabarr_append(&vk->retired, retired);
+}
+
+// Hands the current swapchain, if any, over as oldSwapchain and retires it
+// with its views. Returns false without touching anything while the window
+// has no area. A swapchain with more images than the arrays hold sets
+// swapchain_failed.
 bool vulkan_backend_create_swapchain(Vulkan_State *vk, uint32_t width, uint32_t height) {
     bool result = true;
     VkSurfaceCapabilitiesKHR capabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk->phys_device, vk->surface, &capabilities);
-    vk->extent = capabilities.currentExtent;
-    if (vk->extent.width == UINT32_MAX) {
-        vk->extent.width = clamp(width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
-        vk->extent.height = clamp(height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
+    VkExtent2D extent = capabilities.currentExtent;
+    if (extent.width == UINT32_MAX) {
+        extent.width = clamp(width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
+        extent.height = clamp(height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
     }
+    if (!extent.width || !extent.height) return false;
 
-    uint32_t image_count = clamp(3, capabilities.minImageCount, capabilities.maxImageCount);
+    // A max of 0 means no limit. Every extra image is another frame of latency.
+    uint32_t image_count = vk->present_config.image_count;
+    if (!image_count) image_count = vk->present_config.low_latency ? 2 : 3;
+    uint32_t max_image_count = capabilities.maxImageCount ? capabilities.maxImageCount : VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT;
+    if (max_image_count > VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT) max_image_count = VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT;
+    image_count = clamp(image_count, capabilities.minImageCount, max_image_count);
 
     VkSwapchainCreateInfoKHR info = {};
     info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -187,7 +510,7 @@ bool vulkan_backend_create_swapchain(Vulkan_State *vk, uint32_t width, uint32_t
     info.minImageCount = image_count;
     info.imageFormat = vk->image_format;
     info.imageColorSpace = vk->color_space;
-    info.imageExtent = vk->extent;
+    info.imageExtent = extent;
     info.imageArrayLayers = 1;
     info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
     info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -197,12 +520,34 @@ bool vulkan_backend_create_swapchain(Vulkan_State *vk, uint32_t width, uint32_t
     info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     info.presentMode = vk->present_mode;
     info.clipped = VK_TRUE;
-    info.oldSwapchain = VK_NULL_HANDLE;
-
-    if (vkCreateSwapchainKHR(vk->device, &info, 0, &vk->swapchain) == VK_SUCCESS) {
+    info.oldSwapchain = vk->swapchain;
 
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+    if (vkCreateSwapchainKHR(vk->device, &info, 0, &swapchain) == VK_SUCCESS) {
+        // The driver may hand out more images than requested. Clamping would
+        // let vkAcquireNextImageKHR return an index past the arrays. The old
+        // swapchain is retired either way, so there is nothing to go back to.
         uint32_t actual_image_count = 0;
-        vkGetSwapchainImagesKHR(vk->device, vk->swapchain, &actual_image_count, 0);
+        vkGetSwapchainImagesKHR(vk->device, swapchain, &actual_image_count, 0);
+        if (actual_image_count > VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT) {
+            print_error("Vulkan Swapchain has %u images, at most %u are supported", actual_image_count, VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT);
+            vkDestroySwapchainKHR(vk->device, swapchain, 0);
+            vk->swapchain_failed = true;
+            return false;
+        }
+
+        // The presentation engine isn't on the timeline, so the old swapchain
+        // gets a few more frames for its queued presents to finish.
+        if (vk->swapchain) {
+            for (uint32_t image_idx = 0; image_idx < vk->image_count; ++image_idx) {
+                vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Image_View, .release_value = vk->frame_number, .view = vk->color_image_views[image_idx] });
+                vk->color_image_views[image_idx] = VK_NULL_HANDLE;
+            }
+            vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Swapchain, .release_value = vk->frame_number + VULKAN_FRAMES_IN_FLIGHT, .swapchain = vk->swapchain });
+        }
+        vk->swapchain = swapchain;
+        vk->extent = extent;
+        vk->pacing.present_id = 0;
         vk->image_count = actual_image_count;
         vkGetSwapchainImagesKHR(vk->device, vk->swapchain, &actual_image_count, vk->images);
 
@@ -228,7 +573,7 @@ bool vulkan_backend_create_swapchain(Vulkan_State *vk, uint32_t width, uint32_t
             }
         }
 
-        print_info("Vulkan Swapchain created successfully.");
+        print_info("Vulkan Swapchain created successfully at %ux%u.", vk->extent.width, vk->extent.height);
 
     } else {
         print_error("Vulkan failed to create Swapchain.");
@@ -238,76 +583,21 @@ bool vulkan_backend_create_swapchain(Vulkan_State *vk, uint32_t width, uint32_t
     return result;
 }
 
-bool vulkan_backend_recreate_swapchain(Vulkan_State *vk, uint32_t width, uint32_t height) {
-    bool result = true;
-    for (uint32_t idx = 0; idx < vk->image_count; ++idx) {
-        vkDestroyFramebuffer(vk->device, vk->framebuffers[idx], 0);
-        vkDestroyImageView(vk->device, vk->color_image_views[idx], 0);
-    }
-    //vkDestroyImage(vk->device, vk->depth_image.image, 0);
-    //vkDestroyImageView(vk->device, vk->depth_image.view, 0);
-    vkDestroySwapchainKHR(vk->device, vk->swapchain, 0);
-    vulkan_backend_create_swapchain(vk, width, height);
-    return result;
+void vulkan_pipeline_info_init(Vulkan_Pipeline_Info *info, VkDevice device, VkPipelineCache cache) {
+    info->device = device;
+    info->cache = cache;
 }
 
-VkRenderPass vulkan_backend_create_render_pass(Vulkan_State *vk, VkFormat color_format) {
-    VkAttachmentDescription attachments[] = {
-        {
-            .format = color_format,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
-        },
-    };
-
-    VkAttachmentReference color_attachment_ref = {};
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-    VkSubpassDescription subpasses[] = {
-        {
-            .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-            .colorAttachmentCount = 1,
-            .pColorAttachments = &color_attachment_ref,
-        },
-    };
-
-    VkSubpassDependency dependencies[] = {
-        {
-            .srcSubpass = VK_SUBPASS_EXTERNAL,
-            .dstSubpass = 0,
-            .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-            .srcAccessMask = 0,
-            .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        },
-    };
-
-    VkRenderPassCreateInfo render_pass_info = {};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = array_count(attachments);
-    render_pass_info.pAttachments = attachments;
-    render_pass_info.subpassCount = array_count(subpasses);
-    render_pass_info.pSubpasses = subpasses;
-    render_pass_info.dependencyCount = array_count(dependencies);
-    render_pass_info.pDependencies = dependencies;
+#define VULKAN_HASH_SEED 0xcbf29ce484222325ull
 
-    VkRenderPass result;
-    if (vkCreateRenderPass(vk->device, &render_pass_info, 0, &result) != VK_SUCCESS) {
-        print_error("Vulkan failed to create render pass");
-        return VK_NULL_HANDLE;
+// FNV-1a, chain calls by passing the previous result as hash.
+uint64_t vulkan_hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t byte_idx = 0; byte_idx < size; ++byte_idx) {
+        hash ^= bytes[byte_idx];
+        hash *= 0x100000001b3ull;
     }
-
-    return result;
-}
-
-void vulkan_pipeline_info_init(Vulkan_Pipeline_Info *info, VkDevice device) {
-    info->device = device;
+    return hash;
 }
 
 VkShaderModule vulkan_create_shader_module(VkDevice device, uint8_t *bytecode, size_t size) {
@@ -315,49 +605,205 @@ VkShaderModule vulkan_create_shader_module(VkDevice device, uint8_t *bytecode, s
     info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     info.codeSize = size;
     info.pCode = (uint32_t *)bytecode;
-    VkShaderModule shader;
+    VkShaderModule shader = VK_NULL_HANDLE;
     if (vkCreateShaderModule(device, &info, 0, &shader) != VK_SUCCESS) {
         print_error("Failed to create shader module\n");
     }
     return shader;
 }
 
-bool vulkan_pipeline_info_add_vertex_shader(Vulkan_Pipeline_Info *info, uint8_t *spv, size_t len) {
-    VkShaderModule module = vulkan_create_shader_module(info->device, spv, len);
-    if (module == VK_NULL_HANDLE) {
-        print_error("Vulkan failed to create vertex shader");
-        return false;
+// A null directory means the shaders directory next to the executable, where
+// nob leaves the SPIR-V it compiles. An empty one, or a directory that isn't
+// there as in release builds, keeps every shader on its embedded SPIR-V.
+void vulkan_shader_registry_open(Vulkan_Shader_Registry *shaders, const char *directory) {
+    shaders->directory[0] = 0;
+    if (directory) {
+        snprintf(shaders->directory, sizeof(shaders->directory), "%s", directory);
+    } else {
+        char executable_directory[sizeof(shaders->directory) - sizeof("/shaders")];
+        if (get_executable_directory(executable_directory, sizeof(executable_directory))) {
+            snprintf(shaders->directory, sizeof(shaders->directory), "%s/shaders", executable_directory);
+        }
     }
-    Vulkan_Shader shader = { .type = Shader_Type_Vertex, .handle = module };
-    kabarr_append(&info->shaders, shader);
-    return true;
+    if (shaders->directory[0] && file_watch_open(&shaders->watch, shaders->directory)) {
+        print_info("Loading shaders from %s and watching it for changes", shaders->directory);
+    } else {
+        shaders->directory[0] = 0;
+    }
+}
+
+// Null unless the file holds something that looks like SPIR-V, so a broken
+// file never reaches the driver.
+uint8_t *vulkan_shader_read_file(Vulkan_Shader_Registry *shaders, const char *name, size_t *len) {
+    char path[sizeof(shaders->directory) + sizeof(shaders->sources[0].name) + sizeof("/.spv")];
+    snprintf(path, sizeof(path), "%s/%s.spv", shaders->directory, name);
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = 0;
+    if (file_size >= 20 && file_size % 4 == 0) {
+        data = malloc(file_size);
+        if (fread(data, 1, file_size, file) != (size_t)file_size || *(uint32_t *)data != 0x07230203u) {
+            free(data);
+            data = 0;
+        }
+    }
+    fclose(file);
+    *len = data ? (size_t)file_size : 0;
+    return data;
 }
 
-bool vulkan_pipeline_info_add_fragment_shader(Vulkan_Pipeline_Info *info, uint8_t *spv, size_t len) {
-    VkShaderModule module = vulkan_create_shader_module(info->device, spv, len);
+// Once per name, later calls return the same id. The registry keeps a copy
+// of the embedded SPIR-V, the arrays live on the stack of whoever included
+// the header.
+uint32_t vulkan_shader_registry_add(Vulkan_Shader_Registry *shaders, const char *name, uint8_t *embedded, size_t embedded_len) {
+    for (uint32_t source_idx = 0; source_idx < shaders->count; ++source_idx) {
+        if (strcmp(shaders->sources[source_idx].name, name) == 0) return source_idx;
+    }
+    if (shaders->count >= VULKAN_MAX_SHADER_SOURCES || strlen(name) >= sizeof(shaders->sources[0].name)) {
+        print_error("Vulkan shader registry has no room for %s", name);
+        return VULKAN_SHADER_NONE;
+    }
+    Vulkan_Shader_Source *source = &shaders->sources[shaders->count];
+    *source = (Vulkan_Shader_Source){};
+    snprintf(source->name, sizeof(source->name), "%s", name);
+    if (shaders->directory[0]) source->spv = vulkan_shader_read_file(shaders, name, &source->len);
+    source->from_file = source->spv != 0;
+    if (!source->spv) {
+        source->spv = malloc(embedded_len);
+        memcpy(source->spv, embedded, embedded_len);
+        source->len = embedded_len;
+    }
+    return shaders->count++;
+}
+
+// After #include "shaders/<file>.<ext>.h", e.g. vulkan_embedded_shader(vk, chunk, frag).
+#define vulkan_embedded_shader(vk, file, ext) \
+    vulkan_shader_registry_add(&(vk)->shaders, #file "." #ext, code_shaders_##file##_##ext##_spv, code_shaders_##file##_##ext##_spv_len)
+
+void vulkan_shader_registry_shutdown(Vulkan_Shader_Registry *shaders) {
+    for (uint32_t source_idx = 0; source_idx < shaders->count; ++source_idx) {
+        free(shaders->sources[source_idx].spv);
+    }
+    shaders->count = 0;
+    if (shaders->directory[0]) file_watch_close(&shaders->watch);
+    shaders->directory[0] = 0;
+}
+
+// The module is built from whatever SPIR-V the registry holds for source right now.
+bool vulkan_pipeline_info_add_shader(Vulkan_Pipeline_Info *info, Vulkan_Shader_Registry *shaders, uint32_t source, Shader_Type type) {
+    if (source == VULKAN_SHADER_NONE) return false;
+    Vulkan_Shader_Source *shader_source = &shaders->sources[source];
+    VkShaderModule module = vulkan_create_shader_module(info->device, shader_source->spv, shader_source->len);
     if (module == VK_NULL_HANDLE) {
-        print_error("Vulkan failed to create fragment shader");
+        print_error("Vulkan failed to create shader %s", shader_source->name);
         return false;
     }
-    Vulkan_Shader shader = { .type = Shader_Type_Fragment, .handle = module };
+    Vulkan_Shader shader = {
+        .type = type,
+        .handle = module,
+        .hash = vulkan_hash_bytes(VULKAN_HASH_SEED, shader_source->spv, shader_source->len),
+        .source = source,
+    };
     kabarr_append(&info->shaders, shader);
     return true;
 }
 
+bool vulkan_pipeline_info_add_vertex_shader(Vulkan_Pipeline_Info *info, Vulkan_Shader_Registry *shaders, uint32_t source) {
+    return vulkan_pipeline_info_add_shader(info, shaders, source, Shader_Type_Vertex);
+}
+
+bool vulkan_pipeline_info_add_fragment_shader(Vulkan_Pipeline_Info *info, Vulkan_Shader_Registry *shaders, uint32_t source) {
+    return vulkan_pipeline_info_add_shader(info, shaders, source, Shader_Type_Fragment);
+}
+
+// A compute shader makes this a compute pipeline, don't mix it with other stages.
+bool vulkan_pipeline_info_add_compute_shader(Vulkan_Pipeline_Info *info, Vulkan_Shader_Registry *shaders, uint32_t source) {
+    return vulkan_pipeline_info_add_shader(info, shaders, source, Shader_Type_Compute);
+}
+
 void vulkan_pipeline_info_set_render_pass(Vulkan_Pipeline_Info *info, VkRenderPass render_pass) {
     info->render_pass = render_pass;
 }
 
+void vulkan_pipeline_info_set_descriptor_layout(Vulkan_Pipeline_Info *info, VkDescriptorSetLayout layout) {
+    info->descriptor_set_layout = layout;
+}
+
+// Adds the bindless set as set 1. Pipelines without a set of their own get an
+// empty set 0 so the bindless set index is the same everywhere.
+void vulkan_pipeline_info_set_bindless(Vulkan_Pipeline_Info *info, Vulkan_Bindless *bindless) {
+    info->bindless_set_layout = bindless->set_layout;
+    if (!info->descriptor_set_layout) info->descriptor_set_layout = bindless->empty_set_layout;
+}
+
+// Off by default, VK_COMPARE_OP_NEVER turns it back off.
+void vulkan_pipeline_info_set_depth_test(Vulkan_Pipeline_Info *info, VkCompareOp operation, bool write) {
+    info->depth_operation = operation;
+    if (write) info->flags &= ~VULKAN_PIPELINE_NO_DEPTH_WRITE;
+    else info->flags |= VULKAN_PIPELINE_NO_DEPTH_WRITE;
+}
+
+// For render passes without color attachments. The fragment shader is optional then.
+void vulkan_pipeline_info_set_depth_only(Vulkan_Pipeline_Info *info) {
+    info->flags |= VULKAN_PIPELINE_DEPTH_ONLY;
+}
+
+// Push constants are visible to every graphics stage.
+void vulkan_pipeline_info_set_push_constants(Vulkan_Pipeline_Info *info, uint32_t size) {
+    info->push_constant_size = size;
+}
+
 VkShaderStageFlagBits vulkan_shader_get_stage_from_type(Shader_Type type) {
     switch (type) {
         case Shader_Type_Vertex: return VK_SHADER_STAGE_VERTEX_BIT;
         case Shader_Type_Fragment: return VK_SHADER_STAGE_FRAGMENT_BIT;
-        default: abort(); // TODO: add compute shaders
+        case Shader_Type_Compute: return VK_SHADER_STAGE_COMPUTE_BIT;
+        default: abort();
     }
     return 0;
 }
 
+// Only the shader, the sets and the push constants matter for compute.
+bool vulkan_pipeline_create_compute(Vulkan_Pipeline *pipeline, Vulkan_Pipeline_Info *info) {
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = info->push_constant_size;
+
+    VkDescriptorSetLayout set_layouts[] = { info->descriptor_set_layout, info->bindless_set_layout };
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = info->bindless_set_layout ? 2 : info->descriptor_set_layout ? 1 : 0;
+    pipeline_layout_info.pSetLayouts = set_layouts;
+    pipeline_layout_info.pushConstantRangeCount = info->push_constant_size ? 1 : 0;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+    if (vkCreatePipelineLayout(info->device, &pipeline_layout_info, 0, &pipeline->layout) != VK_SUCCESS) {
+        print_error("Failed to create compute pipeline layout");
+        return false;
+    }
+
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = info->shaders.items[0].handle;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = pipeline->layout;
+    pipeline_info.basePipelineIndex = -1;
+    if (vkCreateComputePipelines(info->device, info->cache, 1, &pipeline_info, 0, &pipeline->handle) != VK_SUCCESS) {
+        print_error("Failed to create compute pipeline");
+        return false;
+    }
+    return true;
+}
+
 bool vulkan_pipeline_create(Vulkan_Pipeline *pipeline, Fixed_Arena *arena, Vulkan_Pipeline_Info *info, VkExtent2D extent) {
+    if (info->shaders.count == 1 && info->shaders.items[0].type == Shader_Type_Compute) {
+        return vulkan_pipeline_create_compute(pipeline, info);
+    }
     Scratch_Arena scratch = arena_begin_scratch(arena);
     bool result = true;
     if (info->shaders.count > 0) {
@@ -426,11 +872,12 @@ bool vulkan_pipeline_create(Vulkan_Pipeline *pipeline, Fixed_Arena *arena, Vulka
         multisample_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
         multisample_info.minSampleShading = 1.0f;
 
+        // Has to be valid whenever the render pass has a depth attachment, even with the test off.
         VkPipelineDepthStencilStateCreateInfo depth_stencil_info = {};
+        depth_stencil_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
         if (info->depth_operation != VK_COMPARE_OP_NEVER) {
-            depth_stencil_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
             depth_stencil_info.depthTestEnable = VK_TRUE;
-            depth_stencil_info.depthWriteEnable = VK_TRUE;
+            depth_stencil_info.depthWriteEnable = (info->flags & VULKAN_PIPELINE_NO_DEPTH_WRITE) ? VK_FALSE : VK_TRUE;
             depth_stencil_info.depthCompareOp = info->depth_operation;
             depth_stencil_info.depthBoundsTestEnable = VK_FALSE;
             depth_stencil_info.minDepthBounds = 0.0f;
@@ -464,16 +911,21 @@ bool vulkan_pipeline_create(Vulkan_Pipeline *pipeline, Fixed_Arena *arena, Vulka
         color_blend_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
         color_blend_info.logicOpEnable = VK_FALSE;
         color_blend_info.logicOp = VK_LOGIC_OP_COPY;
-        color_blend_info.attachmentCount = 1;
+        color_blend_info.attachmentCount = (info->flags & VULKAN_PIPELINE_DEPTH_ONLY) ? 0 : 1;
         color_blend_info.pAttachments = &color_blend_attachment;
 
+        VkPushConstantRange push_constant_range = {};
+        push_constant_range.stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
+        push_constant_range.offset = 0;
+        push_constant_range.size = info->push_constant_size;
+
         VkPipelineLayoutCreateInfo pipeline_layout_info = {};
         pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        // TODO: descriptor sets
-        //pipeline_layout_info.setLayoutCount = 1;
-        //pipeline_layout_info.pSetLayouts = &descriptor_set_layout;
-        pipeline_layout_info.pushConstantRangeCount = 0;
-        pipeline_layout_info.pPushConstantRanges = 0;
+        VkDescriptorSetLayout set_layouts[] = { info->descriptor_set_layout, info->bindless_set_layout };
+        pipeline_layout_info.setLayoutCount = info->bindless_set_layout ? 2 : info->descriptor_set_layout ? 1 : 0;
+        pipeline_layout_info.pSetLayouts = set_layouts;
+        pipeline_layout_info.pushConstantRangeCount = info->push_constant_size ? 1 : 0;
+        pipeline_layout_info.pPushConstantRanges = &push_constant_range;
 
         if (vkCreatePipelineLayout(info->device, &pipeline_layout_info, 0, &pipeline->layout) == VK_SUCCESS) {
             VkGraphicsPipelineCreateInfo pipeline_info = {};
@@ -493,7 +945,7 @@ bool vulkan_pipeline_create(Vulkan_Pipeline *pipeline, Fixed_Arena *arena, Vulka
             pipeline_info.subpass = 0;
             pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
             pipeline_info.basePipelineIndex = -1;
-            if (vkCreateGraphicsPipelines(info->device, VK_NULL_HANDLE, 1, &pipeline_info, 0, &pipeline->handle) != VK_SUCCESS) {
+            if (vkCreateGraphicsPipelines(info->device, info->cache, 1, &pipeline_info, 0, &pipeline->handle) != VK_SUCCESS) {
                 result = false;
                 print_error("Failed to create graphics pipeline");
             }
@@ -512,160 +964,5024 @@ void vulkan_pipeline_info_free(Vulkan_Pipeline_Info *info) {
     kabarr_free(&info->attribs);
 }
 
-bool vulkan_backend_init(Vulkan_State *vk, Fixed_Arena *scratch, void *window, int width, int height) {
-    if (volkInitialize() != VK_SUCCESS) {
-        print_error("Volk failed to initialize.");
-        return false;
+// Only state that changes the compiled pipeline is hashed. Shaders are keyed by
+// their SPIR-V, so two infos built from the same bytecode share an entry.
+uint64_t vulkan_pipeline_info_hash(Vulkan_Pipeline_Info *info) {
+    uint64_t hash = VULKAN_HASH_SEED;
+    hash = vulkan_hash_bytes(hash, &info->flags, sizeof(info->flags));
+    hash = vulkan_hash_bytes(hash, &info->render_pass, sizeof(info->render_pass));
+    hash = vulkan_hash_bytes(hash, &info->descriptor_set_layout, sizeof(info->descriptor_set_layout));
+    hash = vulkan_hash_bytes(hash, &info->bindless_set_layout, sizeof(info->bindless_set_layout));
+    hash = vulkan_hash_bytes(hash, &info->push_constant_size, sizeof(info->push_constant_size));
+    for (uint32_t shader_idx = 0; shader_idx < info->shaders.count; ++shader_idx) {
+        Vulkan_Shader *shader = &info->shaders.items[shader_idx];
+        hash = vulkan_hash_bytes(hash, &shader->type, sizeof(shader->type));
+        hash = vulkan_hash_bytes(hash, &shader->hash, sizeof(shader->hash));
     }
+    hash = vulkan_hash_bytes(hash, info->attribs.items, info->attribs.count*sizeof(*info->attribs.items));
+    if (info->flags & VULKAN_PIPELINE_CUSTOM_VIEWPORT) hash = vulkan_hash_bytes(hash, &info->viewport, sizeof(info->viewport));
+    if (info->flags & VULKAN_PIPELINE_CUSTOM_SCISSOR) hash = vulkan_hash_bytes(hash, &info->scissor, sizeof(info->scissor));
+    hash = vulkan_hash_bytes(hash, &info->depth_operation, sizeof(info->depth_operation));
+    hash = vulkan_hash_bytes(hash, &info->cull_mode, sizeof(info->cull_mode));
+    hash = vulkan_hash_bytes(hash, &info->front_face, sizeof(info->front_face));
+    return hash;
+}
 
-    const char *layers[] = { "VK_LAYER_KHRONOS_validation" };
-    const char *extensions[] = { "VK_KHR_surface", VK_PLATFORM_SURFACE };
-    if (!vulkan_backend_create_instance(vk, layers, array_count(layers), extensions, array_count(extensions))) return false;
-    volkLoadInstance(vk->instance);
+// Compares everything vulkan_pipeline_info_hash hashes, so two infos whose
+// hashes collide never share an entry. Shaders match on their SPIR-V.
+bool vulkan_pipeline_info_equal(Vulkan_Shader_Registry *shaders, Vulkan_Pipeline_Info *a, Vulkan_Pipeline_Info *b) {
+    if (a->flags != b->flags || a->render_pass != b->render_pass || a->push_constant_size != b->push_constant_size) return false;
+    if (a->descriptor_set_layout != b->descriptor_set_layout || a->bindless_set_layout != b->bindless_set_layout) return false;
+    if (a->shaders.count != b->shaders.count || a->attribs.count != b->attribs.count) return false;
+    for (uint32_t shader_idx = 0; shader_idx < a->shaders.count; ++shader_idx) {
+        Vulkan_Shader *shader_a = &a->shaders.items[shader_idx];
+        Vulkan_Shader *shader_b = &b->shaders.items[shader_idx];
+        if (shader_a->type != shader_b->type || shader_a->hash != shader_b->hash) return false;
+        Vulkan_Shader_Source *source_a = &shaders->sources[shader_a->source];
+        Vulkan_Shader_Source *source_b = &shaders->sources[shader_b->source];
+        if (source_a != source_b && (source_a->len != source_b->len || memcmp(source_a->spv, source_b->spv, source_a->len) != 0)) return false;
+    }
+    if (a->attribs.count && memcmp(a->attribs.items, b->attribs.items, a->attribs.count*sizeof(*a->attribs.items)) != 0) return false;
+    if ((a->flags & VULKAN_PIPELINE_CUSTOM_VIEWPORT) && memcmp(&a->viewport, &b->viewport, sizeof(a->viewport)) != 0) return false;
+    if ((a->flags & VULKAN_PIPELINE_CUSTOM_SCISSOR) && memcmp(&a->scissor, &b->scissor, sizeof(a->scissor)) != 0) return false;
+    return a->depth_operation == b->depth_operation && a->cull_mode == b->cull_mode && a->front_face == b->front_face;
+}
 
-#if 0
-    Vulkan_Device_Info device_info = {0};
-    vulkan_device_info_init(&device_info);
-    vulkan_device_choose_color_format(&device_info, VK_FORMAT_B8G8R8A8_SRGB);
-    vulkan_device_choose_color_space(&device_info, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
-    vulkan_device_choose_present_mode(&device_info, VK_PRESENT_MODE_MAILBOX_KHR);
-    vulkan_backend_select_device(vk, &device_info);
+// Shader modules are not needed once the pipeline exists.
+void vulkan_pipeline_info_release_shaders(Vulkan_Pipeline_Info *info) {
+    for (uint32_t shader_idx = 0; shader_idx < info->shaders.count; ++shader_idx) {
+        Vulkan_Shader *shader = &info->shaders.items[shader_idx];
+        if (shader->handle) vkDestroyShaderModule(info->device, shader->handle, 0);
+        shader->handle = VK_NULL_HANDLE;
+    }
+}
 
-    Vulkan_Swapchain_Info swapchain_info = {0};
-    vulkan_swapchain_info_init(&swapchain_info);
-    vulkan_backend_create_swapchain(vk, &swapchain_info);
-#endif
+void vulkan_pipeline_info_destroy(Vulkan_Pipeline_Info *info) {
+    vulkan_pipeline_info_release_shaders(info);
+    vulkan_pipeline_info_free(info);
+}
 
-    if (!vulkan_backend_create_surface(vk, window)) return false;
-    if (!vulkan_backend_select_device(vk, scratch, VK_FORMAT_B8G8R8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, VK_PRESENT_MODE_MAILBOX_KHR)) return false;
-    if (!vulkan_backend_create_swapchain(vk, width, height)) return false;
+void vulkan_pipeline_registry_compile(Vulkan_Pipeline_Registry *registry, Fixed_Arena *arena, uint32_t id) {
+    Vulkan_Pipeline_Entry *entry = &registry->entries[id];
+    bool compiled = vulkan_pipeline_create(&entry->pipeline, arena, &entry->info, entry->extent);
+    vulkan_pipeline_info_release_shaders(&entry->info);
+    atomic_compare_exchange_u64(&entry->state, Vulkan_Pipeline_State_Compiling,
+                                compiled ? Vulkan_Pipeline_State_Ready : Vulkan_Pipeline_State_Failed);
+}
 
-    return true;
+// Claims a queued entry when claim is set, otherwise only reports whether one exists.
+uint32_t vulkan_pipeline_registry_next_queued(Vulkan_Pipeline_Registry *registry, bool claim) {
+    uint64_t count = atomic_add_u64(&registry->count, 0);
+    for (uint32_t entry_idx = 0; entry_idx < count; ++entry_idx) {
+        Vulkan_Pipeline_Entry *entry = &registry->entries[entry_idx];
+        if (!claim && entry->state == Vulkan_Pipeline_State_Queued) return entry_idx;
+        if (claim && atomic_compare_exchange_u64(&entry->state, Vulkan_Pipeline_State_Queued, Vulkan_Pipeline_State_Compiling) == Vulkan_Pipeline_State_Queued) {
+            return entry_idx;
+        }
+    }
+    return VULKAN_PIPELINE_NONE;
 }
 
-bool vulkan_render_pass_add_attachment(Vulkan_Render_Pass_Info *info, VkFormat format, uint32_t sample_count, Vulkan_Attachment_Type type) {
+// Runs until the queue is empty. compiler_active is dropped before the final
+// check so a pipeline queued in between either gets picked up here or starts a
+// new compile thread, never neither.
+THREAD_RETURN_TYPE vulkan_pipeline_compile_thread(void *data) {
+    Vulkan_Pipeline_Registry *registry = (Vulkan_Pipeline_Registry *)data;
+    for (;;) {
+        uint32_t id = vulkan_pipeline_registry_next_queued(registry, true);
+        if (id != VULKAN_PIPELINE_NONE) {
+            vulkan_pipeline_registry_compile(registry, &registry->compile_arena, id);
+            continue;
+        }
+        atomic_compare_exchange_u64(&registry->compiler_active, 1, 0);
+        if (vulkan_pipeline_registry_next_queued(registry, false) == VULKAN_PIPELINE_NONE) break;
+        if (atomic_compare_exchange_u64(&registry->compiler_active, 0, 1) != 0) break;
+    }
+    return 0;
+}
 
-    VkSampleCountFlagBits sample_flag = 0;
-    switch (sample_count) {
-        case 1: { sample_flag = VK_SAMPLE_COUNT_1_BIT; } break;
-        case 2: { sample_flag = VK_SAMPLE_COUNT_2_BIT; } break;
-        case 4: { sample_flag = VK_SAMPLE_COUNT_4_BIT; } break;
-        case 8: { sample_flag = VK_SAMPLE_COUNT_8_BIT; } break;
-        case 16: { sample_flag = VK_SAMPLE_COUNT_16_BIT; } break;
-        case 32: { sample_flag = VK_SAMPLE_COUNT_32_BIT; } break;
-        case 64: { sample_flag = VK_SAMPLE_COUNT_64_BIT; } break;
-        default: {
-            print_error("Invalid multisample count. Must be power of 2 up to 64");
-            return false;
+void vulkan_pipeline_registry_init(Vulkan_Pipeline_Registry *registry) {
+    arena_alloc(&registry->compile_arena, VULKAN_PIPELINE_COMPILE_ARENA_SIZE);
+}
+
+// Takes ownership of info. On a hit the caller's shader modules are dropped and
+// the existing entry returned, otherwise info becomes a new entry in state.
+uint32_t vulkan_pipeline_registry_insert(Vulkan_State *vk, Vulkan_Pipeline_Info *info, uint32_t fallback, Vulkan_Pipeline_State state) {
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    uint64_t key = vulkan_pipeline_info_hash(info);
+    for (uint32_t entry_idx = 0; entry_idx < registry->count; ++entry_idx) {
+        Vulkan_Pipeline_Entry *entry = &registry->entries[entry_idx];
+        if (entry->key == key && entry->state != Vulkan_Pipeline_State_Failed && vulkan_pipeline_info_equal(&vk->shaders, &entry->info, info)) {
+            registry->hits += 1;
+            vulkan_pipeline_info_destroy(info);
+            return entry_idx;
         }
     }
 
-    // TODO: make this better
-    VkAttachmentDescription attachment = {0};
-    attachment.format = format;
-    attachment.samples = sample_flag;
-    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    kabarr_append(&info->attachments, attachment);
+    registry->misses += 1;
+    if (registry->count >= VULKAN_MAX_PIPELINES) {
+        print_error("Vulkan pipeline registry is full");
+        vulkan_pipeline_info_destroy(info);
+        return VULKAN_PIPELINE_NONE;
+    }
+    uint32_t id = (uint32_t)registry->count;
+    Vulkan_Pipeline_Entry *entry = &registry->entries[id];
+    *entry = (Vulkan_Pipeline_Entry){};
+    entry->key = key;
+    entry->state = state;
+    entry->fallback = fallback;
+    entry->extent = vk->extent;
+    entry->info = *info;
+    *info = (Vulkan_Pipeline_Info){};
+    atomic_add_u64(&registry->count, 1);
+    return id;
+}
 
-    return true;
+// With fallback set to VULKAN_PIPELINE_NONE a miss is compiled right here,
+// otherwise it is queued for the compile thread and vulkan_pipeline_resolve
+// returns the fallback until it is ready. Returns VULKAN_PIPELINE_NONE when the
+// registry is full or a blocking compile failed.
+uint32_t vulkan_pipeline_get(Vulkan_State *vk, Fixed_Arena *arena, Vulkan_Pipeline_Info *info, uint32_t fallback) {
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    uint64_t count = registry->count;
+    Vulkan_Pipeline_State state = fallback == VULKAN_PIPELINE_NONE ? Vulkan_Pipeline_State_Compiling : Vulkan_Pipeline_State_Queued;
+    uint32_t id = vulkan_pipeline_registry_insert(vk, info, fallback, state);
+    if (id == VULKAN_PIPELINE_NONE || id < count) return id;
+
+    if (fallback == VULKAN_PIPELINE_NONE) {
+        vulkan_pipeline_registry_compile(registry, arena, id);
+        return registry->entries[id].state == Vulkan_Pipeline_State_Ready ? id : VULKAN_PIPELINE_NONE;
+    }
+
+    if (atomic_compare_exchange_u64(&registry->compiler_active, 0, 1) == 0) {
+        // Whatever thread ran last has already given up compiler_active, so this doesn't block for long.
+        if (registry->compiler) join_thread(registry->compiler);
+        registry->compiler = create_thread(vulkan_pipeline_compile_thread, registry);
+    }
+    return id;
+}
+
+// Startup pipelines are registered up front and compiled by every lane at once
+// in vulkan_pipeline_batch_compile. Ids are valid straight away but resolve to
+// nothing until vulkan_pipeline_batch_finish.
+uint32_t vulkan_pipeline_batch_add(Vulkan_State *vk, Vulkan_Pipeline_Info *info, uint32_t fallback) {
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    if (!registry->batch_begin_ns) {
+        registry->batch_first = (uint32_t)registry->count;
+        registry->batch_begin_ns = get_time_ns();
+    }
+    return vulkan_pipeline_registry_insert(vk, info, fallback, Vulkan_Pipeline_State_Queued);
+}
+
+// Every lane calls this. Lanes claim entries one at a time, so a lane stuck on
+// an expensive pipeline doesn't hold up the rest of the batch.
+void vulkan_pipeline_batch_compile(Vulkan_State *vk, uint32_t lane_index) {
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    if (lane_index >= vk->lane_count) return;
+    Fixed_Arena arena;
+    arena_alloc(&arena, VULKAN_PIPELINE_COMPILE_ARENA_SIZE);
+    vk->lanes[lane_index].pipelines_compiled = 0;
+    for (;;) {
+        uint32_t id = vulkan_pipeline_registry_next_queued(registry, true);
+        if (id == VULKAN_PIPELINE_NONE) break;
+        vulkan_pipeline_registry_compile(registry, &arena, id);
+        vk->lanes[lane_index].pipelines_compiled += 1;
+    }
+    arena_free(&arena);
 }
 
-bool vulkan_pipeline_create_render_pass(Vulkan_Pipeline_Info *info) {
+// Lane 0, after every lane has returned from vulkan_pipeline_batch_compile.
+bool vulkan_pipeline_batch_finish(Vulkan_State *vk) {
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    if (!registry->batch_begin_ns) return true;
     bool result = true;
-    VkAttachmentDescription attachments[] = {
-        {
-            .format = VK_FORMAT_B8G8R8A8_SRGB,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
-        },
-    };
+    for (uint32_t entry_idx = registry->batch_first; entry_idx < registry->count; ++entry_idx) {
+        if (registry->entries[entry_idx].state != Vulkan_Pipeline_State_Ready) result = false;
+    }
+    uint32_t busiest = 0;
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        if (vk->lanes[lane_idx].pipelines_compiled > busiest) busiest = vk->lanes[lane_idx].pipelines_compiled;
+    }
+    print_info("Compiled %u pipelines on %u lanes in %.2f ms (busiest lane: %u)",
+               (uint32_t)registry->count - registry->batch_first, vk->lane_count,
+               (double)(get_time_ns() - registry->batch_begin_ns) / 1000000.0, busiest);
+    registry->batch_begin_ns = 0;
+    if (!result) print_error("Vulkan failed to compile the startup pipelines");
+    return result;
+}
+
+// The pipeline to draw with right now, walking fallbacks past anything still
+// compiling. Null when nothing in the chain is ready.
+Vulkan_Pipeline *vulkan_pipeline_resolve(Vulkan_Pipeline_Registry *registry, uint32_t id) {
+    while (id != VULKAN_PIPELINE_NONE) {
+        Vulkan_Pipeline_Entry *entry = &registry->entries[id];
+        if (atomic_add_u64(&entry->state, 0) == Vulkan_Pipeline_State_Ready) return &entry->pipeline;
+        id = entry->fallback;
+    }
+    return 0;
+}
 
-    VkAttachmentReference color_attachment_ref = {};
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+void vulkan_pipeline_registry_log_stats(Vulkan_Pipeline_Registry *registry) {
+    uint64_t lookups = registry->hits + registry->misses;
+    print_info("Pipeline registry: %llu pipelines, %llu hits, %llu misses (%.1f%% hit rate)",
+               (unsigned long long)registry->count, (unsigned long long)registry->hits, (unsigned long long)registry->misses,
+               lookups ? 100.0*(double)registry->hits/(double)lookups : 0.0);
+}
 
-    VkSubpassDescription subpasses[] = {
-        {
-            .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-            .colorAttachmentCount = 1,
-            .pColorAttachments = &color_attachment_ref,
-        },
-    };
+// Waits for the compile thread, so call before saving the pipeline cache.
+void vulkan_pipeline_registry_shutdown(Vulkan_State *vk) {
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    if (registry->compiler) join_thread(registry->compiler);
+    registry->compiler = 0;
+    vulkan_pipeline_registry_log_stats(registry);
+    for (uint32_t entry_idx = 0; entry_idx < registry->count; ++entry_idx) {
+        Vulkan_Pipeline_Entry *entry = &registry->entries[entry_idx];
+        if (entry->pipeline.handle) vkDestroyPipeline(vk->device, entry->pipeline.handle, 0);
+        if (entry->pipeline.layout) vkDestroyPipelineLayout(vk->device, entry->pipeline.layout, 0);
+        vulkan_pipeline_info_destroy(&entry->info);
+    }
+    registry->count = 0;
+    arena_free(&registry->compile_arena);
+}
 
-    VkSubpassDependency dependencies[] = {
-        {
-            .srcSubpass = VK_SUBPASS_EXTERNAL,
-            .dstSubpass = 0,
-            .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-            .srcAccessMask = 0,
-            .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        },
-    };
+// Lane 0, at the start of a frame. Shaders whose file changed take the new
+// SPIR-V and every ready pipeline built from them is rebuilt through the
+// pipeline cache, under the same id. The old pipelines may still be in flight,
+// so a reload waits for the device. A pipeline that fails to rebuild keeps its
+// old shaders.
+void vulkan_shader_registry_reload(Vulkan_State *vk) {
+    Vulkan_Shader_Registry *shaders = &vk->shaders;
+    if (!shaders->directory[0] || !file_watch_changed(&shaders->watch)) return;
+    uint64_t begin_ns = get_time_ns();
+    uint32_t changed_count = 0;
+    for (uint32_t source_idx = 0; source_idx < shaders->count; ++source_idx) {
+        Vulkan_Shader_Source *source = &shaders->sources[source_idx];
+        size_t len = 0;
+        uint8_t *spv = vulkan_shader_read_file(shaders, source->name, &len);
+        if (!spv || (len == source->len && memcmp(spv, source->spv, len) == 0)) {
+            free(spv);
+            continue;
+        }
+        free(source->spv);
+        source->spv = spv;
+        source->len = len;
+        source->from_file = true;
+        source->changed = true;
+        changed_count += 1;
+    }
+    if (!changed_count) return;
 
-    VkRenderPassCreateInfo render_pass_info = {};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = array_count(attachments);
-    render_pass_info.pAttachments = attachments;
-    render_pass_info.subpassCount = array_count(subpasses);
-    render_pass_info.pSubpasses = subpasses;
-    render_pass_info.dependencyCount = array_count(dependencies);
-    render_pass_info.pDependencies = dependencies;
+    vkDeviceWaitIdle(vk->device);
+    Vulkan_Pipeline_Registry *registry = &vk->pipelines;
+    Fixed_Arena arena;
+    arena_alloc(&arena, VULKAN_PIPELINE_COMPILE_ARENA_SIZE);
+    uint32_t rebuilt = 0;
+    uint32_t failed = 0;
+    uint64_t count = atomic_add_u64(&registry->count, 0);
+    for (uint32_t entry_idx = 0; entry_idx < count; ++entry_idx) {
+        Vulkan_Pipeline_Entry *entry = &registry->entries[entry_idx];
+        if (atomic_add_u64(&entry->state, 0) != Vulkan_Pipeline_State_Ready) continue;
+        Vulkan_Pipeline_Info *info = &entry->info;
+        bool affected = false;
+        for (uint32_t shader_idx = 0; shader_idx < info->shaders.count; ++shader_idx) {
+            if (shaders->sources[info->shaders.items[shader_idx].source].changed) affected = true;
+        }
+        if (!affected) continue;
 
-    if (vkCreateRenderPass(info->device, &render_pass_info, 0, &info->render_pass) != VK_SUCCESS) {
-        print_error("Vulkan failed to create render pass");
-        result = false;
+        bool modules_created = true;
+        for (uint32_t shader_idx = 0; shader_idx < info->shaders.count; ++shader_idx) {
+            Vulkan_Shader *shader = &info->shaders.items[shader_idx];
+            Vulkan_Shader_Source *source = &shaders->sources[shader->source];
+            shader->handle = vulkan_create_shader_module(info->device, source->spv, source->len);
+            shader->hash = vulkan_hash_bytes(VULKAN_HASH_SEED, source->spv, source->len);
+            if (!shader->handle) modules_created = false;
+        }
+        Vulkan_Pipeline pipeline = {};
+        if (modules_created && vulkan_pipeline_create(&pipeline, &arena, info, entry->extent)) {
+            vkDestroyPipeline(vk->device, entry->pipeline.handle, 0);
+            vkDestroyPipelineLayout(vk->device, entry->pipeline.layout, 0);
+            entry->pipeline = pipeline;
+            entry->key = vulkan_pipeline_info_hash(info);
+            rebuilt += 1;
+        } else {
+            if (pipeline.handle) vkDestroyPipeline(vk->device, pipeline.handle, 0);
+            if (pipeline.layout) vkDestroyPipelineLayout(vk->device, pipeline.layout, 0);
+            failed += 1;
+        }
+        vulkan_pipeline_info_release_shaders(info);
+        arena_reset(&arena);
     }
+    arena_free(&arena);
 
-    return result;
+    for (uint32_t source_idx = 0; source_idx < shaders->count; ++source_idx) {
+        shaders->sources[source_idx].changed = false;
+    }
+    shaders->reloads += 1;
+    print_info("Shader reload %u: %u shaders changed, rebuilt %u pipelines in %.2f ms",
+               shaders->reloads, changed_count, rebuilt, (double)(get_time_ns() - begin_ns) / 1000000.0);
+    if (failed) print_error("%u pipelines failed to rebuild and keep their old shaders", failed);
 }
 
-bool vulkan_backend_create_final_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
-    Vulkan_Render_Pass_Info render_pass_info = {0};
-    // TODO: think about this more after making more render passes and attachments.
-#if 0
-    vulkan_render_pass_add_color_attachment(&render_pass_info, VK_FORMAT_B8G8R8A8_SRGB, 1);
-    vulkan_render_pass_add_depth_attachment(&render_pass_info, VK_FORMAT_D24_UNORM_S8_UINT, 1);
-    vulkan_render_pass_create(&pipeline_info.render_pass, &render_pass_info);
-#endif
+#define VULKAN_MEMORY_NIL UINT32_MAX
 
+uint32_t vulkan_memory_find_type(Vulkan_State *vk, uint32_t type_bits, VkMemoryPropertyFlags flags) {
+    for (uint32_t type_idx = 0; type_idx < vk->memory_properties.memoryTypeCount; ++type_idx) {
+        if ((type_bits & (1u << type_idx)) &&
+            (vk->memory_properties.memoryTypes[type_idx].propertyFlags & flags) == flags) {
+            return type_idx;
+        }
+    }
+    return UINT32_MAX;
+}
+
+void vulkan_memory_push_free(Vulkan_Memory_Block *block, uint32_t leaf, uint32_t order) {
+    block->free_order[leaf] = (uint8_t)order;
+    block->free_prev[leaf] = VULKAN_MEMORY_NIL;
+    block->free_next[leaf] = block->free_heads[order];
+    if (block->free_heads[order] != VULKAN_MEMORY_NIL) block->free_prev[block->free_heads[order]] = leaf;
+    block->free_heads[order] = leaf;
+}
+
+void vulkan_memory_remove_free(Vulkan_Memory_Block *block, uint32_t leaf) {
+    uint32_t order = block->free_order[leaf];
+    uint32_t prev = block->free_prev[leaf];
+    uint32_t next = block->free_next[leaf];
+    if (prev != VULKAN_MEMORY_NIL) block->free_next[prev] = next;
+    else block->free_heads[order] = next;
+    if (next != VULKAN_MEMORY_NIL) block->free_prev[next] = prev;
+    block->free_order[leaf] = 0xff;
+}
+
+uint32_t vulkan_memory_block_alloc(Vulkan_Memory_Block *block, uint32_t order) {
+    uint32_t found = order;
+    while (found < block->order_count && block->free_heads[found] == VULKAN_MEMORY_NIL) ++found;
+    if (found == block->order_count) return VULKAN_MEMORY_NIL;
+
+    uint32_t leaf = block->free_heads[found];
+    vulkan_memory_remove_free(block, leaf);
+    while (found > order) {
+        --found;
+        vulkan_memory_push_free(block, leaf + (1u << found), found);
+    }
+    return leaf;
+}
+
+void vulkan_memory_block_free(Vulkan_Memory_Block *block, uint32_t leaf, uint32_t order) {
+    while (order + 1 < block->order_count) {
+        uint32_t buddy = leaf ^ (1u << order);
+        if (block->free_order[buddy] != order) break;
+        vulkan_memory_remove_free(block, buddy);
+        if (buddy < leaf) leaf = buddy;
+        ++order;
+    }
+    vulkan_memory_push_free(block, leaf, order);
+}
+
+VkDeviceSize vulkan_memory_block_largest_free(Vulkan_Memory_Block *block) {
+    for (uint32_t order = block->order_count; order > 0; --order) {
+        if (block->free_heads[order - 1] != VULKAN_MEMORY_NIL) return VULKAN_MEMORY_MIN_ALLOCATION << (order - 1);
+    }
+    return 0;
+}
+
+Vulkan_Memory_Block *vulkan_memory_create_block(Vulkan_State *vk, uint32_t memory_type, bool linear) {
+    // Small heaps (e.g. the 256MB device local + host visible heap) get smaller blocks.
+    uint32_t heap_index = vk->memory_properties.memoryTypes[memory_type].heapIndex;
+    VkDeviceSize size = VULKAN_MEMORY_BLOCK_SIZE;
+    while (size > VULKAN_MEMORY_MIN_ALLOCATION && size > vk->memory_properties.memoryHeaps[heap_index].size / 8) size >>= 1;
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = memory_type;
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(vk->device, &alloc_info, 0, &memory) != VK_SUCCESS) return 0;
+
+    void *mapped = 0;
+    if (vk->memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        if (vkMapMemory(vk->device, memory, 0, VK_WHOLE_SIZE, 0, &mapped) != VK_SUCCESS) {
+            vkFreeMemory(vk->device, memory, 0);
+            return 0;
+        }
+    }
+
+    uint32_t leaf_count = (uint32_t)(size / VULKAN_MEMORY_MIN_ALLOCATION);
+    Vulkan_Memory_Block *block = malloc(sizeof(Vulkan_Memory_Block));
+    memset(block, 0, sizeof(*block));
+    block->memory = memory;
+    block->size = size;
+    block->memory_type = memory_type;
+    block->linear = linear;
+    block->mapped = mapped;
+    block->free_next = malloc(leaf_count*sizeof(uint32_t));
+    block->free_prev = malloc(leaf_count*sizeof(uint32_t));
+    block->free_order = malloc(leaf_count*sizeof(uint8_t));
+    memset(block->free_order, 0xff, leaf_count*sizeof(uint8_t));
+    while ((1u << block->order_count) < leaf_count) ++block->order_count;
+    ++block->order_count;
+    for (uint32_t order = 0; order < VULKAN_MEMORY_MAX_ORDERS; ++order) block->free_heads[order] = VULKAN_MEMORY_NIL;
+    vulkan_memory_push_free(block, 0, block->order_count - 1);
+
+    kabarr_append(&vk->memory_blocks, block);
+    return block;
+}
+
+bool vulkan_memory_allocate_dedicated(Vulkan_State *vk, VkMemoryRequirements *reqs, uint32_t memory_type, VkBuffer buffer, VkImage image, Vulkan_Allocation *allocation) {
+    VkMemoryDedicatedAllocateInfo dedicated_info = {};
+    dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicated_info.buffer = buffer;
+    dedicated_info.image = image;
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext = &dedicated_info;
+    alloc_info.allocationSize = reqs->size;
+    alloc_info.memoryTypeIndex = memory_type;
+    if (vkAllocateMemory(vk->device, &alloc_info, 0, &allocation->memory) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate %llu bytes of device memory", (unsigned long long)reqs->size);
+        return false;
+    }
+    allocation->offset = 0;
+    allocation->size = reqs->size;
+    allocation->block_index = VULKAN_MEMORY_DEDICATED;
+    allocation->memory_type = memory_type;
+    allocation->mapped = 0;
+    if (vk->memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(vk->device, allocation->memory, 0, VK_WHOLE_SIZE, 0, &allocation->mapped);
+    }
+
+    uint32_t heap_index = vk->memory_properties.memoryTypes[memory_type].heapIndex;
+    vk->dedicated_count[heap_index] += 1;
+    vk->dedicated_bytes[heap_index] += reqs->size;
+    return true;
+}
+
+// Not thread safe. Allocations happen on lane 0.
+bool vulkan_memory_allocate(Vulkan_State *vk, VkMemoryRequirements *reqs, VkMemoryPropertyFlags flags, VkBuffer buffer, VkImage image, bool dedicated, Vulkan_Allocation *allocation) {
+    uint32_t memory_type = vulkan_memory_find_type(vk, reqs->memoryTypeBits, flags);
+    if (memory_type == UINT32_MAX) {
+        print_error("Vulkan found no memory type with flags 0x%x", flags);
+        return false;
+    }
+
+    VkDeviceSize needed = reqs->size > reqs->alignment ? reqs->size : reqs->alignment;
+    uint32_t order = 0;
+    while ((VULKAN_MEMORY_MIN_ALLOCATION << order) < needed) ++order;
+
+    // With a granularity of 1 buffers and optimal images can share blocks.
+    bool linear = buffer != VK_NULL_HANDLE || vk->buffer_image_granularity <= 1;
+    if (!dedicated && (VULKAN_MEMORY_MIN_ALLOCATION << order) <= VULKAN_MEMORY_BLOCK_SIZE/2) {
+        for (uint32_t block_idx = 0; block_idx <= vk->memory_blocks.count; ++block_idx) {
+            Vulkan_Memory_Block *block = 0;
+            bool fresh = block_idx == vk->memory_blocks.count;
+            if (!fresh) {
+                block = vk->memory_blocks.items[block_idx];
+                if (block->memory_type != memory_type || block->linear != linear) continue;
+            } else {
+                block = vulkan_memory_create_block(vk, memory_type, linear);
+                if (!block) break;
+            }
+
+            uint32_t leaf = order < block->order_count ? vulkan_memory_block_alloc(block, order) : VULKAN_MEMORY_NIL;
+            if (leaf == VULKAN_MEMORY_NIL) {
+                if (fresh) break;
+                continue;
+            }
+
+            allocation->memory = block->memory;
+            allocation->offset = (VkDeviceSize)leaf*VULKAN_MEMORY_MIN_ALLOCATION;
+            allocation->size = reqs->size;
+            allocation->mapped = block->mapped ? (uint8_t *)block->mapped + allocation->offset : 0;
+            allocation->block_index = block_idx;
+            allocation->order = order;
+            allocation->memory_type = memory_type;
+            block->used += VULKAN_MEMORY_MIN_ALLOCATION << order;
+            block->allocation_count += 1;
+            return true;
+        }
+    }
+
+    // Large resources, ones the driver wants dedicated, and anything that
+    // didn't fit in a new block get their own allocation.
+    return vulkan_memory_allocate_dedicated(vk, reqs, memory_type, buffer, image, allocation);
+}
+
+void vulkan_memory_free(Vulkan_State *vk, Vulkan_Allocation *allocation) {
+    if (!allocation->memory) return;
+    if (allocation->block_index == VULKAN_MEMORY_DEDICATED) {
+        uint32_t heap_index = vk->memory_properties.memoryTypes[allocation->memory_type].heapIndex;
+        vk->dedicated_count[heap_index] -= 1;
+        vk->dedicated_bytes[heap_index] -= allocation->size;
+        vkFreeMemory(vk->device, allocation->memory, 0);
+    } else {
+        Vulkan_Memory_Block *block = vk->memory_blocks.items[allocation->block_index];
+        uint32_t leaf = (uint32_t)(allocation->offset / VULKAN_MEMORY_MIN_ALLOCATION);
+        vulkan_memory_block_free(block, leaf, allocation->order);
+        block->used -= VULKAN_MEMORY_MIN_ALLOCATION << allocation->order;
+        block->allocation_count -= 1;
+    }
+    *allocation = (Vulkan_Allocation){0};
+}
+
+// Everything the timeline has moved past. Shutdown passes UINT64_MAX once the
+// device is idle.
+void vulkan_retired_destroy(Vulkan_State *vk, uint64_t completed) {
+    for (uint32_t retired_idx = 0; retired_idx < vk->retired.count;) {
+        Vulkan_Retired *retired = &vk->retired.items[retired_idx];
+        if (retired->release_value > completed) {
+            ++retired_idx;
+            continue;
+        }
+        switch (retired->kind) {
+            case Vulkan_Retired_Swapchain: vkDestroySwapchainKHR(vk->device, retired->swapchain, 0); break;
+            case Vulkan_Retired_Image: vkDestroyImage(vk->device, retired->image, 0); break;
+            case Vulkan_Retired_Image_View: vkDestroyImageView(vk->device, retired->view, 0); break;
+            case Vulkan_Retired_Framebuffer: vkDestroyFramebuffer(vk->device, retired->framebuffer, 0); break;
+            case Vulkan_Retired_Memory: vulkan_memory_free(vk, &retired->allocation); break;
+        }
+        *retired = vk->retired.items[--vk->retired.count];
+    }
+}
+
+bool vulkan_timeline_wait(Vulkan_State *vk, uint64_t value) {
+    if (!value) return true;
+    VkSemaphoreWaitInfo wait_info = {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &vk->timeline;
+    wait_info.pValues = &value;
+    if (vkWaitSemaphores(vk->device, &wait_info, UINT64_MAX) != VK_SUCCESS) {
+        print_error("Vulkan failed waiting on frame timeline");
+        return false;
+    }
+    return true;
+}
+
+bool vulkan_buffer_create_info(Vulkan_State *vk, VkBufferCreateInfo *info, VkMemoryPropertyFlags flags, Vulkan_Buffer *buffer) {
+    if (vkCreateBuffer(vk->device, info, 0, &buffer->handle) != VK_SUCCESS) {
+        print_error("Vulkan failed to create buffer");
+        return false;
+    }
+    buffer->size = info->size;
+
+    VkMemoryDedicatedRequirements dedicated_reqs = {};
+    dedicated_reqs.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+    VkMemoryRequirements2 reqs = {};
+    reqs.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+    reqs.pNext = &dedicated_reqs;
+    VkBufferMemoryRequirementsInfo2 reqs_info = {};
+    reqs_info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+    reqs_info.buffer = buffer->handle;
+    vkGetBufferMemoryRequirements2(vk->device, &reqs_info, &reqs);
+
+    bool dedicated = dedicated_reqs.prefersDedicatedAllocation || dedicated_reqs.requiresDedicatedAllocation;
+    if (!vulkan_memory_allocate(vk, &reqs.memoryRequirements, flags, buffer->handle, VK_NULL_HANDLE, dedicated, &buffer->allocation)) {
+        vkDestroyBuffer(vk->device, buffer->handle, 0);
+        buffer->handle = VK_NULL_HANDLE;
+        return false;
+    }
+    if (vkBindBufferMemory(vk->device, buffer->handle, buffer->allocation.memory, buffer->allocation.offset) != VK_SUCCESS) {
+        print_error("Vulkan failed to bind buffer memory");
+        vkDestroyBuffer(vk->device, buffer->handle, 0);
+        buffer->handle = VK_NULL_HANDLE;
+        vulkan_memory_free(vk, &buffer->allocation);
+        return false;
+    }
+    return true;
+}
+
+bool vulkan_buffer_create(Vulkan_State *vk, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, Vulkan_Buffer *buffer) {
+    VkBufferCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    return vulkan_buffer_create_info(vk, &info, flags, buffer);
+}
+
+// For buffers that async graph passes touch or that the upload ring writes.
+// The graphics, async compute and transfer families all use them without
+// ownership transfers.
+bool vulkan_buffer_create_shared(Vulkan_State *vk, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, Vulkan_Buffer *buffer) {
+    uint32_t families[3] = { vk->graphics_family };
+    uint32_t family_count = 1;
+    if (vk->compute_queue) families[family_count++] = vk->compute_family;
+    if (vk->transfer_queue) families[family_count++] = vk->transfer_family;
+
+    VkBufferCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (family_count > 1) {
+        info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        info.queueFamilyIndexCount = family_count;
+        info.pQueueFamilyIndices = families;
+    }
+    return vulkan_buffer_create_info(vk, &info, flags, buffer);
+}
+
+void vulkan_buffer_destroy(Vulkan_State *vk, Vulkan_Buffer *buffer) {
+    if (buffer->handle) vkDestroyBuffer(vk->device, buffer->handle, 0);
+    vulkan_memory_free(vk, &buffer->allocation);
+    *buffer = (Vulkan_Buffer){0};
+}
+
+// Creates the image, binds memory and makes a view covering every mip and layer.
+bool vulkan_image_create(Vulkan_State *vk, VkImageCreateInfo *info, VkImageViewType view_type, VkImageAspectFlags aspect, Vulkan_Image *image) {
+    if (vkCreateImage(vk->device, info, 0, &image->handle) != VK_SUCCESS) {
+        print_error("Vulkan failed to create image");
+        return false;
+    }
+    image->format = info->format;
+    image->extent = info->extent;
+
+    VkMemoryDedicatedRequirements dedicated_reqs = {};
+    dedicated_reqs.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+    VkMemoryRequirements2 reqs = {};
+    reqs.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+    reqs.pNext = &dedicated_reqs;
+    VkImageMemoryRequirementsInfo2 reqs_info = {};
+    reqs_info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+    reqs_info.image = image->handle;
+    vkGetImageMemoryRequirements2(vk->device, &reqs_info, &reqs);
+
+    bool dedicated = dedicated_reqs.prefersDedicatedAllocation || dedicated_reqs.requiresDedicatedAllocation;
+    if (!vulkan_memory_allocate(vk, &reqs.memoryRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_NULL_HANDLE, image->handle, dedicated, &image->allocation)) {
+        vkDestroyImage(vk->device, image->handle, 0);
+        image->handle = VK_NULL_HANDLE;
+        return false;
+    }
+    if (vkBindImageMemory(vk->device, image->handle, image->allocation.memory, image->allocation.offset) != VK_SUCCESS) {
+        print_error("Vulkan failed to bind image memory");
+        vkDestroyImage(vk->device, image->handle, 0);
+        image->handle = VK_NULL_HANDLE;
+        vulkan_memory_free(vk, &image->allocation);
+        return false;
+    }
+
+    VkImageViewCreateInfo view_info = {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = image->handle;
+    view_info.viewType = view_type;
+    view_info.format = info->format;
+    view_info.subresourceRange.aspectMask = aspect;
+    view_info.subresourceRange.baseMipLevel = 0;
+    view_info.subresourceRange.levelCount = info->mipLevels;
+    view_info.subresourceRange.baseArrayLayer = 0;
+    view_info.subresourceRange.layerCount = info->arrayLayers;
+    if (vkCreateImageView(vk->device, &view_info, 0, &image->view) != VK_SUCCESS) {
+        print_error("Vulkan failed to create image view");
+        image->view = VK_NULL_HANDLE;
+        vkDestroyImage(vk->device, image->handle, 0);
+        image->handle = VK_NULL_HANDLE;
+        vulkan_memory_free(vk, &image->allocation);
+        return false;
+    }
+    return true;
+}
+
+void vulkan_image_destroy(Vulkan_State *vk, Vulkan_Image *image) {
+    if (image->view) vkDestroyImageView(vk->device, image->view, 0);
+    if (image->handle) vkDestroyImage(vk->device, image->handle, 0);
+    vulkan_memory_free(vk, &image->allocation);
+    *image = (Vulkan_Image){0};
+}
+
+void vulkan_memory_log_stats(Vulkan_State *vk) {
+    for (uint32_t heap_idx = 0; heap_idx < vk->memory_properties.memoryHeapCount; ++heap_idx) {
+        VkDeviceSize reserved = 0, used = 0, largest_free = 0;
+        uint32_t block_count = 0, allocation_count = 0;
+        for (uint32_t block_idx = 0; block_idx < vk->memory_blocks.count; ++block_idx) {
+            Vulkan_Memory_Block *block = vk->memory_blocks.items[block_idx];
+            if (vk->memory_properties.memoryTypes[block->memory_type].heapIndex != heap_idx) continue;
+            VkDeviceSize block_largest = vulkan_memory_block_largest_free(block);
+            if (block_largest > largest_free) largest_free = block_largest;
+            reserved += block->size;
+            used += block->used;
+            allocation_count += block->allocation_count;
+            block_count += 1;
+        }
+        if (!block_count && !vk->dedicated_count[heap_idx]) continue;
+
+        // Fragmentation is how much of the free memory can't be handed out as one piece.
+        VkDeviceSize free = reserved - used;
+        float fragmentation = free ? 1.0f - (float)largest_free / (float)free : 0.0f;
+        print_info("Heap %u: %u blocks, %.1f/%.1f MB used by %u allocations, %.0f%% fragmented, %u dedicated (%.1f MB)",
+                   heap_idx, block_count, (double)used/(1<<20), (double)reserved/(1<<20), allocation_count,
+                   100.0f*fragmentation, vk->dedicated_count[heap_idx], (double)vk->dedicated_bytes[heap_idx]/(1<<20));
+    }
+}
+
+void vulkan_memory_init(Vulkan_State *vk) {
+    vkGetPhysicalDeviceMemoryProperties(vk->phys_device, &vk->memory_properties);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk->phys_device, &properties);
+    vk->buffer_image_granularity = properties.limits.bufferImageGranularity;
+}
+
+void vulkan_memory_shutdown(Vulkan_State *vk) {
+    for (uint32_t block_idx = 0; block_idx < vk->memory_blocks.count; ++block_idx) {
+        Vulkan_Memory_Block *block = vk->memory_blocks.items[block_idx];
+        vkFreeMemory(vk->device, block->memory, 0);
+        free(block->free_next);
+        free(block->free_prev);
+        free(block->free_order);
+        free(block);
+    }
+    kabarr_free(&vk->memory_blocks);
+}
+
+// Reserves size bytes of the ring without recording a copy. Returns the offset
+// into the ring buffer, or UINT64_MAX when the ring is full.
+uint64_t vulkan_staging_reserve(Vulkan_State *vk, VkDeviceSize size) {
+    Vulkan_Upload_Ring *ring = &vk->upload_ring;
+    VkDeviceSize capacity = ring->buffer.size;
+    uint64_t start;
+    for (;;) {
+        uint64_t head = ring->head;
+        start = (head + 15) & ~15ull;
+        // Never wrap in the middle of a copy, skip to the start of the ring instead.
+        if (start % capacity + size > capacity) start += capacity - start % capacity;
+        if (start + size - ring->tail > capacity) return UINT64_MAX;
+        if (atomic_compare_exchange_u64(&ring->head, head, start + size) == head) break;
+    }
+    return start % capacity;
+}
+
+// Reserves size bytes of the upload ring and returns mapped memory to write
+// them into. Safe to call from any lane, each lane keeps its own copy list.
+// Returns 0 when the ring is full, try again next frame.
+void *vulkan_staging_push(Vulkan_State *vk, uint32_t lane_index, VkBuffer dst, VkDeviceSize dst_offset, VkDeviceSize size) {
+    Vulkan_Upload_Ring *ring = &vk->upload_ring;
+    uint64_t offset = vulkan_staging_reserve(vk, size);
+    if (offset == UINT64_MAX) return 0;
+    Vulkan_Upload upload = { .src = ring->buffer.handle, .dst = dst, .region = { offset, dst_offset, size } };
+    kabarr_append(&ring->lane_uploads[lane_index], upload);
+    return (uint8_t *)ring->buffer.allocation.mapped + offset;
+}
+
+// Lane 0 only. Fills the first mip of a 2D color image, which is moved to
+// SHADER_READ_ONLY_OPTIMAL once the copy is done.
+void *vulkan_staging_push_image(Vulkan_State *vk, VkImage dst, VkExtent3D extent, VkDeviceSize size) {
+    Vulkan_Upload_Ring *ring = &vk->upload_ring;
+    uint64_t offset = vulkan_staging_reserve(vk, size);
+    if (offset == UINT64_MAX) return 0;
+    Vulkan_Image_Upload upload = {};
+    upload.src = ring->buffer.handle;
+    upload.dst = dst;
+    upload.region.bufferOffset = offset;
+    upload.region.imageSubresource = (VkImageSubresourceLayers){ VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    upload.region.imageExtent = extent;
+    kabarr_append(&ring->image_uploads, upload);
+    return (uint8_t *)ring->buffer.allocation.mapped + offset;
+}
+
+// GPU side copies within a buffer. These run on the graphics queue before the
+// frame's uploads are visible.
+void vulkan_staging_push_move(Vulkan_State *vk, VkBuffer buffer, VkDeviceSize src_offset, VkDeviceSize dst_offset, VkDeviceSize size) {
+    Vulkan_Upload move = { .src = buffer, .dst = buffer, .region = { src_offset, dst_offset, size } };
+    kabarr_append(&vk->upload_ring.moves, move);
+}
+
+// Drops queued moves that read from or write to any of [offset, offset + size)
+// because newer data is about to be uploaded there.
+void vulkan_staging_cancel_moves(Vulkan_State *vk, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size) {
+    Vulkan_Uploads *moves = &vk->upload_ring.moves;
+    VkDeviceSize end = offset + size;
+    for (uint32_t move_idx = 0; move_idx < moves->count;) {
+        Vulkan_Upload *move = &moves->items[move_idx];
+        VkBufferCopy *region = &move->region;
+        bool reads = move->src == buffer && region->srcOffset < end && offset < region->srcOffset + region->size;
+        bool writes = move->dst == buffer && region->dstOffset < end && offset < region->dstOffset + region->size;
+        if (reads || writes) {
+            *move = moves->items[--moves->count];
+        } else {
+            ++move_idx;
+        }
+    }
+}
+
+bool vulkan_backend_create_upload_ring(Vulkan_State *vk) {
+    Vulkan_Upload_Ring *ring = &vk->upload_ring;
+    if (!vulkan_buffer_create(vk, VULKAN_UPLOAD_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &ring->buffer)) {
+        print_error("Vulkan failed to create upload ring");
+        return false;
+    }
+    ring->head = 0;
+    ring->tail = 0;
+    ring->stats_begin_ns = get_time_ns();
+
+    VkSemaphoreTypeCreateInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timeline_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timeline_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &timeline_info;
+    if (vkCreateSemaphore(vk->device, &semaphore_info, 0, &vk->transfer_timeline) != VK_SUCCESS) {
+        print_error("Vulkan failed to create transfer timeline semaphore");
+        return false;
+    }
+    vk->transfer_value = 0;
+
+    if (vk->transfer_queue) {
+        print_info("Uploads use transfer queue family %u", vk->transfer_family);
+    } else {
+        print_info("No transfer only queue family, uploads use the graphics queue");
+    }
+    return true;
+}
+
+void vulkan_upload_ring_update_stats(Vulkan_State *vk, VkDeviceSize bytes) {
+    Vulkan_Upload_Ring *ring = &vk->upload_ring;
+    ring->stats_bytes += bytes;
+    uint64_t now = get_time_ns();
+    if (now - ring->stats_begin_ns >= 1000000000ull) {
+        double seconds = (double)(now - ring->stats_begin_ns) / 1000000000.0;
+        ring->megabytes_per_second = (float)((double)ring->stats_bytes / (1 << 20) / seconds);
+        if (ring->stats_bytes) print_info("Uploads: %.2f MB/s", ring->megabytes_per_second);
+        ring->stats_bytes = 0;
+        ring->stats_begin_ns = now;
+    }
+}
+
+// Fresh images have nothing worth keeping, so they go straight from UNDEFINED
+// to TRANSFER_DST and on to SHADER_READ_ONLY after the copy.
+void vulkan_record_image_uploads(Vulkan_State *vk, Fixed_Arena *arena, VkCommandBuffer cmd) {
+    Vulkan_Image_Uploads *uploads = &vk->upload_ring.image_uploads;
+    if (!uploads->count) return;
+
+    Scratch_Arena scratch = arena_begin_scratch(arena);
+    VkImageMemoryBarrier *barriers = push_array(scratch.arena, VkImageMemoryBarrier, uploads->count);
+    if (barriers) {
+        for (uint32_t upload_idx = 0; upload_idx < uploads->count; ++upload_idx) {
+            barriers[upload_idx] = (VkImageMemoryBarrier){
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask = 0,
+                .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = uploads->items[upload_idx].dst,
+                .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+            };
+        }
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 0, 0, (uint32_t)uploads->count, barriers);
+
+        for (uint32_t upload_idx = 0; upload_idx < uploads->count; ++upload_idx) {
+            Vulkan_Image_Upload *upload = &uploads->items[upload_idx];
+            vkCmdCopyBufferToImage(cmd, upload->src, upload->dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &upload->region);
+            barriers[upload_idx].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barriers[upload_idx].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            barriers[upload_idx].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barriers[upload_idx].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        }
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 0, 0, 0, 0, (uint32_t)uploads->count, barriers);
+    }
+    arena_end_scratch(&scratch);
+    uploads->count = 0;
+}
+
+void vulkan_record_moves(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Uploads *moves = &vk->upload_ring.moves;
+    if (!moves->count) return;
+
+    // Earlier frames may still be reading what gets written here.
+    VkMemoryBarrier before = {};
+    before.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    before.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    before.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &before, 0, 0, 0, 0);
+
+    for (uint32_t move_idx = 0; move_idx < moves->count; ++move_idx) {
+        Vulkan_Upload *move = &moves->items[move_idx];
+        vkCmdCopyBuffer(cmd, move->src, move->dst, 1, &move->region);
+    }
+    moves->count = 0;
+
+    VkMemoryBarrier after = {};
+    after.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    after.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    after.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &after, 0, 0, 0, 0);
+}
+
+// Lane 0, before the frame's render passes are recorded. Uploads from every
+// lane are batched into one transfer queue submission that the graphics
+// submission of this frame waits on.
+void vulkan_backend_record_uploads(Vulkan_State *vk, Fixed_Arena *arena, VkCommandBuffer cmd) {
+    Vulkan_Upload_Ring *ring = &vk->upload_ring;
+    Vulkan_Frame *frame = &vk->frames[vk->frame_index];
+    frame->transfer_value = 0;
+    frame->upload_ring_end = ring->head;
+
+    uint32_t upload_count = 0;
+    VkDeviceSize upload_bytes = 0;
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        Vulkan_Uploads *uploads = &ring->lane_uploads[lane_idx];
+        upload_count += uploads->count;
+        for (uint32_t upload_idx = 0; upload_idx < uploads->count; ++upload_idx) upload_bytes += uploads->items[upload_idx].region.size;
+    }
+    vulkan_upload_ring_update_stats(vk, upload_bytes);
+
+    // Moves and uploads never touch the same bytes, vulkan_staging_cancel_moves
+    // drops every move that reads or writes a range about to be uploaded. So
+    // their order doesn't matter, and with a transfer queue the uploads go in
+    // their own submission anyway.
+    vulkan_record_moves(vk, cmd);
+    vulkan_record_image_uploads(vk, arena, cmd);
+    if (!upload_count) return;
+
+    bool use_transfer_queue = vk->transfer_queue != VK_NULL_HANDLE;
+    VkCommandBuffer copy_cmd = cmd;
+    if (use_transfer_queue) {
+        vkResetCommandPool(vk->device, frame->transfer_pool, 0);
+        VkCommandBufferBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(frame->transfer_command_buffer, &begin_info);
+        copy_cmd = frame->transfer_command_buffer;
+    } else {
+        VkMemoryBarrier before = {};
+        before.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        before.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        before.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &before, 0, 0, 0, 0);
+    }
+
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        Vulkan_Uploads *uploads = &ring->lane_uploads[lane_idx];
+        for (uint32_t upload_idx = 0; upload_idx < uploads->count; ++upload_idx) {
+            Vulkan_Upload *upload = &uploads->items[upload_idx];
+            vkCmdCopyBuffer(copy_cmd, upload->src, upload->dst, 1, &upload->region);
+        }
+    }
+
+    if (use_transfer_queue) {
+        // Upload destinations are made by vulkan_buffer_create_shared, so the
+        // graphics family reads them without an ownership transfer. The graphics
+        // submission waits for this one on transfer_timeline.
+        vkEndCommandBuffer(copy_cmd);
+
+        // The copies can overwrite ranges that the previous frame still reads.
+        uint64_t wait_value = vk->frame_number;
+        uint64_t signal_value = ++vk->transfer_value;
+        VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+        VkTimelineSemaphoreSubmitInfo timeline_info = {};
+        timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timeline_info.waitSemaphoreValueCount = 1;
+        timeline_info.pWaitSemaphoreValues = &wait_value;
+        timeline_info.signalSemaphoreValueCount = 1;
+        timeline_info.pSignalSemaphoreValues = &signal_value;
+
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.pNext = &timeline_info;
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &vk->timeline;
+        submit_info.pWaitDstStageMask = &wait_stage;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &copy_cmd;
+        submit_info.signalSemaphoreCount = 1;
+        submit_info.pSignalSemaphores = &vk->transfer_timeline;
+        if (vkQueueSubmit(vk->transfer_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+            print_error("Vulkan failed to submit uploads");
+        } else {
+            frame->transfer_value = signal_value;
+        }
+    }
+
+    VkMemoryBarrier after = {};
+    after.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    after.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    after.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &after, 0, 0, 0, 0);
+
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        ring->lane_uploads[lane_idx].count = 0;
+    }
+}
+
+bool vulkan_backend_create_frames(Vulkan_State *vk, uint32_t lane_count) {
+    for (uint32_t frame_idx = 0; frame_idx < VULKAN_FRAMES_IN_FLIGHT; ++frame_idx) {
+        Vulkan_Frame *frame = &vk->frames[frame_idx];
+
+        // Pools are reset wholesale at the start of the frame, so the buffers never get reset individually.
+        VkCommandPoolCreateInfo pool_info = {};
+        pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        pool_info.queueFamilyIndex = vk->graphics_family;
+        if (vkCreateCommandPool(vk->device, &pool_info, 0, &frame->command_pool) != VK_SUCCESS) {
+            print_error("Vulkan failed to create frame command pool");
+            return false;
+        }
+
+        VkCommandBufferAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = frame->command_pool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(vk->device, &alloc_info, &frame->command_buffer) != VK_SUCCESS) {
+            print_error("Vulkan failed to allocate frame command buffer");
+            return false;
+        }
+        frame->timeline_value = 0;
+
+        if (vk->transfer_queue) {
+            pool_info.queueFamilyIndex = vk->transfer_family;
+            if (vkCreateCommandPool(vk->device, &pool_info, 0, &frame->transfer_pool) != VK_SUCCESS) {
+                print_error("Vulkan failed to create frame transfer command pool");
+                return false;
+            }
+            alloc_info.commandPool = frame->transfer_pool;
+            if (vkAllocateCommandBuffers(vk->device, &alloc_info, &frame->transfer_command_buffer) != VK_SUCCESS) {
+                print_error("Vulkan failed to allocate frame transfer command buffer");
+                return false;
+            }
+        }
+
+        if (vk->compute_queue) {
+            pool_info.queueFamilyIndex = vk->compute_family;
+            if (vkCreateCommandPool(vk->device, &pool_info, 0, &frame->compute_pool) != VK_SUCCESS) {
+                print_error("Vulkan failed to create frame compute command pool");
+                return false;
+            }
+            alloc_info.commandPool = frame->compute_pool;
+            if (vkAllocateCommandBuffers(vk->device, &alloc_info, &frame->compute_command_buffer) != VK_SUCCESS) {
+                print_error("Vulkan failed to allocate frame compute command buffer");
+                return false;
+            }
+        }
+    }
+
+    vk->lane_count = clamp(lane_count, 1, VULKAN_MAX_LANES);
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        Vulkan_Lane *lane = &vk->lanes[lane_idx];
+        for (uint32_t frame_idx = 0; frame_idx < VULKAN_FRAMES_IN_FLIGHT; ++frame_idx) {
+            VkCommandPoolCreateInfo pool_info = {};
+            pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            pool_info.queueFamilyIndex = vk->graphics_family;
+            if (vkCreateCommandPool(vk->device, &pool_info, 0, &lane->command_pools[frame_idx]) != VK_SUCCESS) {
+                print_error("Vulkan failed to create lane command pool");
+                return false;
+            }
+
+            VkCommandBufferAllocateInfo alloc_info = {};
+            alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            alloc_info.commandPool = lane->command_pools[frame_idx];
+            alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            alloc_info.commandBufferCount = 1;
+            if (vkAllocateCommandBuffers(vk->device, &alloc_info, &lane->command_buffers[frame_idx]) != VK_SUCCESS) {
+                print_error("Vulkan failed to allocate lane command buffer");
+                return false;
+            }
+        }
+    }
+
+    VkSemaphoreTypeCreateInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timeline_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timeline_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo timeline_semaphore_info = {};
+    timeline_semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    timeline_semaphore_info.pNext = &timeline_info;
+    if (vkCreateSemaphore(vk->device, &timeline_semaphore_info, 0, &vk->timeline) != VK_SUCCESS) {
+        print_error("Vulkan failed to create timeline semaphore");
+        return false;
+    }
+    if (vkCreateSemaphore(vk->device, &timeline_semaphore_info, 0, &vk->compute_timeline) != VK_SUCCESS) {
+        print_error("Vulkan failed to create compute timeline semaphore");
+        return false;
+    }
+    vk->compute_value = 0;
+    if (vk->compute_queue) {
+        print_info("Async compute uses queue family %u", vk->compute_family);
+    } else {
+        print_info("No compute only queue family, async passes run on the graphics queue");
+    }
+
+    // Binary semaphores for acquire and present. These are sized for the largest
+    // swapchain so that recreating the swapchain never has to touch them.
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    bool result = vkCreateSemaphore(vk->device, &semaphore_info, 0, &vk->spare_acquire_semaphore) == VK_SUCCESS;
+    for (uint32_t image_idx = 0; image_idx < VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT && result; ++image_idx) {
+        result = vkCreateSemaphore(vk->device, &semaphore_info, 0, &vk->acquire_semaphores[image_idx]) == VK_SUCCESS &&
+                 vkCreateSemaphore(vk->device, &semaphore_info, 0, &vk->present_semaphores[image_idx]) == VK_SUCCESS;
+    }
+    if (!result) print_error("Vulkan failed to create swapchain semaphores");
+
+    vk->frame_number = 0;
+    return result;
+}
+
+bool vulkan_bindless_init(Vulkan_State *vk) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        { .binding = VULKAN_BINDLESS_TEXTURE_BINDING, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          .descriptorCount = VULKAN_BINDLESS_MAX_TEXTURES, .stageFlags = VK_SHADER_STAGE_ALL },
+        { .binding = VULKAN_BINDLESS_BUFFER_BINDING, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          .descriptorCount = VULKAN_BINDLESS_MAX_BUFFERS, .stageFlags = VK_SHADER_STAGE_ALL },
+    };
+    // Slots nobody uses yet may stay unwritten, and writing one never disturbs
+    // command buffers that already have the set bound.
+    VkDescriptorBindingFlags binding_flags[array_count(bindings)];
+    for (uint32_t binding_idx = 0; binding_idx < array_count(bindings); ++binding_idx) {
+        binding_flags[binding_idx] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+    }
+    VkDescriptorSetLayoutBindingFlagsCreateInfo flags_info = {};
+    flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    flags_info.bindingCount = array_count(binding_flags);
+    flags_info.pBindingFlags = binding_flags;
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.pNext = &flags_info;
+    layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layout_info.bindingCount = array_count(bindings);
+    layout_info.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &bindless->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create bindless descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorSetLayoutCreateInfo empty_info = {};
+    empty_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    if (vkCreateDescriptorSetLayout(vk->device, &empty_info, 0, &bindless->empty_set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create empty descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VULKAN_BINDLESS_MAX_TEXTURES },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VULKAN_BINDLESS_MAX_BUFFERS },
+    };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = array_count(pool_sizes);
+    pool_info.pPoolSizes = pool_sizes;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &bindless->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create bindless descriptor pool");
+        return false;
+    }
+
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = bindless->descriptor_pool;
+    set_info.descriptorSetCount = 1;
+    set_info.pSetLayouts = &bindless->set_layout;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, &bindless->descriptor_set) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate bindless descriptor set");
+        return false;
+    }
+
+    // Block textures want crisp texels.
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+    if (vkCreateSampler(vk->device, &sampler_info, 0, &bindless->sampler) != VK_SUCCESS) {
+        print_error("Vulkan failed to create bindless sampler");
+        return false;
+    }
+    return true;
+}
+
+bool vulkan_bindless_alloc_slot(Vulkan_Indices *free_slots, uint32_t *high_water, uint32_t max, uint32_t *index) {
+    if (free_slots->count) {
+        *index = free_slots->items[--free_slots->count];
+        return true;
+    }
+    if (*high_water >= max) return false;
+    *index = (*high_water)++;
+    return true;
+}
+
+// Invalidates the handle now, the slot and its resource are freed once the GPU
+// is done with the current frame.
+void vulkan_bindless_release(Vulkan_State *vk, Vulkan_Bindless_Kind kind, uint32_t index) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    uint32_t *generations = kind == Vulkan_Bindless_Kind_Texture ? bindless->texture_generations : bindless->buffer_generations;
+    generations[index] += 1;
+    Vulkan_Bindless_Release release = { .kind = kind, .index = index, .release_value = vk->frame_number + 1 };
+    kabarr_append(&bindless->pending, release);
+}
+
+Vulkan_Image *vulkan_texture_get(Vulkan_State *vk, Vulkan_Handle handle) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    if (handle.index >= bindless->texture_high_water || handle.generation != bindless->texture_generations[handle.index]) return 0;
+    return &bindless->textures[handle.index];
+}
+
+Vulkan_Buffer *vulkan_storage_buffer_get(Vulkan_State *vk, Vulkan_Handle handle) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    if (handle.index >= bindless->buffer_high_water || handle.generation != bindless->buffer_generations[handle.index]) return 0;
+    return &bindless->buffers[handle.index];
+}
+
+void vulkan_texture_destroy(Vulkan_State *vk, Vulkan_Handle handle) {
+    if (vulkan_texture_get(vk, handle)) vulkan_bindless_release(vk, Vulkan_Bindless_Kind_Texture, handle.index);
+}
+
+void vulkan_storage_buffer_destroy(Vulkan_State *vk, Vulkan_Handle handle) {
+    if (vulkan_storage_buffer_get(vk, handle)) vulkan_bindless_release(vk, Vulkan_Bindless_Kind_Buffer, handle.index);
+}
+
+// Lane 0, between begin and end frame. rgba is width*height tightly packed
+// RGBA8 texels. Returns a zero handle on failure.
+Vulkan_Handle vulkan_texture_create(Vulkan_State *vk, uint32_t width, uint32_t height, const uint8_t *rgba) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    Vulkan_Handle handle = {};
+    uint32_t index;
+    if (!vulkan_bindless_alloc_slot(&bindless->free_textures, &bindless->texture_high_water, VULKAN_BINDLESS_MAX_TEXTURES, &index)) {
+        print_error("Out of bindless texture slots");
+        return handle;
+    }
+
+    VkImageCreateInfo image_info = {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = VK_FORMAT_R8G8B8A8_SRGB;
+    image_info.extent = (VkExtent3D){ width, height, 1 };
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    Vulkan_Image *texture = &bindless->textures[index];
+    if (!vulkan_image_create(vk, &image_info, VK_IMAGE_VIEW_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, texture)) {
+        vulkan_image_destroy(vk, texture);
+        kabarr_append(&bindless->free_textures, index);
+        return handle;
+    }
+    bindless->texture_generations[index] += 1;
+    handle = (Vulkan_Handle){ index, bindless->texture_generations[index] };
+
+    VkDeviceSize size = (VkDeviceSize)width*height*4;
+    void *staging = vulkan_staging_push_image(vk, texture->handle, image_info.extent, size);
+    if (!staging) {
+        print_error("No upload space left for a %ux%u texture", width, height);
+        vulkan_texture_destroy(vk, handle);
+        return (Vulkan_Handle){};
+    }
+    memcpy(staging, rgba, size);
+
+    VkDescriptorImageInfo descriptor_info = { bindless->sampler, texture->view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = bindless->descriptor_set;
+    write.dstBinding = VULKAN_BINDLESS_TEXTURE_BINDING;
+    write.dstArrayElement = index;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &descriptor_info;
+    vkUpdateDescriptorSets(vk->device, 1, &write, 0, 0);
+    return handle;
+}
+
+// Lane 0, between begin and end frame. Large buffers are staged in pieces so
+// they never need a single run of the ring. Returns a zero handle on failure.
+Vulkan_Handle vulkan_storage_buffer_create(Vulkan_State *vk, const void *data, VkDeviceSize size) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    Vulkan_Handle handle = {};
+    uint32_t index;
+    if (!vulkan_bindless_alloc_slot(&bindless->free_buffers, &bindless->buffer_high_water, VULKAN_BINDLESS_MAX_BUFFERS, &index)) {
+        print_error("Out of bindless buffer slots");
+        return handle;
+    }
+
+    Vulkan_Buffer *buffer = &bindless->buffers[index];
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (!vulkan_buffer_create_shared(vk, size, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer)) {
+        vulkan_buffer_destroy(vk, buffer);
+        kabarr_append(&bindless->free_buffers, index);
+        return handle;
+    }
+    bindless->buffer_generations[index] += 1;
+    handle = (Vulkan_Handle){ index, bindless->buffer_generations[index] };
+
+    // Copies already queued still land in the buffer, so a failure releases it
+    // through the usual deferred path.
+    VkDeviceSize piece_size = VULKAN_UPLOAD_RING_SIZE / 8;
+    for (VkDeviceSize offset = 0; offset < size; offset += piece_size) {
+        VkDeviceSize piece = size - offset < piece_size ? size - offset : piece_size;
+        void *staging = vulkan_staging_push(vk, 0, buffer->handle, offset, piece);
+        if (!staging) {
+            print_error("No upload space left for a %llu byte buffer", (unsigned long long)size);
+            vulkan_storage_buffer_destroy(vk, handle);
+            return (Vulkan_Handle){};
+        }
+        memcpy(staging, (const uint8_t *)data + offset, piece);
+    }
+
+    VkDescriptorBufferInfo descriptor_info = { buffer->handle, 0, VK_WHOLE_SIZE };
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = bindless->descriptor_set;
+    write.dstBinding = VULKAN_BINDLESS_BUFFER_BINDING;
+    write.dstArrayElement = index;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &descriptor_info;
+    vkUpdateDescriptorSets(vk->device, 1, &write, 0, 0);
+    return handle;
+}
+
+void vulkan_bindless_update(Vulkan_State *vk) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    if (!bindless->pending.count) return;
+
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(vk->device, vk->timeline, &completed);
+    for (uint32_t release_idx = 0; release_idx < bindless->pending.count;) {
+        Vulkan_Bindless_Release *release = &bindless->pending.items[release_idx];
+        if (release->release_value <= completed) {
+            if (release->kind == Vulkan_Bindless_Kind_Texture) {
+                vulkan_image_destroy(vk, &bindless->textures[release->index]);
+                kabarr_append(&bindless->free_textures, release->index);
+            } else {
+                vulkan_buffer_destroy(vk, &bindless->buffers[release->index]);
+                kabarr_append(&bindless->free_buffers, release->index);
+            }
+            *release = bindless->pending.items[--bindless->pending.count];
+        } else {
+            ++release_idx;
+        }
+    }
+}
+
+void vulkan_bindless_shutdown(Vulkan_State *vk) {
+    Vulkan_Bindless *bindless = &vk->bindless;
+    for (uint32_t texture_idx = 0; texture_idx < bindless->texture_high_water; ++texture_idx) {
+        vulkan_image_destroy(vk, &bindless->textures[texture_idx]);
+    }
+    for (uint32_t buffer_idx = 0; buffer_idx < bindless->buffer_high_water; ++buffer_idx) {
+        vulkan_buffer_destroy(vk, &bindless->buffers[buffer_idx]);
+    }
+    kabarr_free(&bindless->free_textures);
+    kabarr_free(&bindless->free_buffers);
+    kabarr_free(&bindless->pending);
+    vkDestroySampler(vk->device, bindless->sampler, 0);
+    vkDestroyDescriptorPool(vk->device, bindless->descriptor_pool, 0);
+    vkDestroyDescriptorSetLayout(vk->device, bindless->set_layout, 0);
+    vkDestroyDescriptorSetLayout(vk->device, bindless->empty_set_layout, 0);
+}
+
+// Reads the device clock and the get_time_ns clock together. Redone with every
+// stats report since the two drift apart over minutes.
+void vulkan_profiler_calibrate(Vulkan_State *vk) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    if (!profiler->calibrated) return;
+    VkCalibratedTimestampInfoEXT infos[2] = {};
+    infos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+    infos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[1].timeDomain = profiler->host_domain;
+    uint64_t timestamps[2];
+    uint64_t max_deviation = 0;
+    if (vkGetCalibratedTimestampsEXT(vk->device, array_count(infos), infos, timestamps, &max_deviation) != VK_SUCCESS) return;
+    double device_ns = (double)(timestamps[0] & profiler->valid_mask)*profiler->period_ns;
+    profiler->gpu_offset_ns = (int64_t)host_clock_to_ns(timestamps[1]) - (int64_t)device_ns;
+}
+
+bool vulkan_profiler_init(Vulkan_State *vk, Fixed_Arena *arena) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    Scratch_Arena scratch = arena_begin_scratch(arena);
+
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vk->phys_device, &family_count, 0);
+    VkQueueFamilyProperties *families = push_array(scratch.arena, VkQueueFamilyProperties, family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(vk->phys_device, &family_count, families);
+    uint32_t valid_bits = families[vk->graphics_family].timestampValidBits;
+    profiler->compute_timestamps = vk->compute_queue && families[vk->compute_family].timestampValidBits;
+    if (!valid_bits) {
+        print_info("GPU profiler disabled, the graphics queue has no timestamps");
+        profiler->calibrated = false;
+        arena_end_scratch(&scratch);
+        return true;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk->phys_device, &properties);
+    profiler->period_ns = (double)properties.limits.timestampPeriod;
+    profiler->valid_mask = valid_bits >= 64 ? UINT64_MAX : (1ull << valid_bits) - 1;
+
+    VkQueryPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = VULKAN_FRAMES_IN_FLIGHT*2*VULKAN_PROFILER_MAX_ZONES;
+    if (vkCreateQueryPool(vk->device, &pool_info, 0, &profiler->query_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create timestamp query pool");
+        arena_end_scratch(&scratch);
+        return false;
+    }
+    profiler->enabled = true;
+
+#if defined(_WIN32)
+    profiler->host_domain = VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_EXT;
+#else
+    profiler->host_domain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+#endif
+    if (profiler->calibrated) {
+        uint32_t domain_count = 0;
+        vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(vk->phys_device, &domain_count, 0);
+        VkTimeDomainEXT *domains = push_array(scratch.arena, VkTimeDomainEXT, domain_count);
+        vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(vk->phys_device, &domain_count, domains);
+        bool has_device = false;
+        bool has_host = false;
+        for (uint32_t domain_idx = 0; domain_idx < domain_count; ++domain_idx) {
+            if (domains[domain_idx] == VK_TIME_DOMAIN_DEVICE_EXT) has_device = true;
+            if (domains[domain_idx] == profiler->host_domain) has_host = true;
+        }
+        profiler->calibrated = has_device && has_host;
+    }
+    vulkan_profiler_calibrate(vk);
+    print_info("GPU profiler on, %.2f ns per tick, %s", profiler->period_ns,
+               profiler->calibrated ? "calibrated to the CPU clock" : "zones aligned to submits");
+
+    arena_end_scratch(&scratch);
+    return true;
+}
+
+// BOXEL_TRACE=path writes every frame's lane recording and GPU zones as
+// chrome://tracing JSON until shutdown.
+void vulkan_profiler_open_trace(Vulkan_State *vk, const char *path) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    profiler->trace = fopen(path, "wb");
+    if (!profiler->trace) {
+        print_error("Failed to open trace file %s", path);
+        return;
+    }
+    profiler->trace_begin_ns = get_time_ns();
+    // The first event goes without the separator the others lead with.
+    fprintf(profiler->trace, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"CPU\"}}");
+    fprintf(profiler->trace, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"GPU\"}}");
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        fprintf(profiler->trace, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"lane %u\"}}", lane_idx, lane_idx);
+    }
+    fprintf(profiler->trace, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"graphics\"}}");
+    fprintf(profiler->trace, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"async compute\"}}");
+    print_info("Tracing to %s", path);
+}
+
+void vulkan_profiler_trace_event(Vulkan_Profiler *profiler, const char *name, uint32_t pid, uint32_t tid, uint64_t begin_ns, uint64_t end_ns, uint64_t frame_number) {
+    double begin_us = (double)(int64_t)(begin_ns - profiler->trace_begin_ns) / 1000.0;
+    double duration_us = end_ns > begin_ns ? (double)(end_ns - begin_ns) / 1000.0 : 0.0;
+    fprintf(profiler->trace, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+            name, pid, tid, begin_us, duration_us, (unsigned long long)frame_number);
+}
+
+// Each zone resets its own pair on the queue that writes it, so the
+// graphics and async compute queues never race on a reset.
+void vulkan_profiler_reset(Vulkan_State *vk, VkCommandBuffer cmd, uint32_t zone) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    if (profiler->enabled) vkCmdResetQueryPool(cmd, profiler->query_pool, vk->frame_index*2*VULKAN_PROFILER_MAX_ZONES + zone*2, 2);
+}
+
+// Zone ids are graph pass ids, the frame zone comes after the last pass.
+void vulkan_profiler_write(Vulkan_State *vk, VkCommandBuffer cmd, uint32_t zone, bool end) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    if (!profiler->enabled) return;
+    if (!end) vulkan_profiler_reset(vk, cmd, zone);
+    uint32_t query = vk->frame_index*2*VULKAN_PROFILER_MAX_ZONES + zone*2 + (end ? 1 : 0);
+    vkCmdWriteTimestamp(cmd, end ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, profiler->query_pool, query);
+}
+
+void vulkan_profiler_begin_frame(Vulkan_State *vk, VkCommandBuffer cmd) {
+    vulkan_profiler_write(vk, cmd, vk->graph.pass_count, false);
+}
+
+// The lanes have finished recording by now, so their spans go into the trace
+// here while the GPU zones of this frame follow once they're read back.
+void vulkan_profiler_end_frame(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    uint64_t frame_number = vk->frame_number + 1;
+    if (profiler->enabled) {
+        vulkan_profiler_write(vk, cmd, vk->graph.pass_count, true);
+        profiler->pending[vk->frame_index] = true;
+        profiler->submit_ns[vk->frame_index] = get_time_ns();
+        profiler->frame_numbers[vk->frame_index] = frame_number;
+    }
+    if (!profiler->trace) return;
+    if (vk->pacing.frame_begin_ns) vulkan_profiler_trace_event(profiler, "frame", 0, 0, vk->pacing.frame_begin_ns, get_time_ns(), frame_number);
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        Vulkan_Lane *lane = &vk->lanes[lane_idx];
+        vulkan_profiler_trace_event(profiler, "record", 0, lane_idx, lane->record_begin_ns, lane->record_end_ns, frame_number);
+    }
+}
+
+// Called once the frame slot is free again, which means the timestamps its
+// last frame wrote are available and reading them never waits.
+void vulkan_profiler_collect(Vulkan_State *vk) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    uint32_t slot = vk->frame_index;
+    memset(profiler->zone_ns, 0, sizeof(profiler->zone_ns));
+    if (!profiler->pending[slot]) return;
+    profiler->pending[slot] = false;
+
+    // Async zones are missing when the compute queue can't write timestamps,
+    // the frame zone when the frame was recorded but never submitted.
+    uint32_t pass_count = vk->graph.pass_count;
+    uint64_t results[2*VULKAN_PROFILER_MAX_ZONES][2];   // timestamp, availability
+    VkResult result = vkGetQueryPoolResults(vk->device, profiler->query_pool, slot*2*VULKAN_PROFILER_MAX_ZONES, 2*(pass_count + 1),
+                                            sizeof(results), results, sizeof(results[0]), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (result != VK_SUCCESS && result != VK_NOT_READY) return;
+    if (!results[2*pass_count][1] || !results[2*pass_count + 1][1]) return;
+
+    uint64_t begins[VULKAN_PROFILER_MAX_ZONES];
+    uint64_t ends[VULKAN_PROFILER_MAX_ZONES];
+    bool valid[VULKAN_PROFILER_MAX_ZONES];
+    for (uint32_t zone = 0; zone <= pass_count; ++zone) {
+        valid[zone] = results[2*zone][1] && results[2*zone + 1][1];
+        begins[zone] = results[2*zone][0] & profiler->valid_mask;
+        ends[zone] = begins[zone] + ((results[2*zone + 1][0] - begins[zone]) & profiler->valid_mask);
+    }
+
+    int64_t offset_ns = profiler->gpu_offset_ns;
+    if (!profiler->calibrated) offset_ns = (int64_t)profiler->submit_ns[slot] - (int64_t)((double)begins[pass_count]*profiler->period_ns);
+    for (uint32_t zone = 0; zone <= pass_count; ++zone) {
+        if (!valid[zone]) continue;
+        uint64_t duration_ns = (uint64_t)((double)(ends[zone] - begins[zone])*profiler->period_ns);
+        profiler->zone_ns[zone] = duration_ns;
+        profiler->stats_zone_ns[zone] += duration_ns;
+        bool async = zone < pass_count && vk->graph.passes[zone].async && vk->compute_queue;
+        if (async) {
+            // Both queues tick on the device clock, so their zones line up.
+            profiler->stats_async_ns += duration_ns;
+            for (uint32_t other = 0; other < pass_count; ++other) {
+                if (!valid[other] || vk->graph.passes[other].async) continue;
+                uint64_t overlap_begin = kabarr_max(begins[zone], begins[other]);
+                uint64_t overlap_end = ends[zone] < ends[other] ? ends[zone] : ends[other];
+                if (overlap_end > overlap_begin) profiler->stats_overlap_ns += (uint64_t)((double)(overlap_end - overlap_begin)*profiler->period_ns);
+            }
+        }
+        if (profiler->trace) {
+            uint64_t begin_ns = (uint64_t)((int64_t)((double)begins[zone]*profiler->period_ns) + offset_ns);
+            const char *name = zone < pass_count ? vk->graph.passes[zone].name : "frame";
+            vulkan_profiler_trace_event(profiler, name, 1, async ? 1 : 0, begin_ns, begin_ns + duration_ns, profiler->frame_numbers[slot]);
+        }
+    }
+
+    if (++profiler->stats_frames == VULKAN_PROFILER_STATS_FRAMES) {
+        char passes[1024];
+        size_t used = 0;
+        passes[0] = 0;
+        for (uint32_t pass_id = 0; pass_id < pass_count && used < sizeof(passes); ++pass_id) {
+            double ms = (double)profiler->stats_zone_ns[pass_id] / (1000000.0*VULKAN_PROFILER_STATS_FRAMES);
+            used += snprintf(passes + used, sizeof(passes) - used, "%s%s %.3f", pass_id ? ", " : "", vk->graph.passes[pass_id].name, ms);
+        }
+        double gpu_ms = (double)profiler->stats_zone_ns[pass_count] / (1000000.0*VULKAN_PROFILER_STATS_FRAMES);
+        double cpu_ms = (double)vk->pacing.cpu_frame_ns / 1000000.0;
+        print_info("GPU frame %.3f ms against %.3f ms on the CPU (%s bound): %s",
+                   gpu_ms, cpu_ms, gpu_ms > cpu_ms ? "GPU" : "CPU", passes);
+        if (profiler->stats_async_ns) {
+            print_info("Async compute %.3f ms per frame, %.3f ms of it next to graphics passes",
+                       (double)profiler->stats_async_ns / (1000000.0*VULKAN_PROFILER_STATS_FRAMES),
+                       (double)profiler->stats_overlap_ns / (1000000.0*VULKAN_PROFILER_STATS_FRAMES));
+        }
+        memset(profiler->stats_zone_ns, 0, sizeof(profiler->stats_zone_ns));
+        profiler->stats_async_ns = 0;
+        profiler->stats_overlap_ns = 0;
+        profiler->stats_frames = 0;
+        vulkan_profiler_calibrate(vk);
+    }
+}
+
+void vulkan_profiler_shutdown(Vulkan_State *vk) {
+    Vulkan_Profiler *profiler = &vk->profiler;
+    if (profiler->query_pool) vkDestroyQueryPool(vk->device, profiler->query_pool, 0);
+    if (profiler->trace) {
+        fprintf(profiler->trace, "\n]\n");
+        fclose(profiler->trace);
+        profiler->trace = 0;
+    }
+}
+
+// BOXEL_BENCH_DISPATCH=N records N vkCmdSetScissor calls through the loader
+// trampoline and N through the device table into a throwaway command buffer.
+// Each side runs twice and the second run counts, so both are warm.
+bool vulkan_backend_bench_dispatch(Vulkan_State *vk, uint32_t call_count) {
+    PFN_vkCmdSetScissor trampoline = (PFN_vkCmdSetScissor)vkGetInstanceProcAddr(vk->instance, "vkCmdSetScissor");
+    if (!trampoline) return false;
+
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = vk->graphics_family;
+    VkCommandPool pool;
+    if (vkCreateCommandPool(vk->device, &pool_info, 0, &pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create the dispatch benchmark command pool");
+        return false;
+    }
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+    VkCommandBuffer cmd;
+    if (vkAllocateCommandBuffers(vk->device, &alloc_info, &cmd) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate the dispatch benchmark command buffer");
+        vkDestroyCommandPool(vk->device, pool, 0);
+        return false;
+    }
+
+    VkRect2D scissor = { { 0, 0 }, vk->extent };
+    uint64_t trampoline_ns = 0;
+    uint64_t direct_ns = 0;
+    for (uint32_t run = 0; run < 2; ++run) {
+        VkCommandBufferBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkResetCommandPool(vk->device, pool, 0);
+        vkBeginCommandBuffer(cmd, &begin_info);
+        uint64_t begin_ns = get_time_ns();
+        for (uint32_t call_idx = 0; call_idx < call_count; ++call_idx) trampoline(cmd, 0, 1, &scissor);
+        uint64_t middle_ns = get_time_ns();
+        for (uint32_t call_idx = 0; call_idx < call_count; ++call_idx) vk->device_table.vkCmdSetScissor(cmd, 0, 1, &scissor);
+        uint64_t end_ns = get_time_ns();
+        vkEndCommandBuffer(cmd);
+        trampoline_ns = middle_ns - begin_ns;
+        direct_ns = end_ns - middle_ns;
+    }
+    vkDestroyCommandPool(vk->device, pool, 0);
+
+    double trampoline_call_ns = call_count ? (double)trampoline_ns / call_count : 0.0;
+    double direct_call_ns = call_count ? (double)direct_ns / call_count : 0.0;
+    print_info("Dispatched %u commands at %.2f ns each through the loader, %.2f ns direct (%.2f ns saved per call)",
+               call_count, trampoline_call_ns, direct_call_ns, trampoline_call_ns - direct_call_ns);
+    return true;
+}
+
+bool vulkan_backend_init(Vulkan_State *vk, Fixed_Arena *scratch, void *window, int width, int height, uint32_t lane_count, const char *device_override, Vulkan_Present_Config *present_config) {
+    vk->present_config = *present_config;
+    if (volkInitialize() != VK_SUCCESS) {
+        print_error("Volk failed to initialize.");
+        return false;
+    }
+
+    const char *layers[] = { "VK_LAYER_KHRONOS_validation" };
+    const char *extensions[] = { "VK_KHR_surface", VK_PLATFORM_SURFACE };
+    if (!vulkan_backend_create_instance(vk, layers, array_count(layers), extensions, array_count(extensions))) return false;
+    volkLoadInstance(vk->instance);
+
+#if 0
+    Vulkan_Device_Info device_info = {0};
+    vulkan_device_info_init(&device_info);
+    vulkan_device_choose_color_format(&device_info, VK_FORMAT_B8G8R8A8_SRGB);
+    vulkan_device_choose_color_space(&device_info, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+    vulkan_device_choose_present_mode(&device_info, VK_PRESENT_MODE_MAILBOX_KHR);
+    vulkan_backend_select_device(vk, &device_info);
+
+    Vulkan_Swapchain_Info swapchain_info = {0};
+    vulkan_swapchain_info_init(&swapchain_info);
+    vulkan_backend_create_swapchain(vk, &swapchain_info);
+#endif
+
+    if (!vulkan_backend_create_surface(vk, window)) return false;
+    if (!vulkan_backend_select_device(vk, scratch, VK_FORMAT_B8G8R8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, device_override)) return false;
+    volkLoadDeviceTable(&vk->device_table, vk->device);
+    volkLoadDevice(vk->device);
+    vulkan_backend_choose_present_mode(vk, scratch);
+    vulkan_memory_init(vk);
+    if (!vulkan_backend_load_pipeline_cache(vk)) return false;
+    vulkan_pipeline_registry_init(&vk->pipelines);
+    if (!vulkan_backend_create_swapchain(vk, width, height)) return false;
+    if (!vulkan_backend_create_frames(vk, lane_count)) return false;
+    if (!vulkan_profiler_init(vk, scratch)) return false;
+    if (!vulkan_backend_create_upload_ring(vk)) return false;
+    if (!vulkan_bindless_init(vk)) return false;
+
+    return true;
+}
+
+bool vulkan_render_pass_add_attachment(Vulkan_Render_Pass_Info *info, VkFormat format, uint32_t sample_count, Vulkan_Attachment_Type type,
+                                       VkAttachmentLoadOp load_op, VkAttachmentStoreOp store_op, VkImageLayout initial_layout, VkImageLayout final_layout) {
+
+    VkSampleCountFlagBits sample_flag = 0;
+    switch (sample_count) {
+        case 1: { sample_flag = VK_SAMPLE_COUNT_1_BIT; } break;
+        case 2: { sample_flag = VK_SAMPLE_COUNT_2_BIT; } break;
+        case 4: { sample_flag = VK_SAMPLE_COUNT_4_BIT; } break;
+        case 8: { sample_flag = VK_SAMPLE_COUNT_8_BIT; } break;
+        case 16: { sample_flag = VK_SAMPLE_COUNT_16_BIT; } break;
+        case 32: { sample_flag = VK_SAMPLE_COUNT_32_BIT; } break;
+        case 64: { sample_flag = VK_SAMPLE_COUNT_64_BIT; } break;
+        default: {
+            print_error("Invalid multisample count. Must be power of 2 up to 64");
+            return false;
+        }
+    }
+
+    VkAttachmentReference ref = {0};
+    ref.attachment = (uint32_t)info->attachments.count;
+    switch (type) {
+        case Vulkan_Attachment_Type_Color: {
+            ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            kabarr_append(&info->attachment_refs, ref);
+        } break;
+        case Vulkan_Attachment_Type_Depth_Stencil:
+        case Vulkan_Attachment_Type_Depth_Stencil_Read_Only: {
+            if (info->has_depth) {
+                print_error("Render pass already has a depth attachment");
+                return false;
+            }
+            ref.layout = type == Vulkan_Attachment_Type_Depth_Stencil ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+            info->depth_ref = ref;
+            info->has_depth = true;
+        } break;
+        default: {
+            print_error("Unsupported render pass attachment type %d", type);
+            return false;
+        }
+    }
+
+    VkAttachmentDescription attachment = {0};
+    attachment.format = format;
+    attachment.samples = sample_flag;
+    attachment.loadOp = load_op;
+    attachment.storeOp = store_op;
+    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = initial_layout;
+    attachment.finalLayout = final_layout;
+    kabarr_append(&info->attachments, attachment);
+
+    return true;
+}
+
+// Frees the info's arrays either way. Without stage masks there are no
+// external dependencies and the caller synchronizes with barriers.
+bool vulkan_render_pass_create(VkDevice device, Vulkan_Render_Pass_Info *info, VkRenderPass *render_pass) {
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = (uint32_t)info->attachment_refs.count;
+    subpass.pColorAttachments = info->attachment_refs.items;
+    subpass.pDepthStencilAttachment = info->has_depth ? &info->depth_ref : 0;
+
+    VkSubpassDependency dependencies[] = {
+        {
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = info->source_stage_mask,
+            .srcAccessMask = info->source_access_mask,
+            .dstStageMask = info->dest_stage_mask,
+            .dstAccessMask = info->dest_access_mask,
+        },
+        {
+            .srcSubpass = 0,
+            .dstSubpass = VK_SUBPASS_EXTERNAL,
+            .srcStageMask = info->dest_stage_mask,
+            .srcAccessMask = info->dest_access_mask,
+            .dstStageMask = info->source_stage_mask,
+            .dstAccessMask = info->source_access_mask,
+        },
+    };
+
+    VkRenderPassCreateInfo render_pass_info = {};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.attachmentCount = (uint32_t)info->attachments.count;
+    render_pass_info.pAttachments = info->attachments.items;
+    render_pass_info.subpassCount = 1;
+    render_pass_info.pSubpasses = &subpass;
+    render_pass_info.dependencyCount = info->source_stage_mask ? array_count(dependencies) : 0;
+    render_pass_info.pDependencies = dependencies;
+
+    VkResult result = vkCreateRenderPass(device, &render_pass_info, 0, render_pass);
+    kabarr_free(&info->attachments);
+    kabarr_free(&info->attachment_refs);
+    if (result != VK_SUCCESS) {
+        print_error("Vulkan failed to create render pass");
+        return false;
+    }
+    return true;
+}
+
+uint32_t vulkan_graph_add_resource(Vulkan_Graph *graph, const char *name, Vulkan_Graph_Resource_Type type) {
+    if (graph->resource_count == VULKAN_GRAPH_MAX_RESOURCES) {
+        print_error("Render graph is out of resources for %s", name);
+        return VULKAN_GRAPH_NONE;
+    }
+    uint32_t id = graph->resource_count++;
+    Vulkan_Graph_Resource *resource = &graph->resources[id];
+    *resource = (Vulkan_Graph_Resource){0};
+    resource->name = name;
+    resource->type = type;
+    resource->first_pass = VULKAN_GRAPH_NONE;
+    resource->alias_group = id;
+    return id;
+}
+
+// Sized after the render extent, shifted down by size_shift.
+uint32_t vulkan_graph_add_image(Vulkan_Graph *graph, const char *name, VkFormat format, uint32_t size_shift, uint32_t mip_count) {
+    uint32_t id = vulkan_graph_add_resource(graph, name, Vulkan_Graph_Resource_Image);
+    if (id == VULKAN_GRAPH_NONE) return id;
+    graph->resources[id].format = format;
+    graph->resources[id].size_shift = size_shift;
+    graph->resources[id].mip_count = mip_count;
+    return id;
+}
+
+uint32_t vulkan_graph_add_pass(Vulkan_Graph *graph, const char *name, bool graphics, Vulkan_Graph_Record record, void *user) {
+    if (graph->pass_count == VULKAN_GRAPH_MAX_PASSES) {
+        print_error("Render graph is out of passes for %s", name);
+        return VULKAN_GRAPH_NONE;
+    }
+    uint32_t id = graph->pass_count++;
+    Vulkan_Graph_Pass *pass = &graph->passes[id];
+    *pass = (Vulkan_Graph_Pass){0};
+    pass->name = name;
+    pass->graphics = graphics;
+    pass->record = record;
+    pass->user = user;
+    return id;
+}
+
+// Compute that only touches buffers made by vulkan_buffer_create_shared and
+// comes before every other pass that uses them. With a compute only queue
+// family it runs there next to the start of the frame, otherwise inline.
+uint32_t vulkan_graph_add_async_pass(Vulkan_Graph *graph, const char *name, Vulkan_Graph_Record record, void *user) {
+    uint32_t id = vulkan_graph_add_pass(graph, name, false, record, user);
+    if (id != VULKAN_GRAPH_NONE) {
+        graph->passes[id].async = true;
+        graph->async_pass_count += 1;
+    }
+    return id;
+}
+
+// usage is a mask of VULKAN_GRAPH_* flags that all share one image layout.
+bool vulkan_graph_use(Vulkan_Graph *graph, uint32_t pass_id, uint32_t resource, uint32_t usage) {
+    if (pass_id >= graph->pass_count || resource >= graph->resource_count || graph->passes[pass_id].access_count == VULKAN_GRAPH_MAX_ACCESSES) {
+        print_error("Render graph pass %u can't use resource %u", pass_id, resource);
+        return false;
+    }
+    Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+    Vulkan_Graph_Access access = {0};
+    access.resource = resource;
+    access.usage = usage;
+    pass->accesses[pass->access_count++] = access;
+    return true;
+}
+
+// Attachment cleared at the start of the pass.
+bool vulkan_graph_use_clear(Vulkan_Graph *graph, uint32_t pass_id, uint32_t resource, uint32_t usage, VkClearValue clear_value) {
+    if (!vulkan_graph_use(graph, pass_id, resource, usage)) return false;
+    Vulkan_Graph_Access *access = &graph->passes[pass_id].accesses[graph->passes[pass_id].access_count - 1];
+    access->clear = true;
+    access->clear_value = clear_value;
+    return true;
+}
+
+bool vulkan_graph_format_is_depth(VkFormat format) {
+    return format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_D32_SFLOAT || format == VK_FORMAT_D24_UNORM_S8_UINT ||
+           format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_X8_D24_UNORM_PACK32;
+}
+
+// Stages, access and layout of one access. Returns false if the flags
+// disagree on the layout.
+bool vulkan_graph_usage_sync(Vulkan_Graph_Resource *resource, uint32_t usage, VkPipelineStageFlags *stages, VkAccessFlags *access, VkImageLayout *layout) {
+    *stages = 0;
+    *access = 0;
+    *layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    bool depth = vulkan_graph_format_is_depth(resource->format);
+    VkPipelineStageFlags fragment_tests = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    for (uint32_t bit = 1; bit <= usage; bit <<= 1) {
+        if (!(usage & bit)) continue;
+        VkImageLayout bit_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        switch (bit) {
+            case VULKAN_GRAPH_COLOR_ATTACHMENT: {
+                *stages |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+                *access |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_DEPTH_ATTACHMENT: {
+                *stages |= fragment_tests;
+                *access |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_DEPTH_READ_ONLY: {
+                *stages |= fragment_tests;
+                *access |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_SAMPLED: {
+                *stages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+                *access |= VK_ACCESS_SHADER_READ_BIT;
+                bit_layout = depth ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_STORAGE_READ: {
+                *stages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+                *access |= VK_ACCESS_SHADER_READ_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_GENERAL;
+            } break;
+            case VULKAN_GRAPH_STORAGE_WRITE: {
+                *stages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+                *access |= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_GENERAL;
+            } break;
+            case VULKAN_GRAPH_INDIRECT: {
+                *stages |= VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+                *access |= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+            } break;
+            case VULKAN_GRAPH_TRANSFER_READ: {
+                *stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+                *access |= VK_ACCESS_TRANSFER_READ_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_TRANSFER_WRITE: {
+                *stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+                *access |= VK_ACCESS_TRANSFER_WRITE_BIT;
+                bit_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_VERTEX_READ: {
+                *stages |= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+                *access |= VK_ACCESS_SHADER_READ_BIT;
+            } break;
+            case VULKAN_GRAPH_FRAGMENT_SAMPLED: {
+                *stages |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+                *access |= VK_ACCESS_SHADER_READ_BIT;
+                bit_layout = depth ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            } break;
+            case VULKAN_GRAPH_FRAGMENT_READ: {
+                *stages |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+                *access |= VK_ACCESS_SHADER_READ_BIT;
+            } break;
+        }
+        if (resource->type == Vulkan_Graph_Resource_Buffer || bit_layout == VK_IMAGE_LAYOUT_UNDEFINED) continue;
+        if (*layout != VK_IMAGE_LAYOUT_UNDEFINED && *layout != bit_layout) return false;
+        *layout = bit_layout;
+    }
+    return true;
+}
+
+// What the frame has done to a resource so far, for deciding on barriers.
+typedef struct {
+    VkPipelineStageFlags    write_stages;
+    VkAccessFlags           write_access;
+    VkPipelineStageFlags    read_stages;    // since the last write, for write after read
+    VkPipelineStageFlags    visible_stages; // the last write is already visible here
+    VkImageLayout           layout;
+} Vulkan_Graph_Sync;
+
+// Only emits the barriers when plan is true, the first walk just finds the
+// state everything is in at the end of a frame.
+void vulkan_graph_plan_access(Vulkan_Graph *graph, Vulkan_Graph_Sync *sync, uint32_t resource_id, VkPipelineStageFlags stages,
+                              VkAccessFlags access, VkImageLayout layout, bool write, VkPipelineStageFlags extra_src_stages, VkAccessFlags extra_src_access, bool plan) {
+    Vulkan_Graph_Resource *resource = &graph->resources[resource_id];
+    bool image = resource->type != Vulkan_Graph_Resource_Buffer;
+    bool layout_change = image && sync->layout != layout;
+    bool needed = layout_change || extra_src_stages;
+    if (write) needed |= sync->write_stages || sync->read_stages;
+    else needed |= sync->write_stages && (sync->visible_stages & stages) != stages;
+
+    if (needed && plan) {
+        Vulkan_Graph_Barrier *barrier = &graph->barriers[graph->barrier_count++];
+        barrier->resource = resource_id;
+        barrier->src_stage = sync->write_stages | extra_src_stages;
+        if (write || layout_change) barrier->src_stage |= sync->read_stages;
+        if (!barrier->src_stage) barrier->src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        barrier->src_access = sync->write_access | extra_src_access;
+        barrier->dst_stage = stages;
+        barrier->dst_access = access;
+        barrier->old_layout = sync->layout;
+        barrier->new_layout = layout;
+    }
+
+    VkAccessFlags write_access = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                 VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    if (write) {
+        sync->write_stages = stages;
+        sync->write_access = access & write_access;
+        sync->read_stages = 0;
+        sync->visible_stages = 0;
+    } else {
+        // A layout transition is a write the later readers have to wait for too.
+        if (layout_change) sync->write_stages |= stages;
+        if (needed) sync->visible_stages |= stages;
+        sync->read_stages |= stages;
+    }
+    sync->layout = layout;
+}
+
+// Walks the passes in order. The first walk starts from nothing, the second
+// from where the first ended, so the first use of every resource waits on
+// its last use in the previous frame.
+bool vulkan_graph_plan_barriers(Vulkan_Graph *graph) {
+    Vulkan_Graph_Sync syncs[VULKAN_GRAPH_MAX_RESOURCES] = {0};
+    for (uint32_t walk = 0; walk < 2; ++walk) {
+        bool plan = walk == 1;
+        Vulkan_Graph_Sync frame_end[VULKAN_GRAPH_MAX_RESOURCES];
+        memcpy(frame_end, syncs, sizeof(syncs));
+        for (uint32_t resource_id = 0; resource_id < graph->resource_count; ++resource_id) {
+            Vulkan_Graph_Sync *sync = &syncs[resource_id];
+            Vulkan_Graph_Resource *resource = &graph->resources[resource_id];
+            if (resource->type == Vulkan_Graph_Resource_Buffer) {
+                sync->visible_stages = 0;
+            } else if (resource->type == Vulkan_Graph_Resource_Image) {
+                sync->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            } else {
+                // Acquired fresh every frame, the submit waits on the acquire at this stage.
+                *sync = (Vulkan_Graph_Sync){0};
+                sync->write_stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+            }
+        }
+
+        graph->barrier_count = 0;
+        for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+            Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+            pass->first_barrier = graph->barrier_count;
+            for (uint32_t access_idx = 0; access_idx < pass->access_count; ++access_idx) {
+                Vulkan_Graph_Access *access = &pass->accesses[access_idx];
+                Vulkan_Graph_Resource *resource = &graph->resources[access->resource];
+                VkPipelineStageFlags stages;
+                VkAccessFlags access_mask;
+                VkImageLayout layout;
+                if (!vulkan_graph_usage_sync(resource, access->usage, &stages, &access_mask, &layout)) {
+                    print_error("Render graph pass %s uses %s in two layouts at once", pass->name, resource->name);
+                    return false;
+                }
+
+                // Memory shared with other images: their last use has to be done first.
+                VkPipelineStageFlags extra_src_stages = 0;
+                VkAccessFlags extra_src_access = 0;
+                if (plan && resource->first_pass == pass_id && resource->type == Vulkan_Graph_Resource_Image) {
+                    for (uint32_t other_id = 0; other_id < graph->resource_count; ++other_id) {
+                        if (other_id == access->resource || graph->resources[other_id].alias_group != resource->alias_group) continue;
+                        extra_src_stages |= frame_end[other_id].write_stages | frame_end[other_id].read_stages;
+                        extra_src_access |= frame_end[other_id].write_access;
+                    }
+                }
+                vulkan_graph_plan_access(graph, &syncs[access->resource], access->resource, stages, access_mask, layout,
+                                         (access->usage & VULKAN_GRAPH_WRITES) != 0, extra_src_stages, extra_src_access, plan);
+            }
+            pass->barrier_count = graph->barrier_count - pass->first_barrier;
+        }
+
+        graph->final_barrier = graph->barrier_count;
+        for (uint32_t resource_id = 0; resource_id < graph->resource_count; ++resource_id) {
+            if (graph->resources[resource_id].type != Vulkan_Graph_Resource_Swapchain) continue;
+            vulkan_graph_plan_access(graph, &syncs[resource_id], resource_id, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                                     VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false, 0, 0, plan);
+        }
+    }
+    return true;
+}
+
+// Makes the render passes and the barrier plan, none of which depends on
+// the extent. Lane 0, once every pass has been added.
+bool vulkan_graph_compile(Vulkan_State *vk) {
+    Vulkan_Graph *graph = &vk->graph;
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        for (uint32_t access_idx = 0; access_idx < pass->access_count; ++access_idx) {
+            Vulkan_Graph_Access *access = &pass->accesses[access_idx];
+            Vulkan_Graph_Resource *resource = &graph->resources[access->resource];
+            if (resource->first_pass == VULKAN_GRAPH_NONE) resource->first_pass = pass_id;
+            resource->last_pass = pass_id;
+            if (access->usage & VULKAN_GRAPH_COLOR_ATTACHMENT) resource->usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+            if (access->usage & (VULKAN_GRAPH_DEPTH_ATTACHMENT | VULKAN_GRAPH_DEPTH_READ_ONLY)) resource->usage |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+            if (access->usage & (VULKAN_GRAPH_SAMPLED | VULKAN_GRAPH_FRAGMENT_SAMPLED)) resource->usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+            if (access->usage & (VULKAN_GRAPH_STORAGE_READ | VULKAN_GRAPH_STORAGE_WRITE)) resource->usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+            if (access->usage & VULKAN_GRAPH_TRANSFER_READ) resource->usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            if (access->usage & VULKAN_GRAPH_TRANSFER_WRITE) resource->usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+            if (access->usage & VULKAN_GRAPH_ATTACHMENTS) pass->per_image |= resource->type == Vulkan_Graph_Resource_Swapchain;
+        }
+    }
+
+    // The semaphore the graphics submit waits on covers what the async passes
+    // write, so it waits at every stage a later pass reads them in.
+    graph->async_wait_stages = 0;
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        if (!pass->async) continue;
+        for (uint32_t access_idx = 0; access_idx < pass->access_count; ++access_idx) {
+            Vulkan_Graph_Resource *resource = &graph->resources[pass->accesses[access_idx].resource];
+            if (resource->type != Vulkan_Graph_Resource_Buffer || !graph->passes[resource->first_pass].async) {
+                print_error("Render graph async pass %s can only use buffers that no earlier pass touches, not %s", pass->name, resource->name);
+                return false;
+            }
+            for (uint32_t reader_id = pass_id + 1; reader_id < graph->pass_count; ++reader_id) {
+                Vulkan_Graph_Pass *reader = &graph->passes[reader_id];
+                if (reader->async) continue;
+                for (uint32_t reader_access_idx = 0; reader_access_idx < reader->access_count; ++reader_access_idx) {
+                    Vulkan_Graph_Access *reader_access = &reader->accesses[reader_access_idx];
+                    if (reader_access->resource != pass->accesses[access_idx].resource) continue;
+                    VkPipelineStageFlags stages;
+                    VkAccessFlags access_mask;
+                    VkImageLayout layout;
+                    vulkan_graph_usage_sync(resource, reader_access->usage, &stages, &access_mask, &layout);
+                    graph->async_wait_stages |= stages;
+                }
+            }
+        }
+    }
+    if (graph->async_pass_count && !graph->async_wait_stages) graph->async_wait_stages = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    // Images that only ever are attachments never have to be backed by real
+    // memory on tilers. Groups are filled first fit in order of first use.
+    bool lazy_memory = vulkan_memory_find_type(vk, UINT32_MAX, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != UINT32_MAX;
+    VkImageUsageFlags attachment_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    for (uint32_t resource_id = 0; resource_id < graph->resource_count; ++resource_id) {
+        Vulkan_Graph_Resource *resource = &graph->resources[resource_id];
+        if (resource->type != Vulkan_Graph_Resource_Image) continue;
+        if (resource->first_pass == VULKAN_GRAPH_NONE) {
+            print_error("Render graph image %s is never used", resource->name);
+            return false;
+        }
+        resource->lazy = lazy_memory && !(resource->usage & ~attachment_usage);
+        if (resource->lazy) resource->usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+
+        for (uint32_t group = 0; group < resource_id; ++group) {
+            Vulkan_Graph_Resource *leader = &graph->resources[group];
+            if (leader->type != Vulkan_Graph_Resource_Image || leader->alias_group != group || leader->lazy != resource->lazy) continue;
+            bool overlaps = false;
+            for (uint32_t member = group; member < resource_id && !overlaps; ++member) {
+                Vulkan_Graph_Resource *other = &graph->resources[member];
+                if (other->alias_group != group) continue;
+                overlaps = other->first_pass <= resource->last_pass && resource->first_pass <= other->last_pass;
+            }
+            if (!overlaps) {
+                resource->alias_group = group;
+                break;
+            }
+        }
+    }
+
+    // Layout transitions all happen in the planned barriers, so every
+    // attachment starts and ends in the layout its pass uses it in.
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        if (!pass->graphics) continue;
+        Vulkan_Render_Pass_Info render_pass_info = {0};
+        for (uint32_t access_idx = 0; access_idx < pass->access_count; ++access_idx) {
+            Vulkan_Graph_Access *access = &pass->accesses[access_idx];
+            if (!(access->usage & VULKAN_GRAPH_ATTACHMENTS)) continue;
+            Vulkan_Graph_Resource *resource = &graph->resources[access->resource];
+            VkPipelineStageFlags stages;
+            VkAccessFlags access_mask;
+            VkImageLayout layout;
+            vulkan_graph_usage_sync(resource, access->usage, &stages, &access_mask, &layout);
+
+            bool swapchain = resource->type == Vulkan_Graph_Resource_Swapchain;
+            VkFormat format = swapchain ? vk->image_format : resource->format;
+            VkAttachmentLoadOp load_op = access->clear ? VK_ATTACHMENT_LOAD_OP_CLEAR :
+                                         resource->first_pass < pass_id ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            VkAttachmentStoreOp store_op = swapchain || resource->last_pass > pass_id ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            Vulkan_Attachment_Type type = (access->usage & VULKAN_GRAPH_COLOR_ATTACHMENT) ? Vulkan_Attachment_Type_Color :
+                                          (access->usage & VULKAN_GRAPH_DEPTH_ATTACHMENT) ? Vulkan_Attachment_Type_Depth_Stencil :
+                                                                                           Vulkan_Attachment_Type_Depth_Stencil_Read_Only;
+            if (!vulkan_render_pass_add_attachment(&render_pass_info, format, 1, type, load_op, store_op, layout, layout)) return false;
+        }
+        if (!vulkan_render_pass_create(vk->device, &render_pass_info, &pass->render_pass)) return false;
+    }
+
+    return vulkan_graph_plan_barriers(graph);
+}
+
+VkFramebuffer vulkan_graph_framebuffer(Vulkan_State *vk, uint32_t pass_id) {
+    Vulkan_Graph_Pass *pass = &vk->graph.passes[pass_id];
+    return pass->framebuffers[pass->per_image ? vk->image_index : 0];
+}
+
+VkRenderPass vulkan_graph_render_pass(Vulkan_State *vk, uint32_t pass_id) {
+    return vk->graph.passes[pass_id].render_pass;
+}
+
+void vulkan_graph_import_buffer(Vulkan_Graph *graph, uint32_t resource, VkBuffer buffer) {
+    graph->resources[resource].buffer = buffer;
+}
+
+// Retired rather than destroyed, frames in flight may still render to them.
+void vulkan_graph_destroy_targets(Vulkan_State *vk) {
+    Vulkan_Graph *graph = &vk->graph;
+    uint64_t release_value = vk->frame_number;
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        for (uint32_t image_idx = 0; image_idx < VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT; ++image_idx) {
+            if (pass->framebuffers[image_idx]) {
+                vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Framebuffer, .release_value = release_value, .framebuffer = pass->framebuffers[image_idx] });
+            }
+            pass->framebuffers[image_idx] = VK_NULL_HANDLE;
+        }
+    }
+    for (uint32_t resource_id = 0; resource_id < graph->resource_count; ++resource_id) {
+        Vulkan_Graph_Resource *resource = &graph->resources[resource_id];
+        if (resource->type != Vulkan_Graph_Resource_Image) continue;
+        if (resource->image.view) vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Image_View, .release_value = release_value, .view = resource->image.view });
+        if (resource->image.handle) vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Image, .release_value = release_value, .image = resource->image.handle });
+        resource->image = (Vulkan_Image){0};
+        if (graph->memory[resource_id].memory) vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Memory, .release_value = release_value, .allocation = graph->memory[resource_id] });
+        graph->memory[resource_id] = (Vulkan_Allocation){0};
+    }
+}
+
+// Images, their shared memory and the framebuffers, for the current extent.
+bool vulkan_graph_create_targets(Vulkan_State *vk) {
+    Vulkan_Graph *graph = &vk->graph;
+    vulkan_graph_destroy_targets(vk);
+
+    VkMemoryRequirements group_reqs[VULKAN_GRAPH_MAX_RESOURCES] = {0};
+    VkDeviceSize image_bytes = 0;
+    for (uint32_t resource_id = 0; resource_id < graph->resource_count; ++resource_id) {
+        Vulkan_Graph_Resource *resource = &graph->resources[resource_id];
+        if (resource->type != Vulkan_Graph_Resource_Image) continue;
+        uint32_t width = kabarr_max(vk->render_extent.width >> resource->size_shift, 1u);
+        uint32_t height = kabarr_max(vk->render_extent.height >> resource->size_shift, 1u);
+        uint32_t levels = 1;
+        while (levels < VULKAN_GRAPH_MAX_MIPS && (width >> levels || height >> levels)) ++levels;
+        if (resource->mip_count && resource->mip_count < levels) levels = resource->mip_count;
+        resource->levels = levels;
+
+        VkImageCreateInfo image_info = {};
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.format = resource->format;
+        image_info.extent = (VkExtent3D){ width, height, 1 };
+        image_info.mipLevels = levels;
+        image_info.arrayLayers = 1;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = resource->usage;
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (vkCreateImage(vk->device, &image_info, 0, &resource->image.handle) != VK_SUCCESS) {
+            print_error("Vulkan failed to create render graph image %s", resource->name);
+            return false;
+        }
+        resource->image.format = resource->format;
+        resource->image.extent = image_info.extent;
+
+        VkMemoryRequirements reqs;
+        vkGetImageMemoryRequirements(vk->device, resource->image.handle, &reqs);
+        image_bytes += reqs.size;
+        VkMemoryRequirements *group = &group_reqs[resource->alias_group];
+        if (!group->memoryTypeBits) group->memoryTypeBits = reqs.memoryTypeBits;
+        group->memoryTypeBits &= reqs.memoryTypeBits;
+        if (reqs.size > group->size) group->size = reqs.size;
+        if (reqs.alignment > group->alignment) group->alignment = reqs.alignment;
+    }
+
+    VkDeviceSize memory_bytes = 0;
+    for (uint32_t resource_id = 0; resource_id < graph->resource_count; ++resource_id) {
+        Vulkan_Graph_Resource *resource = &graph->resources[resource_id];
+        if (resource->type != Vulkan_Graph_Resource_Image) continue;
+        if (resource->alias_group == resource_id) {
+            if (!group_reqs[resource_id].memoryTypeBits) {
+                print_error("Render graph images aliased with %s share no memory type", resource->name);
+                return false;
+            }
+            VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+            if (resource->lazy) flags |= VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+            if (!vulkan_memory_allocate(vk, &group_reqs[resource_id], flags, VK_NULL_HANDLE, VK_NULL_HANDLE, resource->lazy, &graph->memory[resource_id])) return false;
+            memory_bytes += group_reqs[resource_id].size;
+        }
+        Vulkan_Allocation *memory = &graph->memory[resource->alias_group];
+        if (vkBindImageMemory(vk->device, resource->image.handle, memory->memory, memory->offset) != VK_SUCCESS) {
+            print_error("Vulkan failed to bind render graph image %s", resource->name);
+            return false;
+        }
+
+        VkImageViewCreateInfo view_info = {};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = resource->image.handle;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = resource->format;
+        view_info.subresourceRange.aspectMask = vulkan_graph_format_is_depth(resource->format) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+        view_info.subresourceRange.levelCount = resource->levels;
+        view_info.subresourceRange.layerCount = 1;
+        if (vkCreateImageView(vk->device, &view_info, 0, &resource->image.view) != VK_SUCCESS) {
+            print_error("Vulkan failed to create render graph view %s", resource->name);
+            return false;
+        }
+    }
+
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        if (!pass->graphics) continue;
+        uint32_t framebuffer_count = pass->per_image ? vk->image_count : 1;
+        VkExtent2D extent = pass->per_image ? vk->extent : vk->render_extent;
+        for (uint32_t image_idx = 0; image_idx < framebuffer_count; ++image_idx) {
+            VkImageView attachments[VULKAN_GRAPH_MAX_ACCESSES];
+            uint32_t attachment_count = 0;
+            for (uint32_t access_idx = 0; access_idx < pass->access_count; ++access_idx) {
+                Vulkan_Graph_Access *access = &pass->accesses[access_idx];
+                if (!(access->usage & VULKAN_GRAPH_ATTACHMENTS)) continue;
+                Vulkan_Graph_Resource *resource = &graph->resources[access->resource];
+                attachments[attachment_count++] = resource->type == Vulkan_Graph_Resource_Swapchain ? vk->color_image_views[image_idx] : resource->image.view;
+            }
+            VkFramebufferCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            info.renderPass = pass->render_pass;
+            info.attachmentCount = attachment_count;
+            info.pAttachments = attachments;
+            info.width = extent.width;
+            info.height = extent.height;
+            info.layers = 1;
+            if (vkCreateFramebuffer(vk->device, &info, 0, &pass->framebuffers[image_idx]) != VK_SUCCESS) {
+                print_error("Vulkan failed to create framebuffer for %s", pass->name);
+                return false;
+            }
+        }
+    }
+
+    print_info("Render graph: %u passes, %u barriers, %.2f MB of images in %.2f MB of memory",
+               graph->pass_count, graph->barrier_count, (double)image_bytes / (1024.0*1024.0), (double)memory_bytes / (1024.0*1024.0));
+    return true;
+}
+
+void vulkan_graph_record_barriers(Vulkan_State *vk, VkCommandBuffer cmd, uint32_t first, uint32_t count) {
+    if (!count) return;
+    Vulkan_Graph *graph = &vk->graph;
+    VkImageMemoryBarrier image_barriers[VULKAN_GRAPH_MAX_ACCESSES + VULKAN_GRAPH_MAX_RESOURCES];
+    VkBufferMemoryBarrier buffer_barriers[VULKAN_GRAPH_MAX_ACCESSES + VULKAN_GRAPH_MAX_RESOURCES];
+    uint32_t image_count = 0, buffer_count = 0;
+    VkPipelineStageFlags src_stages = 0, dst_stages = 0;
+    for (uint32_t barrier_idx = first; barrier_idx < first + count; ++barrier_idx) {
+        Vulkan_Graph_Barrier *barrier = &graph->barriers[barrier_idx];
+        Vulkan_Graph_Resource *resource = &graph->resources[barrier->resource];
+        src_stages |= barrier->src_stage;
+        dst_stages |= barrier->dst_stage;
+        if (resource->type == Vulkan_Graph_Resource_Buffer) {
+            // Write after read only needs the execution dependency.
+            if (!barrier->src_access) continue;
+            buffer_barriers[buffer_count++] = (VkBufferMemoryBarrier){
+                .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                .srcAccessMask = barrier->src_access,
+                .dstAccessMask = barrier->dst_access,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .buffer = resource->buffer,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE,
+            };
+        } else {
+            bool swapchain = resource->type == Vulkan_Graph_Resource_Swapchain;
+            bool depth = !swapchain && vulkan_graph_format_is_depth(resource->format);
+            image_barriers[image_count++] = (VkImageMemoryBarrier){
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask = barrier->src_access,
+                .dstAccessMask = barrier->dst_access,
+                .oldLayout = barrier->old_layout,
+                .newLayout = barrier->new_layout,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = swapchain ? vk->images[vk->image_index] : resource->image.handle,
+                .subresourceRange = { depth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT, 0, swapchain ? 1 : resource->levels, 0, 1 },
+            };
+        }
+    }
+    vkCmdPipelineBarrier(cmd, src_stages, dst_stages, 0, 0, 0, buffer_count, buffer_barriers, image_count, image_barriers);
+}
+
+// Lane 0. Every pass gets its barriers as one vkCmdPipelineBarrier, graphics
+// passes are wrapped in their render pass with a viewport over all of it,
+// the swapchain extent for passes that render to it, the render extent else.
+void vulkan_graph_execute(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Graph *graph = &vk->graph;
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        if (pass->async && vk->compute_queue) {
+            if (!vk->profiler.compute_timestamps) vulkan_profiler_reset(vk, cmd, pass_id);
+            continue;
+        }
+        vulkan_graph_record_barriers(vk, cmd, pass->first_barrier, pass->barrier_count);
+        vulkan_profiler_write(vk, cmd, pass_id, false);
+        if (!pass->graphics) {
+            pass->record(pass->user, cmd);
+            vulkan_profiler_write(vk, cmd, pass_id, true);
+            continue;
+        }
+
+        VkClearValue clear_values[VULKAN_GRAPH_MAX_ACCESSES];
+        uint32_t attachment_count = 0;
+        for (uint32_t access_idx = 0; access_idx < pass->access_count; ++access_idx) {
+            Vulkan_Graph_Access *access = &pass->accesses[access_idx];
+            if (access->usage & VULKAN_GRAPH_ATTACHMENTS) clear_values[attachment_count++] = access->clear_value;
+        }
+        VkExtent2D extent = pass->per_image ? vk->extent : vk->render_extent;
+        VkRenderPassBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        begin_info.renderPass = pass->render_pass;
+        begin_info.framebuffer = vulkan_graph_framebuffer(vk, pass_id);
+        begin_info.renderArea.extent = extent;
+        begin_info.clearValueCount = attachment_count;
+        begin_info.pClearValues = clear_values;
+        vkCmdBeginRenderPass(cmd, &begin_info, pass->secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+        if (!pass->secondary) {
+            VkViewport viewport = { 0.0f, 0.0f, (float)extent.width, (float)extent.height, 0.0f, 1.0f };
+            VkRect2D scissor = { { 0, 0 }, extent };
+            vkCmdSetViewport(cmd, 0, 1, &viewport);
+            vkCmdSetScissor(cmd, 0, 1, &scissor);
+        }
+        pass->record(pass->user, cmd);
+        vkCmdEndRenderPass(cmd);
+        vulkan_profiler_write(vk, cmd, pass_id, true);
+    }
+    vulkan_graph_record_barriers(vk, cmd, graph->final_barrier, graph->barrier_count - graph->final_barrier);
+}
+
+// The semaphores around the compute submit order these against everything
+// else, so their planned barriers are left out.
+void vulkan_graph_execute_async(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Graph *graph = &vk->graph;
+    bool timestamps = vk->profiler.compute_timestamps;
+    for (uint32_t pass_id = 0; pass_id < graph->pass_count; ++pass_id) {
+        Vulkan_Graph_Pass *pass = &graph->passes[pass_id];
+        if (!pass->async) continue;
+        if (timestamps) vulkan_profiler_write(vk, cmd, pass_id, false);
+        pass->record(pass->user, cmd);
+        if (timestamps) vulkan_profiler_write(vk, cmd, pass_id, true);
+    }
+}
+
+void vulkan_graph_shutdown(Vulkan_State *vk) {
+    vulkan_graph_destroy_targets(vk);
+    for (uint32_t pass_id = 0; pass_id < vk->graph.pass_count; ++pass_id) {
+        if (vk->graph.passes[pass_id].render_pass) vkDestroyRenderPass(vk->device, vk->graph.passes[pass_id].render_pass, 0);
+    }
+}
+
+// Draws into the opaque pass, after vulkan_backend_create_render_graph.
+bool vulkan_backend_create_final_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->opaque_pass));
+    #include "shaders/final.vert.h"
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, final, vert))) return false;
+    #include "shaders/final.frag.h"
+    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, final, frag))) return false;
+    vk->final_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (vk->final_pipeline == VULKAN_PIPELINE_NONE) return false;
+
+#if 0
+    // extended example
+    Vulkan_Pipeline pipeline = {0};
+    vulkan_pipeline_init(&pipeline, device);
+    vulkan_pipeline_add_vertex_shader(&pipeline, vert_spv, vert_len);
+    vulkan_pipeline_add_fragment_shader(&pipeline, frag_spv, frag_len);
+    vulkan_pipeline_push_vertx_binding(&pipeline, 0, sizeof(Vertex));
+    vulkan_pipeline_push_attribute(&pipeline, 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offset_of(Vertex, position));
+    vulkan_pipeline_push_attribute(&pipeline, 0, 1, VK_FORMAT_R32G32B32_SFLOAT, offset_of(Vertex, normal));
+    vulkan_pipeline_push_attribute(&pipeline, 0, 2, VK_FORMAT_R32G32_SFLOAT,    offset_of(Vertex, texcoord));
+    vulkan_pipeline_set_viewport(&pipeline, extent); // set to max extent by default
+    vulkan_pipeline_set_scissor(&pipeline, extent); // set to max extent by default
+    vulkan_pipeline_set_depth_test(&pipeline, VK_COMPARE_OP_LESS); // disabled by default, but if you call this its enabled
+    vulkan_pipeline_cull_face(&pipeline, VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE); // disabled by default, but if you call this its enabled
+    vulkan_pipeline_enable_alpha(&pipeline); // false by default, but if you call this its set to true
+    if (!vulkan_pipeline_create(&pipeline, render_pass)) return false;
+#endif
+
+    return true;
+}
+
+// Splits size off the start of a free range that is at least that big.
+uint32_t vulkan_range_take_front(Vulkan_Ranges *free_ranges, uint32_t range_index, uint32_t size) {
+    Vulkan_Range *range = &free_ranges->items[range_index];
+    uint32_t offset = range->offset;
+    range->offset += size;
+    range->size -= size;
+    if (range->size == 0) {
+        memmove(range, range + 1, (free_ranges->count - range_index - 1)*sizeof(Vulkan_Range));
+        --free_ranges->count;
+    }
+    return offset;
+}
+
+// Best fit out of a sorted free list.
+bool vulkan_range_alloc(Vulkan_Ranges *free_ranges, uint32_t size, uint32_t *offset) {
+    uint32_t best = UINT32_MAX;
+    for (uint32_t range_idx = 0; range_idx < free_ranges->count; ++range_idx) {
+        Vulkan_Range *range = &free_ranges->items[range_idx];
+        if (range->size >= size && (best == UINT32_MAX || range->size < free_ranges->items[best].size)) {
+            best = range_idx;
+            if (range->size == size) break;
+        }
+    }
+    if (best == UINT32_MAX) return false;
+    *offset = vulkan_range_take_front(free_ranges, best, size);
+    return true;
+}
+
+void vulkan_range_free(Vulkan_Ranges *free_ranges, uint32_t offset, uint32_t size) {
+    uint32_t index = 0;
+    while (index < free_ranges->count && free_ranges->items[index].offset < offset) ++index;
+
+    bool merge_prev = index > 0 && free_ranges->items[index - 1].offset + free_ranges->items[index - 1].size == offset;
+    bool merge_next = index < free_ranges->count && offset + size == free_ranges->items[index].offset;
+    if (merge_prev && merge_next) {
+        free_ranges->items[index - 1].size += size + free_ranges->items[index].size;
+        memmove(&free_ranges->items[index], &free_ranges->items[index + 1], (free_ranges->count - index - 1)*sizeof(Vulkan_Range));
+        --free_ranges->count;
+    } else if (merge_prev) {
+        free_ranges->items[index - 1].size += size;
+    } else if (merge_next) {
+        free_ranges->items[index].offset = offset;
+        free_ranges->items[index].size += size;
+    } else {
+        Vulkan_Range range = { .offset = offset, .size = size };
+        kabarr_grow(free_ranges, free_ranges->count + 1);
+        memmove(&free_ranges->items[index + 1], &free_ranges->items[index], (free_ranges->count - index)*sizeof(Vulkan_Range));
+        free_ranges->items[index] = range;
+        ++free_ranges->count;
+    }
+}
+
+// Extends [offset, offset + size) by extra if the range right after it is free.
+bool vulkan_range_grow(Vulkan_Ranges *free_ranges, uint32_t offset, uint32_t size, uint32_t extra) {
+    for (uint32_t range_idx = 0; range_idx < free_ranges->count; ++range_idx) {
+        Vulkan_Range *range = &free_ranges->items[range_idx];
+        if (range->offset != offset + size) continue;
+        if (range->size < extra) return false;
+        range->offset += extra;
+        range->size -= extra;
+        if (range->size == 0) {
+            memmove(range, range + 1, (free_ranges->count - range_idx - 1)*sizeof(Vulkan_Range));
+            --free_ranges->count;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Ranges freed this frame can still be read by frames in flight, so they only
+// go back on the free list once the timeline has passed this frame.
+void vulkan_chunk_buffer_release(Vulkan_State *vk, uint32_t offset, uint32_t size) {
+    if (!size) return;
+    Vulkan_Range range = { .offset = offset, .size = size, .release_value = vk->frame_number + 1 };
+    kabarr_append(&vk->chunks.pending_ranges, range);
+}
+
+// Chunk infos are gathered and uploaded once per frame, so an info that didn't
+// fit in the upload ring is simply retried next frame.
+void vulkan_chunk_buffer_mark_info(Vulkan_State *vk, uint32_t chunk_index) {
+    Vulkan_Chunk_Mesh *mesh = &vk->chunks.chunks[chunk_index];
+    if (mesh->info_dirty) return;
+    mesh->info_dirty = true;
+    kabarr_append(&vk->chunks.dirty_infos, chunk_index);
+}
+
+void vulkan_chunk_buffer_flush_infos(Vulkan_State *vk) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    uint32_t flushed = 0;
+    for (; flushed < chunks->dirty_infos.count; ++flushed) {
+        uint32_t chunk_index = chunks->dirty_infos.items[flushed];
+        Vulkan_Chunk_Mesh *mesh = &chunks->chunks[chunk_index];
+        Vulkan_Chunk_Info *info = vulkan_staging_push(vk, 0, chunks->infos.handle, chunk_index*sizeof(Vulkan_Chunk_Info), sizeof(Vulkan_Chunk_Info));
+        if (!info) break;
+        memset(info, 0, sizeof(*info));
+        memcpy(info->position, mesh->position, sizeof(info->position));
+        info->quad_offset = mesh->offset;
+        info->quad_count = mesh->live ? mesh->quad_count : 0;
+        info->bounds_min = mesh->bounds_min;
+        info->bounds_max = mesh->bounds_max;
+        mesh->info_dirty = false;
+    }
+    memmove(chunks->dirty_infos.items, chunks->dirty_infos.items + flushed, (chunks->dirty_infos.count - flushed)*sizeof(uint32_t));
+    chunks->dirty_infos.count -= flushed;
+}
+
+// Same corner math as chunk.vert, packed the way Vulkan_Chunk_Info stores it.
+void vulkan_chunk_quads_bounds(Vulkan_Chunk_Quad *quads, uint32_t quad_count, uint32_t *bounds_min, uint32_t *bounds_max) {
+    uint32_t lo[3] = { UINT32_MAX, UINT32_MAX, UINT32_MAX };
+    uint32_t hi[3] = { 0, 0, 0 };
+    for (uint32_t quad_idx = 0; quad_idx < quad_count; ++quad_idx) {
+        uint32_t a = quads[quad_idx].a;
+        uint32_t local[3] = { a & 63u, (a >> 6) & 63u, (a >> 12) & 63u };
+        uint32_t axis = ((a >> 18) & 7u) >> 1;
+        uint32_t u_axis = axis == 0 ? 1 : axis == 1 ? 2 : 0;
+        uint32_t v_axis = axis == 0 ? 2 : axis == 1 ? 0 : 1;
+        uint32_t end[3] = { local[0], local[1], local[2] };
+        end[u_axis] += ((a >> 21) & 31u) + 1;
+        end[v_axis] += ((a >> 26) & 31u) + 1;
+        for (uint32_t axis_idx = 0; axis_idx < 3; ++axis_idx) {
+            if (local[axis_idx] < lo[axis_idx]) lo[axis_idx] = local[axis_idx];
+            if (end[axis_idx] > hi[axis_idx]) hi[axis_idx] = end[axis_idx];
+        }
+    }
+    *bounds_min = lo[0] | lo[1] << 8 | lo[2] << 16;
+    *bounds_max = hi[0] | hi[1] << 8 | hi[2] << 16;
+}
+
+float vulkan_shadow_tile_world(uint32_t cascade) {
+    return VULKAN_SHADOW_TILE_WORLD*(float)(1u << (2*cascade));
+}
+
+// Bounds of a world space box along the light's right and up axes.
+void vulkan_shadow_box_bounds(Vulkan_Shadows *shadows, float lo[3], float hi[3], float out_min[2], float out_max[2]) {
+    for (uint32_t axis = 0; axis < 2; ++axis) {
+        float center = 0.0f, radius = 0.0f;
+        for (uint32_t k = 0; k < 3; ++k) {
+            center += 0.5f*(lo[k] + hi[k])*shadows->light_basis[axis][k];
+            radius += 0.5f*(hi[k] - lo[k])*fabsf(shadows->light_basis[axis][k]);
+        }
+        out_min[axis] = center - radius;
+        out_max[axis] = center + radius;
+    }
+}
+
+// Every tile the chunk casts onto gets redrawn, which is every tile it
+// overlaps when seen from the light.
+void vulkan_shadow_invalidate_chunk(Vulkan_State *vk, int32_t position[3]) {
+    Vulkan_Shadows *shadows = &vk->shadows;
+    if (!shadows->atlas.handle) return;
+    float lo[3], hi[3], box_min[2], box_max[2];
+    for (uint32_t k = 0; k < 3; ++k) {
+        lo[k] = (float)(position[k]*VULKAN_CHUNK_SIZE);
+        hi[k] = lo[k] + (float)VULKAN_CHUNK_SIZE;
+    }
+    vulkan_shadow_box_bounds(shadows, lo, hi, box_min, box_max);
+    for (uint32_t cascade = 0; cascade < VULKAN_SHADOW_CASCADES; ++cascade) {
+        float tile_world = vulkan_shadow_tile_world(cascade);
+        for (uint32_t slot_idx = 0; slot_idx < VULKAN_SHADOW_TILES*VULKAN_SHADOW_TILES; ++slot_idx) {
+            Vulkan_Shadow_Slot *slot = &shadows->slots[cascade][slot_idx];
+            if (!slot->valid) continue;
+            bool overlaps = true;
+            for (uint32_t axis = 0; axis < 2; ++axis) {
+                float tile_min = (float)slot->tile[axis]*tile_world;
+                overlaps &= box_max[axis] > tile_min && box_min[axis] < tile_min + tile_world;
+            }
+            if (overlaps) slot->valid = false;
+        }
+    }
+}
+
+void vulkan_chunk_mesh_remove(Vulkan_State *vk, uint32_t chunk_index) {
+    Vulkan_Chunk_Mesh *mesh = &vk->chunks.chunks[chunk_index];
+    if (!mesh->live) return;
+    vulkan_chunk_buffer_release(vk, mesh->offset, mesh->capacity);
+    vulkan_shadow_invalidate_chunk(vk, mesh->position);
+    vk->chunks.live_quads -= mesh->quad_count;
+    vk->chunks.live_chunks -= 1;
+    mesh->live = false;
+    mesh->quad_count = 0;
+    mesh->capacity = 0;
+    vulkan_chunk_buffer_mark_info(vk, chunk_index);
+}
+
+// Remeshes that fit the chunk's current range are written in place. Lane 0
+// only. Returns false if the upload ring is full, retry next frame.
+bool vulkan_chunk_mesh_upload(Vulkan_State *vk, uint32_t chunk_index, int32_t position[3], Vulkan_Chunk_Quad *quads, uint32_t quad_count) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    if (chunk_index >= VULKAN_MAX_CHUNKS) {
+        print_error("Chunk index %u out of range", chunk_index);
+        return false;
+    }
+    if (quad_count == 0) {
+        vulkan_chunk_mesh_remove(vk, chunk_index);
+        return true;
+    }
+
+    Vulkan_Chunk_Mesh *mesh = &chunks->chunks[chunk_index];
+    uint32_t capacity = (quad_count + VULKAN_CHUNK_QUAD_GRANULARITY - 1) & ~(VULKAN_CHUNK_QUAD_GRANULARITY - 1);
+    uint32_t offset = mesh->offset;
+    bool in_place = mesh->live && capacity <= mesh->capacity;
+    bool grown = !in_place && mesh->live && vulkan_range_grow(&chunks->free_ranges, mesh->offset, mesh->capacity, capacity - mesh->capacity);
+    if (!in_place && !grown && !vulkan_range_alloc(&chunks->free_ranges, capacity, &offset)) {
+        print_error("Chunk buffer is out of space for %u quads", quad_count);
+        return false;
+    }
+
+    VkDeviceSize bytes = (VkDeviceSize)quad_count*sizeof(Vulkan_Chunk_Quad);
+    void *dst = vulkan_staging_push(vk, 0, chunks->quads.handle, (VkDeviceSize)offset*sizeof(Vulkan_Chunk_Quad), bytes);
+    if (!dst) {
+        // Nothing has been written to the new space yet so it can go straight back.
+        if (grown) vulkan_range_free(&chunks->free_ranges, mesh->offset + mesh->capacity, capacity - mesh->capacity);
+        else if (!in_place) vulkan_range_free(&chunks->free_ranges, offset, capacity);
+        return false;
+    }
+    memcpy(dst, quads, bytes);
+    vulkan_staging_cancel_moves(vk, chunks->quads.handle, (VkDeviceSize)offset*sizeof(Vulkan_Chunk_Quad), (VkDeviceSize)capacity*sizeof(Vulkan_Chunk_Quad));
+
+    if (in_place) {
+        // Give back the tail when the mesh shrank a lot.
+        if (capacity*2 <= mesh->capacity) {
+            vulkan_chunk_buffer_release(vk, mesh->offset + capacity, mesh->capacity - capacity);
+            mesh->capacity = capacity;
+        }
+    } else if (grown) {
+        mesh->capacity = capacity;
+    } else {
+        if (mesh->live) vulkan_chunk_buffer_release(vk, mesh->offset, mesh->capacity);
+        mesh->offset = offset;
+        mesh->capacity = capacity;
+    }
+
+    if (mesh->live) {
+        chunks->live_quads -= mesh->quad_count;
+        if (memcmp(mesh->position, position, sizeof(mesh->position)) != 0) vulkan_shadow_invalidate_chunk(vk, mesh->position);
+    } else {
+        chunks->live_chunks += 1;
+    }
+    vulkan_shadow_invalidate_chunk(vk, position);
+    chunks->live_quads += quad_count;
+    mesh->live = true;
+    mesh->quad_count = quad_count;
+    vulkan_chunk_quads_bounds(quads, quad_count, &mesh->bounds_min, &mesh->bounds_max);
+    memcpy(mesh->position, position, sizeof(mesh->position));
+    if (chunk_index >= chunks->chunk_high_water) chunks->chunk_high_water = chunk_index + 1;
+    vulkan_chunk_buffer_mark_info(vk, chunk_index);
+    return true;
+}
+
+// Moves the highest live chunks down into the lowest hole, a few per frame, so
+// the used part of the buffer stays compact.
+void vulkan_chunk_buffer_defragment(Vulkan_State *vk) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    uint32_t budget = VULKAN_CHUNK_DEFRAG_QUADS_PER_FRAME;
+    for (uint32_t move_idx = 0; move_idx < 16 && chunks->free_ranges.count > 1; ++move_idx) {
+        Vulkan_Range hole = chunks->free_ranges.items[0];
+
+        uint32_t candidate = UINT32_MAX;
+        for (uint32_t chunk_idx = 0; chunk_idx < chunks->chunk_high_water; ++chunk_idx) {
+            Vulkan_Chunk_Mesh *mesh = &chunks->chunks[chunk_idx];
+            if (!mesh->live || mesh->offset < hole.offset || mesh->capacity > hole.size || mesh->capacity > budget) continue;
+            if (candidate == UINT32_MAX || mesh->offset > chunks->chunks[candidate].offset) candidate = chunk_idx;
+        }
+        if (candidate == UINT32_MAX) break;
+
+        // Straight into the lowest hole, a best fit could land higher up and
+        // leave the hole open.
+        Vulkan_Chunk_Mesh *mesh = &chunks->chunks[candidate];
+        if (hole.offset >= mesh->offset) break;
+        uint32_t offset = vulkan_range_take_front(&chunks->free_ranges, 0, mesh->capacity);
+        vulkan_staging_push_move(vk, chunks->quads.handle,
+                                 (VkDeviceSize)mesh->offset*sizeof(Vulkan_Chunk_Quad),
+                                 (VkDeviceSize)offset*sizeof(Vulkan_Chunk_Quad),
+                                 (VkDeviceSize)mesh->quad_count*sizeof(Vulkan_Chunk_Quad));
+        vulkan_chunk_buffer_release(vk, mesh->offset, mesh->capacity);
+        mesh->offset = offset;
+        vulkan_chunk_buffer_mark_info(vk, candidate);
+        budget -= mesh->capacity;
+    }
+}
+
+void vulkan_chunk_buffer_update(Vulkan_State *vk) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    if (!chunks->quads.handle) return;
+
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(vk->device, vk->timeline, &completed);
+    for (uint32_t range_idx = 0; range_idx < chunks->pending_ranges.count;) {
+        Vulkan_Range *range = &chunks->pending_ranges.items[range_idx];
+        if (range->release_value <= completed) {
+            vulkan_range_free(&chunks->free_ranges, range->offset, range->size);
+            *range = chunks->pending_ranges.items[--chunks->pending_ranges.count];
+        } else {
+            ++range_idx;
+        }
+    }
+    vulkan_chunk_buffer_defragment(vk);
+}
+
+bool vulkan_backend_create_chunk_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    if (!vulkan_buffer_create_shared(vk, (VkDeviceSize)VULKAN_CHUNK_QUAD_CAPACITY*sizeof(Vulkan_Chunk_Quad), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &chunks->quads)) return false;
+    if (!vulkan_buffer_create_shared(vk, VULKAN_MAX_CHUNKS*sizeof(Vulkan_Chunk_Info), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &chunks->infos)) return false;
+    VkBufferUsageFlags draw_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (!vulkan_buffer_create(vk, 2*VULKAN_MAX_CHUNKS*sizeof(VkDrawIndirectCommand), draw_usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &chunks->draws)) return false;
+    if (!vulkan_buffer_create(vk, sizeof(Vulkan_Chunk_Draw_Counts), draw_usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &chunks->draw_count)) return false;
+    if (!vulkan_buffer_create(vk, VULKAN_MAX_CHUNKS*sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &chunks->visibility)) return false;
+    if (!vulkan_buffer_create(vk, VULKAN_FRAMES_IN_FLIGHT*sizeof(Vulkan_Chunk_Draw_Counts), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &chunks->stats_readback)) return false;
+    vulkan_range_free(&chunks->free_ranges, 0, VULKAN_CHUNK_QUAD_CAPACITY);
+    for (uint32_t frame_idx = 0; frame_idx < VULKAN_FRAMES_IN_FLIGHT; ++frame_idx) chunks->stats_live[frame_idx] = UINT32_MAX;
+
+    VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+    VkDescriptorSetLayoutBinding bindings[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 3, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        // Written by vulkan_backend_create_render_targets, the pyramid is a render graph image.
+        { .binding = 4, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 5, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        // Written by vulkan_backend_create_shadow_stage.
+        { .binding = 6, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT },
+        // Written by vulkan_backend_create_light_stage.
+        { .binding = 7, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT },
+        { .binding = 8, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT },
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = array_count(bindings);
+    layout_info.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &chunks->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create chunk descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VULKAN_TARGET_GENERATIONS*(array_count(bindings) - 2) },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VULKAN_TARGET_GENERATIONS*2 },
+    };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = VULKAN_TARGET_GENERATIONS;
+    pool_info.poolSizeCount = array_count(pool_sizes);
+    pool_info.pPoolSizes = pool_sizes;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &chunks->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create chunk descriptor pool");
+        return false;
+    }
+
+    // Only the pyramid binding differs between the generations.
+    VkDescriptorSetLayout set_layouts[VULKAN_TARGET_GENERATIONS];
+    for (uint32_t generation = 0; generation < VULKAN_TARGET_GENERATIONS; ++generation) set_layouts[generation] = chunks->set_layout;
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = chunks->descriptor_pool;
+    set_info.descriptorSetCount = VULKAN_TARGET_GENERATIONS;
+    set_info.pSetLayouts = set_layouts;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, chunks->descriptor_sets) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate chunk descriptor sets");
+        return false;
+    }
+    chunks->descriptor_set = chunks->descriptor_sets[0];
+
+    VkDescriptorBufferInfo buffer_infos[] = {
+        { chunks->quads.handle, 0, VK_WHOLE_SIZE },
+        { chunks->infos.handle, 0, VK_WHOLE_SIZE },
+        { chunks->draws.handle, 0, VK_WHOLE_SIZE },
+        { chunks->draw_count.handle, 0, VK_WHOLE_SIZE },
+        { chunks->visibility.handle, 0, VK_WHOLE_SIZE },
+    };
+    uint32_t buffer_bindings[array_count(buffer_infos)] = { 0, 1, 2, 3, 5 };
+    VkWriteDescriptorSet writes[VULKAN_TARGET_GENERATIONS*array_count(buffer_infos)];
+    for (uint32_t write_idx = 0; write_idx < array_count(writes); ++write_idx) {
+        uint32_t buffer_idx = write_idx % array_count(buffer_infos);
+        writes[write_idx] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = chunks->descriptor_sets[write_idx / array_count(buffer_infos)],
+            .dstBinding = buffer_bindings[buffer_idx],
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &buffer_infos[buffer_idx],
+        };
+    }
+    vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0, 0);
+    vulkan_graph_import_buffer(&vk->graph, vk->chunk_draws_target, chunks->draws.handle);
+    vulkan_graph_import_buffer(&vk->graph, vk->chunk_draw_count_target, chunks->draw_count.handle);
+    vulkan_graph_import_buffer(&vk->graph, vk->chunk_visibility_target, chunks->visibility.handle);
+
+    // Position only, the prepass draws with it so that the opaque pipelines
+    // below shade each pixel once. Set 1 is only there to share their layout.
+    #include "shaders/chunk_depth.vert.h"
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->depth_prepass));
+    vulkan_pipeline_info_set_depth_only(&pipeline_info);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, chunks->set_layout);
+    vulkan_pipeline_info_set_bindless(&pipeline_info, &vk->bindless);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Chunk_Constants));
+    vulkan_pipeline_info_set_depth_test(&pipeline_info, VK_COMPARE_OP_LESS, true);
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk_depth, vert))) return false;
+    chunks->depth_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (chunks->depth_pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    // Both are part of the startup batch. The fallback stays registered for
+    // when the lit pipeline gets rebuilt at runtime.
+    #include "shaders/chunk.vert.h"
+    #include "shaders/chunk.frag.h"
+    #include "shaders/chunk_fallback.frag.h"
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->opaque_pass));
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, chunks->set_layout);
+    vulkan_pipeline_info_set_bindless(&pipeline_info, &vk->bindless);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Chunk_Constants));
+    vulkan_pipeline_info_set_depth_test(&pipeline_info, VK_COMPARE_OP_EQUAL, false);
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk, vert))) return false;
+    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk_fallback, frag))) return false;
+    chunks->fallback_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (chunks->fallback_pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->opaque_pass));
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, chunks->set_layout);
+    vulkan_pipeline_info_set_bindless(&pipeline_info, &vk->bindless);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Chunk_Constants));
+    vulkan_pipeline_info_set_depth_test(&pipeline_info, VK_COMPARE_OP_EQUAL, false);
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk, vert))) return false;
+    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk, frag))) return false;
+    chunks->pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, chunks->fallback_pipeline);
+    if (chunks->pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    #include "shaders/chunk_cull.comp.h"
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, chunks->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Chunk_Cull_Constants));
+    if (!vulkan_pipeline_info_add_compute_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk_cull, comp))) return false;
+    chunks->cull_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    return chunks->cull_pipeline != VULKAN_PIPELINE_NONE;
+}
+
+// Reads back the draw counts of the frame that last used this slot. Logged
+// every 256 frames as an average.
+void vulkan_chunk_buffer_read_stats(Vulkan_State *vk) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    if (!chunks->stats_readback.handle || chunks->stats_live[vk->frame_index] == UINT32_MAX) return;
+    Vulkan_Chunk_Draw_Counts *counts = (Vulkan_Chunk_Draw_Counts *)chunks->stats_readback.allocation.mapped + vk->frame_index;
+    chunks->stats_drawn_total += counts->early_draws + counts->late_draws;
+    chunks->stats_live_total += chunks->stats_live[vk->frame_index];
+    chunks->stats_frustum_triangles += counts->frustum_triangles;
+    chunks->stats_drawn_triangles += counts->drawn_triangles;
+    chunks->stats_live[vk->frame_index] = UINT32_MAX;
+    if (++chunks->stats_frames == 256) {
+        print_info("GPU culling: %.1f chunks drawn, %.1f culled, %.1fk triangles after frustum, %.1fk after occlusion per frame",
+                   (double)chunks->stats_drawn_total / 256.0,
+                   (double)(chunks->stats_live_total - chunks->stats_drawn_total) / 256.0,
+                   (double)chunks->stats_frustum_triangles / 256000.0,
+                   (double)chunks->stats_drawn_triangles / 256000.0);
+        chunks->stats_drawn_total = 0;
+        chunks->stats_live_total = 0;
+        chunks->stats_frustum_triangles = 0;
+        chunks->stats_drawn_triangles = 0;
+        chunks->stats_frames = 0;
+    }
+}
+
+// Runs as the cull_early and cull_late graph passes, which wait on the
+// previous users of the draw lists. The late phase tests against the pyramid
+// when it was built this frame and only against the frustum otherwise.
+void vulkan_chunk_buffer_record_cull(Vulkan_State *vk, VkCommandBuffer cmd, uint32_t phase, bool hiz_built) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    if (!chunks->draws.handle) return;
+
+    if (phase == VULKAN_CHUNK_CULL_EARLY) {
+        vkCmdFillBuffer(cmd, chunks->draw_count.handle, 0, sizeof(Vulkan_Chunk_Draw_Counts), 0);
+        if (!chunks->visibility_cleared) {
+            vkCmdFillBuffer(cmd, chunks->visibility.handle, 0, VK_WHOLE_SIZE, 0);
+            chunks->visibility_cleared = true;
+        }
+
+        VkMemoryBarrier cleared = {};
+        cleared.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        cleared.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        cleared.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &cleared, 0, 0, 0, 0);
+    }
+
+    Vulkan_Pipeline *cull = vulkan_pipeline_resolve(&vk->pipelines, chunks->cull_pipeline);
+    if (cull && chunks->chunk_high_water) {
+        Vulkan_Chunk_Cull_Constants constants = {};
+        memcpy(constants.view_proj, vk->view_proj, sizeof(constants.view_proj));
+        constants.chunk_count = chunks->chunk_high_water;
+        constants.phase = phase;
+        if (hiz_built) {
+            constants.hiz_width = vk->hiz.extent.width;
+            constants.hiz_height = vk->hiz.extent.height;
+            constants.hiz_mip_count = vk->hiz.mip_count;
+        }
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull->handle);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull->layout, 0, 1, &chunks->descriptor_set, 0, 0);
+        vkCmdPushConstants(cmd, cull->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        vkCmdDispatch(cmd, (chunks->chunk_high_water + 63) / 64, 1, 1);
+    }
+
+    // The graph only orders passes, the stats copy is inside this one.
+    if (phase == VULKAN_CHUNK_CULL_LATE) {
+        VkMemoryBarrier culled = {};
+        culled.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        culled.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        culled.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &culled, 0, 0, 0, 0);
+        VkBufferCopy region = { 0, vk->frame_index*sizeof(Vulkan_Chunk_Draw_Counts), sizeof(Vulkan_Chunk_Draw_Counts) };
+        vkCmdCopyBuffer(cmd, chunks->draw_count.handle, chunks->stats_readback.handle, 1, &region);
+        chunks->stats_live[vk->frame_index] = chunks->live_chunks;
+    }
+}
+
+// The cull pass wrote one draw per visible chunk into the list. firstVertex
+// points at the chunk's quads and firstInstance at its Chunk_Info. pipeline is
+// one of the chunk pipelines, they all share a layout. Returns false if
+// nothing was recorded.
+bool vulkan_chunk_buffer_record_draws(Vulkan_State *vk, VkCommandBuffer cmd, uint32_t pipeline, uint32_t list) {
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    Vulkan_Pipeline *chunk_pipeline = vulkan_pipeline_resolve(&vk->pipelines, pipeline);
+    if (!chunk_pipeline || !chunks->chunk_high_water) return false;
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, chunk_pipeline->handle);
+    VkDescriptorSet sets[] = { chunks->descriptor_set, vk->bindless.descriptor_set };
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, chunk_pipeline->layout, 0, array_count(sets), sets, 0, 0);
+    Vulkan_Chunk_Constants constants = {};
+    memcpy(constants.view_proj, vk->view_proj, sizeof(constants.view_proj));
+    memcpy(constants.shadow_origins, vk->shadows.origins, sizeof(constants.shadow_origins));
+    constants.cluster_scale[0] = (float)VULKAN_LIGHT_CLUSTERS_X / (float)vk->render_extent.width;
+    constants.cluster_scale[1] = (float)VULKAN_LIGHT_CLUSTERS_Y / (float)vk->render_extent.height;
+    vkCmdPushConstants(cmd, chunk_pipeline->layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(constants), &constants);
+
+    VkDeviceSize draws_offset = (VkDeviceSize)list*VULKAN_MAX_CHUNKS*sizeof(VkDrawIndirectCommand);
+    VkDeviceSize count_offset = list == VULKAN_CHUNK_CULL_EARLY ? offsetof(Vulkan_Chunk_Draw_Counts, early_draws) : offsetof(Vulkan_Chunk_Draw_Counts, late_draws);
+    vkCmdDrawIndirectCount(cmd, chunks->draws.handle, draws_offset, chunks->draw_count.handle, count_offset, chunks->chunk_high_water, sizeof(VkDrawIndirectCommand));
+    return true;
+}
+
+// The hiz graph pass, which has the depth readable and the pyramid in GENERAL.
+// Level 0 reduces the depth buffer, every level after that the one before it.
+// Returns false when the pyramid could not be built this frame.
+bool vulkan_hiz_record_build(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Hiz *hiz = &vk->hiz;
+    Vulkan_Pipeline *reduce = vulkan_pipeline_resolve(&vk->pipelines, hiz->pipeline);
+    if (!reduce || !hiz->mip_count) return false;
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, reduce->handle);
+    uint32_t src_width = vk->render_extent.width;
+    uint32_t src_height = vk->render_extent.height;
+    for (uint32_t level = 0; level < hiz->mip_count; ++level) {
+        Vulkan_Hiz_Constants constants = {};
+        constants.src_width = src_width;
+        constants.src_height = src_height;
+        constants.dst_width = kabarr_max(hiz->extent.width >> level, 1u);
+        constants.dst_height = kabarr_max(hiz->extent.height >> level, 1u);
+        constants.from_depth = level == 0;
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, reduce->layout, 0, 1, &hiz->sets[vk->target_generation][level], 0, 0);
+        vkCmdPushConstants(cmd, reduce->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        vkCmdDispatch(cmd, (constants.dst_width + 7) / 8, (constants.dst_height + 7) / 8, 1);
+
+        // The graph's barrier covers the last level on its way to the late cull.
+        if (level + 1 == hiz->mip_count) break;
+        VkMemoryBarrier reduced = {};
+        reduced.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        reduced.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        reduced.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &reduced, 0, 0, 0, 0);
+        src_width = constants.dst_width;
+        src_height = constants.dst_height;
+    }
+    return true;
+}
+
+void vulkan_backend_destroy_render_targets(Vulkan_State *vk) {
+    Vulkan_Hiz *hiz = &vk->hiz;
+    for (uint32_t level = 0; level < hiz->mip_count; ++level) {
+        vulkan_retire(vk, (Vulkan_Retired){ .kind = Vulkan_Retired_Image_View, .release_value = vk->frame_number, .view = hiz->mip_views[level] });
+        hiz->mip_views[level] = VK_NULL_HANDLE;
+    }
+    hiz->mip_count = 0;
+    vulkan_graph_destroy_targets(vk);
+}
+
+// Everything that follows the render extent: the render graph's images and
+// framebuffers, and the descriptors pointing at the Hi-Z pyramid, the far
+// field images and the scene color. The old ones are retired, so frames in
+// flight keep rendering with them.
+bool vulkan_backend_create_render_targets(Vulkan_State *vk) {
+    vulkan_backend_destroy_render_targets(vk);
+    float scale = vk->resolution.scale ? vk->resolution.scale : 1.0f;
+    vk->render_extent.width = kabarr_max((uint32_t)((float)vk->extent.width*scale + 0.5f), 1u);
+    vk->render_extent.height = kabarr_max((uint32_t)((float)vk->extent.height*scale + 0.5f), 1u);
+    if (!vulkan_graph_create_targets(vk)) return false;
+
+    // The other generation's sets were last used before the previous resize,
+    // this only blocks when the window is resized every frame.
+    vk->target_release_values[vk->target_generation] = vk->frame_number;
+    uint32_t generation = (vk->target_generation + 1) % VULKAN_TARGET_GENERATIONS;
+    if (!vulkan_timeline_wait(vk, vk->target_release_values[generation])) return false;
+    vk->target_generation = generation;
+    vk->chunks.descriptor_set = vk->chunks.descriptor_sets[generation];
+
+    // Rounding down keeps every pyramid texel inside the depth texels it covers,
+    // the reduce folds the odd row and column into the last texel.
+    Vulkan_Hiz *hiz = &vk->hiz;
+    Vulkan_Graph_Resource *pyramid = &vk->graph.resources[vk->hiz_target];
+    Vulkan_Graph_Resource *depth = &vk->graph.resources[vk->depth_target];
+    hiz->extent.width = pyramid->image.extent.width;
+    hiz->extent.height = pyramid->image.extent.height;
+    hiz->mip_count = pyramid->levels;
+
+    for (uint32_t level = 0; level < hiz->mip_count; ++level) {
+        VkImageViewCreateInfo view_info = {};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = pyramid->image.handle;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = pyramid->format;
+        view_info.subresourceRange = (VkImageSubresourceRange){ VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 };
+        if (vkCreateImageView(vk->device, &view_info, 0, &hiz->mip_views[level]) != VK_SUCCESS) {
+            print_error("Vulkan failed to create Hi-Z mip view");
+            return false;
+        }
+    }
+
+    // Level 0 never reads src, it just needs something valid bound.
+    for (uint32_t level = 0; level < hiz->mip_count; ++level) {
+        VkDescriptorImageInfo depth_info = { hiz->sampler, depth->image.view, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL };
+        VkDescriptorImageInfo src = { VK_NULL_HANDLE, hiz->mip_views[level ? level - 1 : 0], VK_IMAGE_LAYOUT_GENERAL };
+        VkDescriptorImageInfo dst = { VK_NULL_HANDLE, hiz->mip_views[level], VK_IMAGE_LAYOUT_GENERAL };
+        VkWriteDescriptorSet writes[] = {
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = hiz->sets[generation][level], .dstBinding = 0,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .pImageInfo = &depth_info },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = hiz->sets[generation][level], .dstBinding = 1,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .pImageInfo = &src },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = hiz->sets[generation][level], .dstBinding = 2,
+              .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .pImageInfo = &dst },
+        };
+        vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0, 0);
+    }
+
+    VkDescriptorImageInfo pyramid_info = { hiz->sampler, pyramid->image.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = vk->chunks.descriptor_set;
+    write.dstBinding = 4;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &pyramid_info;
+    vkUpdateDescriptorSets(vk->device, 1, &write, 0, 0);
+
+    // The raymarch writes the far images in GENERAL, the composite samples them.
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    Vulkan_Graph_Resource *far_color = &vk->graph.resources[vk->far_color_target];
+    Vulkan_Graph_Resource *far_depth = &vk->graph.resources[vk->far_depth_target];
+    far_field->descriptor_set = far_field->descriptor_sets[generation];
+    VkDescriptorImageInfo far_infos[] = {
+        { far_field->sampler, depth->image.view, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL },
+        { VK_NULL_HANDLE, far_color->image.view, VK_IMAGE_LAYOUT_GENERAL },
+        { VK_NULL_HANDLE, far_depth->image.view, VK_IMAGE_LAYOUT_GENERAL },
+        { far_field->sampler, far_color->image.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+        { far_field->sampler, far_depth->image.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+    };
+    VkWriteDescriptorSet far_writes[array_count(far_infos)];
+    for (uint32_t write_idx = 0; write_idx < array_count(far_writes); ++write_idx) {
+        bool storage = write_idx == 1 || write_idx == 2;
+        far_writes[write_idx] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = far_field->descriptor_set,
+            .dstBinding = 3 + write_idx,
+            .descriptorCount = 1,
+            .descriptorType = storage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &far_infos[write_idx],
+        };
+    }
+    vkUpdateDescriptorSets(vk->device, array_count(far_writes), far_writes, 0, 0);
+
+    Vulkan_Resolution *resolution = &vk->resolution;
+    Vulkan_Graph_Resource *scene_color = &vk->graph.resources[vk->scene_color_target];
+    resolution->descriptor_set = resolution->descriptor_sets[generation];
+    VkDescriptorImageInfo scene_info = { resolution->sampler, scene_color->image.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+    write.dstSet = resolution->descriptor_set;
+    write.dstBinding = 0;
+    write.pImageInfo = &scene_info;
+    vkUpdateDescriptorSets(vk->device, 1, &write, 0, 0);
+    return true;
+}
+
+// Column major like view_proj, returns false for a singular matrix.
+bool vulkan_mat4_inverse(const float m[16], float out[16]) {
+    float inv[16];
+    inv[0] = m[5]*m[10]*m[15] - m[5]*m[11]*m[14] - m[9]*m[6]*m[15] + m[9]*m[7]*m[14] + m[13]*m[6]*m[11] - m[13]*m[7]*m[10];
+    inv[4] = -m[4]*m[10]*m[15] + m[4]*m[11]*m[14] + m[8]*m[6]*m[15] - m[8]*m[7]*m[14] - m[12]*m[6]*m[11] + m[12]*m[7]*m[10];
+    inv[8] = m[4]*m[9]*m[15] - m[4]*m[11]*m[13] - m[8]*m[5]*m[15] + m[8]*m[7]*m[13] + m[12]*m[5]*m[11] - m[12]*m[7]*m[9];
+    inv[12] = -m[4]*m[9]*m[14] + m[4]*m[10]*m[13] + m[8]*m[5]*m[14] - m[8]*m[6]*m[13] - m[12]*m[5]*m[10] + m[12]*m[6]*m[9];
+    inv[1] = -m[1]*m[10]*m[15] + m[1]*m[11]*m[14] + m[9]*m[2]*m[15] - m[9]*m[3]*m[14] - m[13]*m[2]*m[11] + m[13]*m[3]*m[10];
+    inv[5] = m[0]*m[10]*m[15] - m[0]*m[11]*m[14] - m[8]*m[2]*m[15] + m[8]*m[3]*m[14] + m[12]*m[2]*m[11] - m[12]*m[3]*m[10];
+    inv[9] = -m[0]*m[9]*m[15] + m[0]*m[11]*m[13] + m[8]*m[1]*m[15] - m[8]*m[3]*m[13] - m[12]*m[1]*m[11] + m[12]*m[3]*m[9];
+    inv[13] = m[0]*m[9]*m[14] - m[0]*m[10]*m[13] - m[8]*m[1]*m[14] + m[8]*m[2]*m[13] + m[12]*m[1]*m[10] - m[12]*m[2]*m[9];
+    inv[2] = m[1]*m[6]*m[15] - m[1]*m[7]*m[14] - m[5]*m[2]*m[15] + m[5]*m[3]*m[14] + m[13]*m[2]*m[7] - m[13]*m[3]*m[6];
+    inv[6] = -m[0]*m[6]*m[15] + m[0]*m[7]*m[14] + m[4]*m[2]*m[15] - m[4]*m[3]*m[14] - m[12]*m[2]*m[7] + m[12]*m[3]*m[6];
+    inv[10] = m[0]*m[5]*m[15] - m[0]*m[7]*m[13] - m[4]*m[1]*m[15] + m[4]*m[3]*m[13] + m[12]*m[1]*m[7] - m[12]*m[3]*m[5];
+    inv[14] = -m[0]*m[5]*m[14] + m[0]*m[6]*m[13] + m[4]*m[1]*m[14] - m[4]*m[2]*m[13] - m[12]*m[1]*m[6] + m[12]*m[2]*m[5];
+    inv[3] = -m[1]*m[6]*m[11] + m[1]*m[7]*m[10] + m[5]*m[2]*m[11] - m[5]*m[3]*m[10] - m[9]*m[2]*m[7] + m[9]*m[3]*m[6];
+    inv[7] = m[0]*m[6]*m[11] - m[0]*m[7]*m[10] - m[4]*m[2]*m[11] + m[4]*m[3]*m[10] + m[8]*m[2]*m[7] - m[8]*m[3]*m[6];
+    inv[11] = -m[0]*m[5]*m[11] + m[0]*m[7]*m[9] + m[4]*m[1]*m[11] - m[4]*m[3]*m[9] - m[8]*m[1]*m[7] + m[8]*m[3]*m[5];
+    inv[15] = m[0]*m[5]*m[10] - m[0]*m[6]*m[9] - m[4]*m[1]*m[10] + m[4]*m[2]*m[9] + m[8]*m[1]*m[6] - m[8]*m[2]*m[5];
+    float det = m[0]*inv[0] + m[1]*inv[4] + m[2]*inv[8] + m[3]*inv[12];
+    if (det == 0.0f) return false;
+    for (uint32_t idx = 0; idx < 16; ++idx) out[idx] = inv[idx] / det;
+    return true;
+}
+
+// Before the Hi-Z stage, which writes the image bindings of the sets.
+bool vulkan_backend_create_far_field_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    uint32_t grid_cells = VULKAN_FAR_GRID_X*VULKAN_FAR_GRID_Y*VULKAN_FAR_GRID_Z;
+    VkDeviceSize brick_bytes = VULKAN_FAR_CELLS*VULKAN_FAR_CELLS*VULKAN_FAR_CELLS*sizeof(uint16_t);
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (!vulkan_buffer_create_shared(vk, grid_cells*sizeof(uint32_t), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &far_field->grid)) return false;
+    if (!vulkan_buffer_create_shared(vk, VULKAN_FAR_MAX_CHUNKS*4*sizeof(int32_t), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &far_field->positions)) return false;
+    if (!vulkan_buffer_create_shared(vk, VULKAN_FAR_MAX_CHUNKS*brick_bytes, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &far_field->bricks)) return false;
+    far_field->grid_entries = malloc(grid_cells*sizeof(uint32_t));
+    assert(far_field->grid_entries);
+    memset(far_field->grid_entries, 0, grid_cells*sizeof(uint32_t));
+
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    if (vkCreateSampler(vk->device, &sampler_info, 0, &far_field->sampler) != VK_SUCCESS) {
+        print_error("Vulkan failed to create far field sampler");
+        return false;
+    }
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        // Written by vulkan_backend_create_render_targets, these are render graph images.
+        { .binding = 3, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 4, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 5, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 6, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT },
+        { .binding = 7, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT },
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = array_count(bindings);
+    layout_info.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &far_field->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create far field descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3*VULKAN_TARGET_GENERATIONS },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3*VULKAN_TARGET_GENERATIONS },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2*VULKAN_TARGET_GENERATIONS },
+    };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = VULKAN_TARGET_GENERATIONS;
+    pool_info.poolSizeCount = array_count(pool_sizes);
+    pool_info.pPoolSizes = pool_sizes;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &far_field->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create far field descriptor pool");
+        return false;
+    }
+
+    VkDescriptorSetLayout set_layouts[VULKAN_TARGET_GENERATIONS];
+    for (uint32_t generation = 0; generation < VULKAN_TARGET_GENERATIONS; ++generation) set_layouts[generation] = far_field->set_layout;
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = far_field->descriptor_pool;
+    set_info.descriptorSetCount = VULKAN_TARGET_GENERATIONS;
+    set_info.pSetLayouts = set_layouts;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, far_field->descriptor_sets) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate far field descriptor sets");
+        return false;
+    }
+    far_field->descriptor_set = far_field->descriptor_sets[0];
+
+    VkDescriptorBufferInfo buffer_infos[] = {
+        { far_field->grid.handle, 0, VK_WHOLE_SIZE },
+        { far_field->positions.handle, 0, VK_WHOLE_SIZE },
+        { far_field->bricks.handle, 0, VK_WHOLE_SIZE },
+    };
+    VkWriteDescriptorSet writes[VULKAN_TARGET_GENERATIONS*array_count(buffer_infos)];
+    for (uint32_t write_idx = 0; write_idx < array_count(writes); ++write_idx) {
+        uint32_t buffer_idx = write_idx % array_count(buffer_infos);
+        writes[write_idx] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = far_field->descriptor_sets[write_idx / array_count(buffer_infos)],
+            .dstBinding = buffer_idx,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &buffer_infos[buffer_idx],
+        };
+    }
+    vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0, 0);
+
+    #include "shaders/far_raymarch.comp.h"
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, far_field->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Far_Constants));
+    if (!vulkan_pipeline_info_add_compute_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, far_raymarch, comp))) return false;
+    far_field->raymarch_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (far_field->raymarch_pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    // Writes the raymarched depth so later passes test against the far field too.
+    #include "shaders/fullscreen.vert.h"
+    #include "shaders/far_composite.frag.h"
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->far_composite_pass));
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, far_field->set_layout);
+    vulkan_pipeline_info_set_depth_test(&pipeline_info, VK_COMPARE_OP_LESS_OR_EQUAL, true);
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, fullscreen, vert))) return false;
+    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, far_composite, frag))) return false;
+    far_field->composite_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (far_field->composite_pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    print_info("Far field covers %ux%ux%u chunks with room for %u of them in %.1f MB",
+               VULKAN_FAR_GRID_X, VULKAN_FAR_GRID_Y, VULKAN_FAR_GRID_Z, VULKAN_FAR_MAX_CHUNKS,
+               (double)(far_field->grid.size + far_field->positions.size + far_field->bricks.size) / (1024.0*1024.0));
+    return true;
+}
+
+uint32_t vulkan_far_grid_index(int32_t position[3]) {
+    uint32_t x = (uint32_t)position[0] & (VULKAN_FAR_GRID_X - 1);
+    uint32_t y = (uint32_t)position[1] & (VULKAN_FAR_GRID_Y - 1);
+    uint32_t z = (uint32_t)position[2] & (VULKAN_FAR_GRID_Z - 1);
+    return x + VULKAN_FAR_GRID_X*(y + VULKAN_FAR_GRID_Y*z);
+}
+
+// Grid cells are gathered and uploaded once per frame like the chunk infos.
+void vulkan_far_grid_set(Vulkan_State *vk, uint32_t cell, uint32_t entry) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    bool dirty = (far_field->grid_entries[cell] & VULKAN_FAR_GRID_DIRTY) != 0;
+    far_field->grid_entries[cell] = entry | VULKAN_FAR_GRID_DIRTY;
+    if (!dirty) kabarr_append(&far_field->dirty_cells, cell);
+}
+
+// The brick may still be read by frames in flight, it is reused once they're done.
+void vulkan_far_brick_release(Vulkan_State *vk, uint32_t brick) {
+    Vulkan_Range range = { .offset = brick, .size = 1, .release_value = vk->frame_number + 1 };
+    kabarr_append(&vk->far_field.pending_bricks, range);
+    vk->far_field.live_chunks -= 1;
+}
+
+void vulkan_far_chunk_remove(Vulkan_State *vk, int32_t position[3]) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    if (!far_field->grid_entries) return;
+    uint32_t cell = vulkan_far_grid_index(position);
+    uint32_t entry = far_field->grid_entries[cell] & ~VULKAN_FAR_GRID_DIRTY;
+    if (!entry || memcmp(far_field->brick_positions[entry - 1], position, sizeof(far_field->brick_positions[0])) != 0) return;
+    vulkan_far_brick_release(vk, entry - 1);
+    vulkan_far_grid_set(vk, cell, 0);
+}
+
+// Lane 0 only, between begin_frame and record. voxels holds 32^3 colors in
+// the chunk quad material format, x fastest then y then z, 0 for air. Every
+// cell keeps the first solid voxel of its 2x2x2, top layer first so surfaces
+// keep their color. A chunk that wraps onto the cell of another one replaces
+// it. Returns false if the upload ring is full, retry next frame.
+bool vulkan_far_chunk_upload(Vulkan_State *vk, int32_t position[3], const uint16_t *voxels) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    if (!far_field->grid_entries) return false;
+    uint16_t cells[VULKAN_FAR_CELLS*VULKAN_FAR_CELLS*VULKAN_FAR_CELLS];
+    bool solid = false;
+    for (uint32_t z = 0; z < VULKAN_FAR_CELLS; ++z) {
+        for (uint32_t y = 0; y < VULKAN_FAR_CELLS; ++y) {
+            for (uint32_t x = 0; x < VULKAN_FAR_CELLS; ++x) {
+                uint16_t color = 0;
+                for (uint32_t sub = 0; sub < 8 && !color; ++sub) {
+                    uint32_t vx = 2*x + (sub & 1);
+                    uint32_t vy = 2*y + 1 - ((sub >> 2) & 1);
+                    uint32_t vz = 2*z + ((sub >> 1) & 1);
+                    color = voxels[vx + VULKAN_CHUNK_SIZE*(vy + VULKAN_CHUNK_SIZE*vz)];
+                }
+                cells[x + VULKAN_FAR_CELLS*(y + VULKAN_FAR_CELLS*z)] = color;
+                solid |= color != 0;
+            }
+        }
+    }
+    if (!solid) {
+        vulkan_far_chunk_remove(vk, position);
+        return true;
+    }
+
+    uint32_t brick;
+    if (far_field->free_bricks.count) {
+        brick = far_field->free_bricks.items[far_field->free_bricks.count - 1];
+    } else if (far_field->brick_high_water < VULKAN_FAR_MAX_CHUNKS) {
+        brick = far_field->brick_high_water;
+    } else {
+        print_error("Far field is out of room for chunks");
+        return false;
+    }
+
+    // Nothing reads the brick until the grid points at it, so a half done
+    // upload can simply be tried again.
+    int32_t *brick_position = vulkan_staging_push(vk, 0, far_field->positions.handle, brick*4*sizeof(int32_t), 4*sizeof(int32_t));
+    if (!brick_position) return false;
+    memcpy(brick_position, position, 3*sizeof(int32_t));
+    brick_position[3] = 0;
+    void *dst = vulkan_staging_push(vk, 0, far_field->bricks.handle, brick*sizeof(cells), sizeof(cells));
+    if (!dst) return false;
+    memcpy(dst, cells, sizeof(cells));
+    if (far_field->free_bricks.count && far_field->free_bricks.items[far_field->free_bricks.count - 1] == brick) far_field->free_bricks.count -= 1;
+    else far_field->brick_high_water += 1;
+
+    uint32_t cell = vulkan_far_grid_index(position);
+    uint32_t old_entry = far_field->grid_entries[cell] & ~VULKAN_FAR_GRID_DIRTY;
+    if (old_entry) vulkan_far_brick_release(vk, old_entry - 1);
+    memcpy(far_field->brick_positions[brick], position, sizeof(far_field->brick_positions[0]));
+    far_field->live_chunks += 1;
+    vulkan_far_grid_set(vk, cell, brick + 1);
+    return true;
+}
+
+// Bricks freed before the last completed frame can be written again.
+void vulkan_far_field_update(Vulkan_State *vk) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(vk->device, vk->timeline, &completed);
+    for (uint32_t range_idx = 0; range_idx < far_field->pending_bricks.count;) {
+        Vulkan_Range *range = &far_field->pending_bricks.items[range_idx];
+        if (range->release_value <= completed) {
+            kabarr_append(&far_field->free_bricks, range->offset);
+            *range = far_field->pending_bricks.items[--far_field->pending_bricks.count];
+        } else {
+            ++range_idx;
+        }
+    }
+}
+
+// The first flush uploads the whole grid, which also clears it.
+void vulkan_far_field_flush_grid(Vulkan_State *vk) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    if (!far_field->grid_entries) return;
+    if (!far_field->grid_uploaded) {
+        uint32_t *grid = vulkan_staging_push(vk, 0, far_field->grid.handle, 0, far_field->grid.size);
+        if (!grid) return;
+        for (uint32_t cell = 0; cell < far_field->grid.size / sizeof(uint32_t); ++cell) {
+            far_field->grid_entries[cell] &= ~VULKAN_FAR_GRID_DIRTY;
+            grid[cell] = far_field->grid_entries[cell];
+        }
+        far_field->dirty_cells.count = 0;
+        far_field->grid_uploaded = true;
+        return;
+    }
+
+    uint32_t flushed = 0;
+    for (; flushed < far_field->dirty_cells.count; ++flushed) {
+        uint32_t cell = far_field->dirty_cells.items[flushed];
+        uint32_t *entry = vulkan_staging_push(vk, 0, far_field->grid.handle, cell*sizeof(uint32_t), sizeof(uint32_t));
+        if (!entry) break;
+        far_field->grid_entries[cell] &= ~VULKAN_FAR_GRID_DIRTY;
+        *entry = far_field->grid_entries[cell];
+    }
+    memmove(far_field->dirty_cells.items, far_field->dirty_cells.items + flushed, (far_field->dirty_cells.count - flushed)*sizeof(uint32_t));
+    far_field->dirty_cells.count -= flushed;
+}
+
+// Runs as the far raymarch graph pass, once the depth of every mesh is in.
+// Returns false when there is nothing to composite this frame.
+bool vulkan_far_field_record_raymarch(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    Vulkan_Pipeline *raymarch = vulkan_pipeline_resolve(&vk->pipelines, far_field->raymarch_pipeline);
+    if (!raymarch || !far_field->live_chunks || !far_field->grid_uploaded) return false;
+
+    Vulkan_Far_Constants constants = {};
+    if (!vulkan_mat4_inverse(vk->view_proj, constants.inv_view_proj)) return false;
+    for (uint32_t column = 0; column < 4; ++column) {
+        constants.depth_row_z[column] = vk->view_proj[column*4 + 2];
+        constants.depth_row_w[column] = vk->view_proj[column*4 + 3];
+    }
+    constants.width = vk->render_extent.width;
+    constants.height = vk->render_extent.height;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, raymarch->handle);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, raymarch->layout, 0, 1, &far_field->descriptor_set, 0, 0);
+    vkCmdPushConstants(cmd, raymarch->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, (constants.width + 7) / 8, (constants.height + 7) / 8, 1);
+    return true;
+}
+
+bool vulkan_far_field_record_composite(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    Vulkan_Pipeline *composite = vulkan_pipeline_resolve(&vk->pipelines, far_field->composite_pipeline);
+    if (!composite || !far_field->raymarched) return false;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, composite->handle);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, composite->layout, 0, 1, &far_field->descriptor_set, 0, 0);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
+    return true;
+}
+
+// Before the Hi-Z stage, which writes the scene color into the sets. The
+// scale starts at the highest one and vulkan_resolution_update brings it down.
+bool vulkan_backend_create_upscale_stage(Vulkan_State *vk, Fixed_Arena *transient_arena, Vulkan_Resolution_Config *config) {
+    Vulkan_Resolution *resolution = &vk->resolution;
+    resolution->config = *config;
+    resolution->scale = config->max_scale;
+    resolution->stats_lowest_scale = config->max_scale;
+    if (config->enabled && !vk->profiler.enabled) {
+        print_info("No GPU timestamps, dynamic resolution stays at %.0f%%", (double)config->max_scale*100.0);
+        resolution->config.enabled = false;
+    }
+
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    if (vkCreateSampler(vk->device, &sampler_info, 0, &resolution->sampler) != VK_SUCCESS) {
+        print_error("Vulkan failed to create upscale sampler");
+        return false;
+    }
+
+    // Written by vulkan_backend_create_render_targets, the scene color is a render graph image.
+    VkDescriptorSetLayoutBinding binding = { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT };
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 1;
+    layout_info.pBindings = &binding;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &resolution->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create upscale descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorPoolSize pool_size = { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VULKAN_TARGET_GENERATIONS };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = VULKAN_TARGET_GENERATIONS;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &resolution->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create upscale descriptor pool");
+        return false;
+    }
+
+    VkDescriptorSetLayout set_layouts[VULKAN_TARGET_GENERATIONS];
+    for (uint32_t generation = 0; generation < VULKAN_TARGET_GENERATIONS; ++generation) set_layouts[generation] = resolution->set_layout;
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = resolution->descriptor_pool;
+    set_info.descriptorSetCount = VULKAN_TARGET_GENERATIONS;
+    set_info.pSetLayouts = set_layouts;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, resolution->descriptor_sets) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate upscale descriptor sets");
+        return false;
+    }
+    resolution->descriptor_set = resolution->descriptor_sets[0];
+
+    #include "shaders/fullscreen.vert.h"
+    #include "shaders/upscale.frag.h"
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->upscale_pass));
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, resolution->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Upscale_Constants));
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, fullscreen, vert))) return false;
+    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, upscale, frag))) return false;
+    resolution->pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (resolution->pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    if (resolution->config.enabled) {
+        if (config->target_ms) {
+            print_info("Dynamic resolution between %.0f%% and %.0f%% holding %.2f ms on the GPU",
+                       (double)config->min_scale*100.0, (double)config->max_scale*100.0, (double)config->target_ms);
+        } else {
+            print_info("Dynamic resolution between %.0f%% and %.0f%% holding the refresh interval on the GPU",
+                       (double)config->min_scale*100.0, (double)config->max_scale*100.0);
+        }
+    }
+    return true;
+}
+
+// Once per frame after the profiler collected, returns true when the scale
+// changed and the render targets have to follow. The GPU time follows the
+// pixel count, so the edge scales with the square root of the time ratio,
+// aimed a little under the target so the next frames don't bounce off it.
+bool vulkan_resolution_update(Vulkan_State *vk) {
+    Vulkan_Resolution *resolution = &vk->resolution;
+    uint64_t frame_ns = vk->profiler.zone_ns[vk->graph.pass_count];
+    if (!resolution->config.enabled || !frame_ns) return false;
+    float frame_ms = (float)frame_ns / 1000000.0f;
+    resolution->gpu_ms = resolution->gpu_ms ? resolution->gpu_ms*0.9f + frame_ms*0.1f : frame_ms;
+
+    float target_ms = resolution->config.target_ms;
+    if (!target_ms) target_ms = vk->pacing.refresh_ns ? (float)vk->pacing.refresh_ns / 1000000.0f : 1000.0f / 60.0f;
+    resolution->stats_scale += resolution->scale;
+    if (resolution->scale < resolution->stats_lowest_scale) resolution->stats_lowest_scale = resolution->scale;
+    if (++resolution->stats_frames == 256) {
+        print_info("Dynamic resolution: %.0f%% average scale, %.0f%% lowest, %u changes, %.2f ms on the GPU against %.2f ms, now %ux%u",
+                   resolution->stats_scale / 256.0*100.0, (double)resolution->stats_lowest_scale*100.0, resolution->stats_changes,
+                   (double)resolution->gpu_ms, (double)target_ms, vk->render_extent.width, vk->render_extent.height);
+        resolution->stats_scale = 0.0;
+        resolution->stats_lowest_scale = resolution->scale;
+        resolution->stats_changes = 0;
+        resolution->stats_frames = 0;
+    }
+
+    // Frames in flight still render at the old scale when it changes.
+    if (resolution->cooldown) {
+        resolution->cooldown -= 1;
+        return false;
+    }
+    if (resolution->gpu_ms <= target_ms && resolution->gpu_ms >= target_ms*VULKAN_RESOLUTION_HEADROOM) return false;
+    float aim_ms = target_ms*(1.0f + VULKAN_RESOLUTION_HEADROOM)*0.5f;
+    float scale = resolution->scale*sqrtf(aim_ms / resolution->gpu_ms);
+    scale = roundf(scale / VULKAN_RESOLUTION_STEP)*VULKAN_RESOLUTION_STEP;
+    if (scale < resolution->config.min_scale) scale = resolution->config.min_scale;
+    if (scale > resolution->config.max_scale) scale = resolution->config.max_scale;
+    if (fabsf(scale - resolution->scale) < VULKAN_RESOLUTION_STEP*0.5f) return false;
+    resolution->scale = scale;
+    resolution->cooldown = VULKAN_RESOLUTION_COOLDOWN;
+    resolution->stats_changes += 1;
+    return true;
+}
+
+// The last pass, bilinear from the render extent with the sharpening fading
+// in as the scale drops. At native scale it's a plain copy.
+bool vulkan_resolution_record_upscale(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Resolution *resolution = &vk->resolution;
+    Vulkan_Pipeline *upscale = vulkan_pipeline_resolve(&vk->pipelines, resolution->pipeline);
+    if (!upscale) return false;
+    Vulkan_Upscale_Constants constants = {};
+    constants.output_size[0] = (float)vk->extent.width;
+    constants.output_size[1] = (float)vk->extent.height;
+    float upscaled = (1.0f - resolution->scale)*2.0f;
+    if (upscaled < 0.0f) upscaled = 0.0f;
+    if (upscaled > 1.0f) upscaled = 1.0f;
+    constants.sharpness = resolution->config.sharpness*upscaled;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, upscale->handle);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, upscale->layout, 0, 1, &resolution->descriptor_set, 0, 0);
+    vkCmdPushConstants(cmd, upscale->layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(constants), &constants);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
+    return true;
+}
+
+// After the chunk stage, the atlas goes into binding 6 of its sets.
+bool vulkan_backend_create_shadow_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Shadows *shadows = &vk->shadows;
+    VkImageCreateInfo image_info = {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = VULKAN_SHADOW_FORMAT;
+    image_info.extent = (VkExtent3D){ VULKAN_SHADOW_ATLAS_TEXELS, VULKAN_SHADOW_ATLAS_TEXELS, 1 };
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (!vulkan_image_create(vk, &image_info, VK_IMAGE_VIEW_TYPE_2D, VK_IMAGE_ASPECT_DEPTH_BIT, &shadows->atlas)) return false;
+
+    // Same basis as chunk.frag.
+    float light[3] = { 0.4f, 1.0f, 0.3f };
+    float length = sqrtf(light[0]*light[0] + light[1]*light[1] + light[2]*light[2]);
+    for (uint32_t k = 0; k < 3; ++k) shadows->light_basis[2][k] = light[k] / length;
+    float *toward = shadows->light_basis[2];
+    float right_length = sqrtf(toward[2]*toward[2] + toward[0]*toward[0]);
+    float *right = shadows->light_basis[0];
+    right[0] = toward[2] / right_length;
+    right[1] = 0.0f;
+    right[2] = -toward[0] / right_length;
+    float *up = shadows->light_basis[1];
+    up[0] = toward[1]*right[2] - toward[2]*right[1];
+    up[1] = toward[2]*right[0] - toward[0]*right[2];
+    up[2] = toward[0]*right[1] - toward[1]*right[0];
+
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.compareEnable = VK_TRUE;
+    sampler_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    if (vkCreateSampler(vk->device, &sampler_info, 0, &shadows->sampler) != VK_SUCCESS) {
+        print_error("Vulkan failed to create shadow sampler");
+        return false;
+    }
+
+    VkDescriptorImageInfo atlas_info = { shadows->sampler, shadows->atlas.view, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL };
+    VkWriteDescriptorSet writes[VULKAN_TARGET_GENERATIONS];
+    for (uint32_t generation = 0; generation < VULKAN_TARGET_GENERATIONS; ++generation) {
+        writes[generation] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = vk->chunks.descriptor_sets[generation],
+            .dstBinding = 6,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &atlas_info,
+        };
+    }
+    vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0, 0);
+
+    // The atlas rests in the read only layout, and the dependencies order the
+    // tile draws after last frame's lookups and before this frame's.
+    Vulkan_Render_Pass_Info render_pass_info = {0};
+    render_pass_info.source_stage_mask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    render_pass_info.source_access_mask = VK_ACCESS_SHADER_READ_BIT;
+    render_pass_info.dest_stage_mask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    render_pass_info.dest_access_mask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    if (!vulkan_render_pass_add_attachment(&render_pass_info, VULKAN_SHADOW_FORMAT, 1, Vulkan_Attachment_Type_Depth_Stencil,
+                                           VK_ATTACHMENT_LOAD_OP_LOAD, VK_ATTACHMENT_STORE_OP_STORE,
+                                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL)) return false;
+    if (!vulkan_render_pass_create(vk->device, &render_pass_info, &shadows->render_pass)) return false;
+
+    VkFramebufferCreateInfo framebuffer_info = {};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = shadows->render_pass;
+    framebuffer_info.attachmentCount = 1;
+    framebuffer_info.pAttachments = &shadows->atlas.view;
+    framebuffer_info.width = VULKAN_SHADOW_ATLAS_TEXELS;
+    framebuffer_info.height = VULKAN_SHADOW_ATLAS_TEXELS;
+    framebuffer_info.layers = 1;
+    if (vkCreateFramebuffer(vk->device, &framebuffer_info, 0, &shadows->framebuffer) != VK_SUCCESS) {
+        print_error("Vulkan failed to create shadow framebuffer");
+        return false;
+    }
+
+    // The prepass's vertex shader, drawn per chunk with the tile's matrix.
+    #include "shaders/chunk_depth.vert.h"
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, shadows->render_pass);
+    vulkan_pipeline_info_set_depth_only(&pipeline_info);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, vk->chunks.set_layout);
+    vulkan_pipeline_info_set_bindless(&pipeline_info, &vk->bindless);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Chunk_Constants));
+    vulkan_pipeline_info_set_depth_test(&pipeline_info, VK_COMPARE_OP_LESS, true);
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, chunk_depth, vert))) return false;
+    shadows->pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (shadows->pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    print_info("Shadow atlas: %u cascades of %ux%u tiles, %u texels each, %.1f MB",
+               VULKAN_SHADOW_CASCADES, VULKAN_SHADOW_TILES, VULKAN_SHADOW_TILES, VULKAN_SHADOW_TILE_TEXELS,
+               (double)shadows->atlas.allocation.size / (1024.0*1024.0));
+    return true;
+}
+
+// Lane 0 in begin_frame, before any lane pushes the origins. A cascade only
+// moves once the camera leaves its middle tiles, and then by whole tiles, so
+// the tiles that stay in view keep the texels they were drawn with.
+void vulkan_shadow_update(Vulkan_State *vk) {
+    Vulkan_Shadows *shadows = &vk->shadows;
+    float inverse[16];
+    if (!shadows->atlas.handle || !vulkan_mat4_inverse(vk->view_proj, inverse) || inverse[15] == 0.0f) return;
+
+    // The middle of the near plane, close enough to the camera.
+    float camera[3] = { inverse[12] / inverse[15], inverse[13] / inverse[15], inverse[14] / inverse[15] };
+    for (uint32_t cascade = 0; cascade < VULKAN_SHADOW_CASCADES; ++cascade) {
+        float tile_world = vulkan_shadow_tile_world(cascade);
+        for (uint32_t axis = 0; axis < 2; ++axis) {
+            float *basis = shadows->light_basis[axis];
+            int32_t tile = (int32_t)floorf((camera[0]*basis[0] + camera[1]*basis[1] + camera[2]*basis[2]) / tile_world);
+            int32_t *origin = &shadows->origins[cascade][axis];
+            if (!shadows->origins_set || tile < *origin + 1 || tile > *origin + VULKAN_SHADOW_TILES - 2) *origin = tile - 1;
+        }
+    }
+    shadows->origins_set = true;
+}
+
+// Orthographic along the light, x and y span the tile and depth runs from
+// the near end of VULKAN_SHADOW_DEPTH_RANGE to the far one.
+void vulkan_shadow_tile_matrix(Vulkan_Shadows *shadows, float tile_world, int32_t tile[2], float out[16]) {
+    memset(out, 0, 16*sizeof(float));
+    for (uint32_t k = 0; k < 3; ++k) {
+        out[k*4 + 0] = 2.0f*shadows->light_basis[0][k] / tile_world;
+        out[k*4 + 1] = 2.0f*shadows->light_basis[1][k] / tile_world;
+        out[k*4 + 2] = -shadows->light_basis[2][k] / (2.0f*VULKAN_SHADOW_DEPTH_RANGE);
+    }
+    out[12] = -(float)(2*tile[0] + 1);
+    out[13] = -(float)(2*tile[1] + 1);
+    out[14] = 0.5f;
+    out[15] = 1.0f;
+}
+
+// Runs as the shadow graph pass. Draws every tile that is stale or now holds
+// another part of the world, each with the chunks over it.
+void vulkan_shadow_record(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Shadows *shadows = &vk->shadows;
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    if (!shadows->atlas.handle) return;
+
+    // Cleared to the far plane once, so tiles that aren't drawn yet are lit.
+    if (!shadows->atlas_ready) {
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = shadows->atlas.handle;
+        barrier.subresourceRange = (VkImageSubresourceRange){ VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 0, 0, 1, &barrier);
+        VkClearDepthStencilValue clear_value = { 1.0f, 0 };
+        vkCmdClearDepthStencilImage(cmd, shadows->atlas.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear_value, 1, &barrier.subresourceRange);
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        VkPipelineStageFlags dst_stages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stages, 0, 0, 0, 0, 0, 1, &barrier);
+        shadows->atlas_ready = true;
+    }
+
+    uint32_t tiles = 0, draws = 0;
+    Vulkan_Pipeline *pipeline = vulkan_pipeline_resolve(&vk->pipelines, shadows->pipeline);
+    for (uint32_t cascade = 0; pipeline && shadows->origins_set && cascade < VULKAN_SHADOW_CASCADES; ++cascade) {
+        float tile_world = vulkan_shadow_tile_world(cascade);
+        for (uint32_t slot_idx = 0; slot_idx < VULKAN_SHADOW_TILES*VULKAN_SHADOW_TILES; ++slot_idx) {
+            // Tile coordinates wrap onto the slots, the slot's tile is the one in the cascade's window.
+            uint32_t slot_xy[2] = { slot_idx % VULKAN_SHADOW_TILES, slot_idx / VULKAN_SHADOW_TILES };
+            int32_t tile[2];
+            for (uint32_t axis = 0; axis < 2; ++axis) {
+                int32_t origin = shadows->origins[cascade][axis];
+                tile[axis] = origin + (((int32_t)slot_xy[axis] - origin) & (VULKAN_SHADOW_TILES - 1));
+            }
+            Vulkan_Shadow_Slot *slot = &shadows->slots[cascade][slot_idx];
+            if (slot->valid && slot->tile[0] == tile[0] && slot->tile[1] == tile[1]) continue;
+
+            if (tiles == 0) {
+                VkRenderPassBeginInfo begin_info = {};
+                begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                begin_info.renderPass = shadows->render_pass;
+                begin_info.framebuffer = shadows->framebuffer;
+                begin_info.renderArea.extent = (VkExtent2D){ VULKAN_SHADOW_ATLAS_TEXELS, VULKAN_SHADOW_ATLAS_TEXELS };
+                vkCmdBeginRenderPass(cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->handle);
+                VkDescriptorSet sets[] = { chunks->descriptor_set, vk->bindless.descriptor_set };
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout, 0, array_count(sets), sets, 0, 0);
+            }
+
+            VkRect2D rect = {};
+            rect.offset.x = (int32_t)(((cascade & 1)*VULKAN_SHADOW_TILES + slot_xy[0])*VULKAN_SHADOW_TILE_TEXELS);
+            rect.offset.y = (int32_t)(((cascade >> 1)*VULKAN_SHADOW_TILES + slot_xy[1])*VULKAN_SHADOW_TILE_TEXELS);
+            rect.extent = (VkExtent2D){ VULKAN_SHADOW_TILE_TEXELS, VULKAN_SHADOW_TILE_TEXELS };
+            VkViewport viewport = { (float)rect.offset.x, (float)rect.offset.y, (float)VULKAN_SHADOW_TILE_TEXELS, (float)VULKAN_SHADOW_TILE_TEXELS, 0.0f, 1.0f };
+            vkCmdSetViewport(cmd, 0, 1, &viewport);
+            vkCmdSetScissor(cmd, 0, 1, &rect);
+            VkClearAttachment clear = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, { .depthStencil = { 1.0f, 0 } } };
+            VkClearRect clear_rect = { rect, 0, 1 };
+            vkCmdClearAttachments(cmd, 1, &clear, 1, &clear_rect);
+
+            Vulkan_Chunk_Constants constants = {};
+            vulkan_shadow_tile_matrix(shadows, tile_world, tile, constants.view_proj);
+            vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(constants), &constants);
+
+            // firstVertex and firstInstance like the cull pass writes them.
+            for (uint32_t chunk_idx = 0; chunk_idx < chunks->chunk_high_water; ++chunk_idx) {
+                Vulkan_Chunk_Mesh *mesh = &chunks->chunks[chunk_idx];
+                if (!mesh->live) continue;
+                float lo[3], hi[3], box_min[2], box_max[2];
+                for (uint32_t k = 0; k < 3; ++k) {
+                    lo[k] = (float)(mesh->position[k]*VULKAN_CHUNK_SIZE) + (float)((mesh->bounds_min >> (8*k)) & 0xff);
+                    hi[k] = (float)(mesh->position[k]*VULKAN_CHUNK_SIZE) + (float)((mesh->bounds_max >> (8*k)) & 0xff);
+                }
+                vulkan_shadow_box_bounds(shadows, lo, hi, box_min, box_max);
+                bool overlaps = true;
+                for (uint32_t axis = 0; axis < 2; ++axis) {
+                    float tile_min = (float)tile[axis]*tile_world;
+                    overlaps &= box_max[axis] > tile_min && box_min[axis] < tile_min + tile_world;
+                }
+                if (!overlaps) continue;
+                vkCmdDraw(cmd, mesh->quad_count*6, 1, mesh->offset*6, chunk_idx);
+                draws += 1;
+            }
+
+            slot->tile[0] = tile[0];
+            slot->tile[1] = tile[1];
+            slot->valid = true;
+            tiles += 1;
+        }
+    }
+    if (tiles) vkCmdEndRenderPass(cmd);
+
+    shadows->stats_tiles += tiles;
+    shadows->stats_draws += draws;
+    if (++shadows->stats_frames == 256) {
+        print_info("Shadow atlas: %.2f tiles redrawn, %.1f chunk draws per frame",
+                   (double)shadows->stats_tiles / 256.0, (double)shadows->stats_draws / 256.0);
+        shadows->stats_tiles = 0;
+        shadows->stats_draws = 0;
+        shadows->stats_frames = 0;
+    }
+}
+
+// After the chunk and far field stages, the pyramid is bound in the chunk
+// descriptor set and the far field's sets are written with it.
+bool vulkan_backend_create_hiz_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Hiz *hiz = &vk->hiz;
+
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+    if (vkCreateSampler(vk->device, &sampler_info, 0, &hiz->sampler) != VK_SUCCESS) {
+        print_error("Vulkan failed to create Hi-Z sampler");
+        return false;
+    }
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = array_count(bindings);
+    layout_info.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &hiz->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create Hi-Z descriptor set layout");
+        return false;
+    }
+
+    uint32_t set_count = VULKAN_TARGET_GENERATIONS*VULKAN_HIZ_MAX_MIPS;
+    VkDescriptorPoolSize pool_sizes[] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, set_count },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2*set_count },
+    };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = set_count;
+    pool_info.poolSizeCount = array_count(pool_sizes);
+    pool_info.pPoolSizes = pool_sizes;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &hiz->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create Hi-Z descriptor pool");
+        return false;
+    }
+
+    VkDescriptorSetLayout set_layouts[VULKAN_TARGET_GENERATIONS*VULKAN_HIZ_MAX_MIPS];
+    for (uint32_t set_idx = 0; set_idx < set_count; ++set_idx) set_layouts[set_idx] = hiz->set_layout;
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = hiz->descriptor_pool;
+    set_info.descriptorSetCount = set_count;
+    set_info.pSetLayouts = set_layouts;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, &hiz->sets[0][0]) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate Hi-Z descriptor sets");
+        return false;
+    }
+
+    #include "shaders/hiz_reduce.comp.h"
     Vulkan_Pipeline_Info pipeline_info = {0};
-    vulkan_pipeline_info_init(&pipeline_info, vk->device);
-    if (!vulkan_pipeline_create_render_pass(&pipeline_info)) return false;
-    #include "shaders/final.vert.h"
-    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, code_shaders_final_vert_spv, code_shaders_final_vert_spv_len)) return false;
-    #include "shaders/final.frag.h"
-    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, code_shaders_final_frag_spv, code_shaders_final_frag_spv_len)) return false;
-    if (!vulkan_pipeline_create(&vk->final_pipeline, transient_arena, &pipeline_info, vk->extent)) return false;
-    vulkan_pipeline_info_free(&pipeline_info);
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, hiz->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Hiz_Constants));
+    if (!vulkan_pipeline_info_add_compute_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, hiz_reduce, comp))) return false;
+    hiz->pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (hiz->pipeline == VULKAN_PIPELINE_NONE) return false;
 
-#if 0
-    // extended example
-    Vulkan_Pipeline pipeline = {0};
-    vulkan_pipeline_init(&pipeline, device);
-    vulkan_pipeline_add_vertex_shader(&pipeline, vert_spv, vert_len);
-    vulkan_pipeline_add_fragment_shader(&pipeline, frag_spv, frag_len);
-    vulkan_pipeline_push_vertx_binding(&pipeline, 0, sizeof(Vertex));
-    vulkan_pipeline_push_attribute(&pipeline, 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offset_of(Vertex, position));
-    vulkan_pipeline_push_attribute(&pipeline, 0, 1, VK_FORMAT_R32G32B32_SFLOAT, offset_of(Vertex, normal));
-    vulkan_pipeline_push_attribute(&pipeline, 0, 2, VK_FORMAT_R32G32_SFLOAT,    offset_of(Vertex, texcoord));
-    vulkan_pipeline_set_viewport(&pipeline, extent); // set to max extent by default
-    vulkan_pipeline_set_scissor(&pipeline, extent); // set to max extent by default
-    vulkan_pipeline_set_depth_test(&pipeline, VK_COMPARE_OP_LESS); // disabled by default, but if you call this its enabled
-    vulkan_pipeline_cull_face(&pipeline, VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE); // disabled by default, but if you call this its enabled
-    vulkan_pipeline_enable_alpha(&pipeline); // false by default, but if you call this its set to true
-    if (!vulkan_pipeline_create(&pipeline, render_pass)) return false;
-#endif
+    return vulkan_backend_create_render_targets(vk);
+}
+
+// The arrays of the particle state share one buffer, each starting where a
+// storage buffer descriptor may point.
+bool vulkan_backend_create_particle_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Particles *particles = &vk->particles;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk->phys_device, &properties);
+    VkDeviceSize alignment = properties.limits.minStorageBufferOffsetAlignment;
+    // positions, velocities, looks, dead list, both alive lists
+    VkDeviceSize array_sizes[array_count(particles->offsets)] = {
+        VULKAN_MAX_PARTICLES*4*sizeof(float), VULKAN_MAX_PARTICLES*4*sizeof(float), VULKAN_MAX_PARTICLES*2*sizeof(uint32_t),
+        VULKAN_MAX_PARTICLES*sizeof(uint32_t), 2*VULKAN_MAX_PARTICLES*sizeof(uint32_t),
+    };
+    VkDeviceSize state_size = 0;
+    for (uint32_t array_idx = 0; array_idx < array_count(array_sizes); ++array_idx) {
+        particles->offsets[array_idx] = state_size;
+        state_size = (state_size + array_sizes[array_idx] + alignment - 1) & ~(alignment - 1);
+    }
+    if (!vulkan_buffer_create_shared(vk, state_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particles->state)) return false;
+    if (!vulkan_buffer_create_shared(vk, sizeof(Vulkan_Particle_Counters), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particles->counters)) return false;
+    VkMemoryPropertyFlags host_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!vulkan_buffer_create(vk, VULKAN_FRAMES_IN_FLIGHT*VULKAN_MAX_PARTICLE_EMITTERS*sizeof(Vulkan_Particle_Emitter), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              host_flags, &particles->emitter_buffer)) return false;
+    if (!vulkan_buffer_create(vk, VULKAN_FRAMES_IN_FLIGHT*sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, host_flags, &particles->stats_readback)) return false;
+
+    VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+    VkDescriptorSetLayoutBinding bindings[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 3, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 4, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = stages },
+        { .binding = 5, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 6, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 7, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = array_count(bindings);
+    layout_info.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &particles->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create particle descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorPoolSize pool_size = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, array_count(bindings) };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &particles->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create particle descriptor pool");
+        return false;
+    }
+
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = particles->descriptor_pool;
+    set_info.descriptorSetCount = 1;
+    set_info.pSetLayouts = &particles->set_layout;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, &particles->descriptor_set) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate particle descriptor set");
+        return false;
+    }
+
+    VkDescriptorBufferInfo buffer_infos[array_count(bindings)];
+    for (uint32_t array_idx = 0; array_idx < array_count(array_sizes); ++array_idx) {
+        buffer_infos[array_idx] = (VkDescriptorBufferInfo){ particles->state.handle, particles->offsets[array_idx], array_sizes[array_idx] };
+    }
+    buffer_infos[5] = (VkDescriptorBufferInfo){ particles->counters.handle, 0, VK_WHOLE_SIZE };
+    buffer_infos[6] = (VkDescriptorBufferInfo){ particles->emitter_buffer.handle, 0, VK_WHOLE_SIZE };
+    buffer_infos[7] = (VkDescriptorBufferInfo){ particles->stats_readback.handle, 0, VK_WHOLE_SIZE };
+    VkWriteDescriptorSet writes[array_count(bindings)];
+    for (uint32_t write_idx = 0; write_idx < array_count(writes); ++write_idx) {
+        writes[write_idx] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = particles->descriptor_set,
+            .dstBinding = write_idx,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &buffer_infos[write_idx],
+        };
+    }
+    vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0, 0);
+    vulkan_graph_import_buffer(&vk->graph, vk->particle_state_target, particles->state.handle);
+    vulkan_graph_import_buffer(&vk->graph, vk->particle_counters_target, particles->counters.handle);
+
+    #include "shaders/particles.comp.h"
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, particles->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Particle_Constants));
+    if (!vulkan_pipeline_info_add_compute_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, particles, comp))) return false;
+    particles->compute_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    if (particles->compute_pipeline == VULKAN_PIPELINE_NONE) return false;
+
+    // Blended over the opaque pass, tested against its depth but never writing it.
+    #include "shaders/particle.vert.h"
+    #include "shaders/particle.frag.h"
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_render_pass(&pipeline_info, vulkan_graph_render_pass(vk, vk->particle_pass));
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, particles->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Particle_Draw_Constants));
+    vulkan_pipeline_info_set_depth_test(&pipeline_info, VK_COMPARE_OP_LESS, false);
+    pipeline_info.flags |= VULKAN_PIPELINE_BLEND_ALPHA;
+    if (!vulkan_pipeline_info_add_vertex_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, particle, vert))) return false;
+    if (!vulkan_pipeline_info_add_fragment_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, particle, frag))) return false;
+    particles->draw_pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    return particles->draw_pipeline != VULKAN_PIPELINE_NONE;
+}
+
+// Emitters keep spawning until they are removed. Returns false for an index
+// past VULKAN_MAX_PARTICLE_EMITTERS.
+bool vulkan_particle_emitter_set(Vulkan_State *vk, uint32_t emitter_index, Vulkan_Particle_Emitter *emitter) {
+    Vulkan_Particles *particles = &vk->particles;
+    if (emitter_index >= VULKAN_MAX_PARTICLE_EMITTERS) {
+        print_error("Particle emitter %u is out of range", emitter_index);
+        return false;
+    }
+    if (!particles->emitter_live[emitter_index]) particles->spawn_carry[emitter_index] = 0.0f;
+    particles->emitters[emitter_index] = *emitter;
+    particles->emitter_live[emitter_index] = true;
+    if (emitter_index >= particles->emitter_high_water) particles->emitter_high_water = emitter_index + 1;
+    return true;
+}
+
+// Particles already spawned live out their lifetime.
+void vulkan_particle_emitter_remove(Vulkan_State *vk, uint32_t emitter_index) {
+    Vulkan_Particles *particles = &vk->particles;
+    if (emitter_index >= VULKAN_MAX_PARTICLE_EMITTERS) return;
+    particles->emitter_live[emitter_index] = false;
+    while (particles->emitter_high_water && !particles->emitter_live[particles->emitter_high_water - 1]) particles->emitter_high_water -= 1;
+}
+
+// Between the particle stages, the prepare stage also writes the simulate
+// dispatch arguments.
+void vulkan_particles_barrier(VkCommandBuffer cmd, bool indirect) {
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    VkPipelineStageFlags dst_stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    if (indirect) {
+        barrier.dstAccessMask |= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        dst_stages |= VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+    }
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dst_stages, 0, 1, &barrier, 0, 0, 0, 0);
+}
+
+// Runs as the async particle simulate pass. The spawn counts are the only
+// thing worked out on the CPU, per emitter and from its rate, everything per
+// particle happens in particles.comp.
+void vulkan_particles_record_simulate(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Particles *particles = &vk->particles;
+    Vulkan_Pipeline *pipeline = vulkan_pipeline_resolve(&vk->pipelines, particles->compute_pipeline);
+    if (!pipeline || !particles->state.handle) return;
+
+    // Clamped so a hitch doesn't turn into one big burst.
+    uint64_t now_ns = get_time_ns();
+    float delta_time = particles->last_update_ns ? (float)(now_ns - particles->last_update_ns) / 1e9f : 0.0f;
+    if (delta_time > 0.1f) delta_time = 0.1f;
+    particles->last_update_ns = now_ns;
+
+    Vulkan_Particle_Emitter *slot_emitters = (Vulkan_Particle_Emitter *)particles->emitter_buffer.allocation.mapped + vk->frame_index*VULKAN_MAX_PARTICLE_EMITTERS;
+    uint32_t emitter_count = 0;
+    uint32_t spawn_count = 0;
+    for (uint32_t emitter_idx = 0; emitter_idx < particles->emitter_high_water; ++emitter_idx) {
+        if (!particles->emitter_live[emitter_idx]) continue;
+        Vulkan_Particle_Emitter *emitter = &particles->emitters[emitter_idx];
+        float spawns = emitter->rate*delta_time + particles->spawn_carry[emitter_idx];
+        uint32_t count = (uint32_t)spawns;
+        particles->spawn_carry[emitter_idx] = spawns - (float)count;
+        if (count > VULKAN_MAX_PARTICLES - spawn_count) count = VULKAN_MAX_PARTICLES - spawn_count;
+        if (!count) continue;
+        slot_emitters[emitter_count] = *emitter;
+        slot_emitters[emitter_count].first_spawn = spawn_count;
+        emitter_count += 1;
+        spawn_count += count;
+    }
+    if (!particles->initialized && !spawn_count) return;
+
+    Vulkan_Particle_Constants constants = {};
+    constants.current = particles->current;
+    constants.emitter_offset = vk->frame_index*VULKAN_MAX_PARTICLE_EMITTERS;
+    constants.emitter_count = emitter_count;
+    constants.spawn_count = spawn_count;
+    constants.frame_slot = vk->frame_index;
+    constants.seed = (uint32_t)vk->frame_number;
+    constants.delta_time = delta_time;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->handle);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->layout, 0, 1, &particles->descriptor_set, 0, 0);
+
+    if (!particles->initialized) {
+        constants.stage = VULKAN_PARTICLE_STAGE_INIT;
+        vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        vkCmdDispatch(cmd, VULKAN_MAX_PARTICLES / 64, 1, 1);
+        vulkan_particles_barrier(cmd, false);
+        particles->initialized = true;
+    }
+    if (spawn_count) {
+        constants.stage = VULKAN_PARTICLE_STAGE_EMIT;
+        vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        vkCmdDispatch(cmd, (spawn_count + 63) / 64, 1, 1);
+        vulkan_particles_barrier(cmd, false);
+    }
+    constants.stage = VULKAN_PARTICLE_STAGE_PREPARE;
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, 1, 1, 1);
+    vulkan_particles_barrier(cmd, true);
+
+    constants.stage = VULKAN_PARTICLE_STAGE_SIMULATE;
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatchIndirect(cmd, particles->counters.handle, offsetof(Vulkan_Particle_Counters, simulate));
+    vulkan_particles_barrier(cmd, false);
+
+    constants.stage = VULKAN_PARTICLE_STAGE_FINISH;
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, 1, 1, 1);
+
+    // The survivors are in the other list now, which is what gets drawn.
+    particles->current ^= 1;
+    particles->stats_pending[vk->frame_index] = true;
+    particles->stats_spawned_total += spawn_count;
+}
+
+// One instanced quad per live particle, the count comes from the finish stage.
+// Returns false if nothing was recorded.
+bool vulkan_particles_record_draw(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Particles *particles = &vk->particles;
+    Vulkan_Pipeline *pipeline = vulkan_pipeline_resolve(&vk->pipelines, particles->draw_pipeline);
+    if (!pipeline || !particles->initialized) return false;
+
+    Vulkan_Particle_Draw_Constants constants = {};
+    memcpy(constants.view_proj, vk->view_proj, sizeof(constants.view_proj));
+    constants.alive_offset = particles->current*VULKAN_MAX_PARTICLES;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->handle);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout, 0, 1, &particles->descriptor_set, 0, 0);
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(constants), &constants);
+    vkCmdDrawIndirect(cmd, particles->counters.handle, offsetof(Vulkan_Particle_Counters, draw), 1, sizeof(VkDrawIndirectCommand));
+    return true;
+}
+
+// The alive count the finish stage left for this slot, with the GPU time of
+// both particle passes from the same frame. Logged every 256 frames as an
+// average.
+void vulkan_particles_read_stats(Vulkan_State *vk) {
+    Vulkan_Particles *particles = &vk->particles;
+    if (!particles->stats_pending[vk->frame_index]) return;
+    particles->stats_pending[vk->frame_index] = false;
+    particles->stats_alive_total += ((uint32_t *)particles->stats_readback.allocation.mapped)[vk->frame_index];
+    particles->stats_simulate_ns += vk->profiler.zone_ns[vk->particle_simulate_pass];
+    particles->stats_draw_ns += vk->profiler.zone_ns[vk->particle_pass];
+    if (++particles->stats_frames == 256) {
+        print_info("Particles: %.0f alive, %.1f spawned per frame, simulate %.3f ms, draw %.3f ms",
+                   (double)particles->stats_alive_total / 256.0,
+                   (double)particles->stats_spawned_total / 256.0,
+                   (double)particles->stats_simulate_ns / (256.0*1000000.0),
+                   (double)particles->stats_draw_ns / (256.0*1000000.0));
+        particles->stats_alive_total = 0;
+        particles->stats_spawned_total = 0;
+        particles->stats_simulate_ns = 0;
+        particles->stats_draw_ns = 0;
+        particles->stats_frames = 0;
+    }
+}
+
+// After the chunk stage, the lights and their clusters go into bindings 7
+// and 8 of its sets.
+bool vulkan_backend_create_light_stage(Vulkan_State *vk, Fixed_Arena *transient_arena) {
+    Vulkan_Lights *lights = &vk->lights;
+    VkDeviceSize cluster_bytes = sizeof(Vulkan_Light_Clusters) + VULKAN_LIGHT_INDEX_CAPACITY*sizeof(uint32_t);
+    if (!vulkan_buffer_create_shared(vk, VULKAN_MAX_LIGHTS*sizeof(Vulkan_Light), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &lights->light_buffer)) return false;
+    if (!vulkan_buffer_create_shared(vk, cluster_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &lights->clusters)) return false;
+    if (!vulkan_buffer_create(vk, VULKAN_MAX_LIGHTS*2*sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &lights->ranges)) return false;
+    VkMemoryPropertyFlags host_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!vulkan_buffer_create(vk, VULKAN_FRAMES_IN_FLIGHT*VULKAN_MAX_LIGHTS*sizeof(Vulkan_Light), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              host_flags, &lights->light_uploads)) return false;
+    if (!vulkan_buffer_create(vk, VULKAN_FRAMES_IN_FLIGHT*2*sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, host_flags, &lights->stats_readback)) return false;
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 3, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 4, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = array_count(bindings);
+    layout_info.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(vk->device, &layout_info, 0, &lights->set_layout) != VK_SUCCESS) {
+        print_error("Vulkan failed to create light descriptor set layout");
+        return false;
+    }
+
+    VkDescriptorPoolSize pool_size = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, array_count(bindings) };
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    if (vkCreateDescriptorPool(vk->device, &pool_info, 0, &lights->descriptor_pool) != VK_SUCCESS) {
+        print_error("Vulkan failed to create light descriptor pool");
+        return false;
+    }
+
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = lights->descriptor_pool;
+    set_info.descriptorSetCount = 1;
+    set_info.pSetLayouts = &lights->set_layout;
+    if (vkAllocateDescriptorSets(vk->device, &set_info, &lights->descriptor_set) != VK_SUCCESS) {
+        print_error("Vulkan failed to allocate light descriptor set");
+        return false;
+    }
+
+    VkDescriptorBufferInfo buffer_infos[array_count(bindings)] = {
+        { lights->light_uploads.handle, 0, VK_WHOLE_SIZE },
+        { lights->light_buffer.handle, 0, VK_WHOLE_SIZE },
+        { lights->ranges.handle, 0, VK_WHOLE_SIZE },
+        { lights->clusters.handle, 0, VK_WHOLE_SIZE },
+        { lights->stats_readback.handle, 0, VK_WHOLE_SIZE },
+    };
+    VkWriteDescriptorSet writes[array_count(bindings) + 2*VULKAN_TARGET_GENERATIONS];
+    for (uint32_t write_idx = 0; write_idx < array_count(bindings); ++write_idx) {
+        writes[write_idx] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = lights->descriptor_set,
+            .dstBinding = write_idx,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &buffer_infos[write_idx],
+        };
+    }
+    for (uint32_t generation = 0; generation < VULKAN_TARGET_GENERATIONS; ++generation) {
+        for (uint32_t buffer_idx = 0; buffer_idx < 2; ++buffer_idx) {
+            writes[array_count(bindings) + 2*generation + buffer_idx] = (VkWriteDescriptorSet){
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = vk->chunks.descriptor_sets[generation],
+                .dstBinding = 7 + buffer_idx,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &buffer_infos[buffer_idx ? 3 : 1],
+            };
+        }
+    }
+    vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0, 0);
+    vulkan_graph_import_buffer(&vk->graph, vk->lights_target, lights->light_buffer.handle);
+    vulkan_graph_import_buffer(&vk->graph, vk->light_clusters_target, lights->clusters.handle);
+
+    #include "shaders/light_cull.comp.h"
+    Vulkan_Pipeline_Info pipeline_info = {0};
+    vulkan_pipeline_info_init(&pipeline_info, vk->device, vk->pipeline_cache);
+    vulkan_pipeline_info_set_descriptor_layout(&pipeline_info, lights->set_layout);
+    vulkan_pipeline_info_set_push_constants(&pipeline_info, sizeof(Vulkan_Light_Cull_Constants));
+    if (!vulkan_pipeline_info_add_compute_shader(&pipeline_info, &vk->shaders, vulkan_embedded_shader(vk, light_cull, comp))) return false;
+    lights->pipeline = vulkan_pipeline_batch_add(vk, &pipeline_info, VULKAN_PIPELINE_NONE);
+    return lights->pipeline != VULKAN_PIPELINE_NONE;
+}
+
+// Lights shine until they are removed. Returns false for an index past
+// VULKAN_MAX_LIGHTS.
+bool vulkan_light_set(Vulkan_State *vk, uint32_t light_index, Vulkan_Light *light) {
+    Vulkan_Lights *lights = &vk->lights;
+    if (light_index >= VULKAN_MAX_LIGHTS) {
+        print_error("Light %u is out of range", light_index);
+        return false;
+    }
+    lights->lights[light_index] = *light;
+    lights->light_live[light_index] = true;
+    if (light_index >= lights->light_high_water) lights->light_high_water = light_index + 1;
+    return true;
+}
+
+void vulkan_light_remove(Vulkan_State *vk, uint32_t light_index) {
+    Vulkan_Lights *lights = &vk->lights;
+    if (light_index >= VULKAN_MAX_LIGHTS) return;
+    lights->light_live[light_index] = false;
+    while (lights->light_high_water && !lights->light_live[lights->light_high_water - 1]) lights->light_high_water -= 1;
+}
+
+void vulkan_lights_barrier(VkCommandBuffer cmd) {
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, 0, 0, 0);
+}
+
+// Runs as the async light cull pass, every frame so the clusters are never
+// stale. The CPU packs the live lights into this slot's uploads, the gather
+// stage copies them to device local memory and works out the clusters each
+// can reach, the assign stage lists them per cluster and the finish stage
+// leaves the totals for the stats.
+void vulkan_lights_record_cull(Vulkan_State *vk, VkCommandBuffer cmd) {
+    Vulkan_Lights *lights = &vk->lights;
+    Vulkan_Pipeline *pipeline = vulkan_pipeline_resolve(&vk->pipelines, lights->pipeline);
+    if (!pipeline || !lights->clusters.handle) return;
+
+    Vulkan_Light *slot_lights = (Vulkan_Light *)lights->light_uploads.allocation.mapped + vk->frame_index*VULKAN_MAX_LIGHTS;
+    uint32_t light_count = 0;
+    for (uint32_t light_idx = 0; light_idx < lights->light_high_water; ++light_idx) {
+        if (lights->light_live[light_idx]) slot_lights[light_count++] = lights->lights[light_idx];
+    }
+    lights->light_count = light_count;
 
+    Vulkan_Light_Cull_Constants constants = {};
+    memcpy(constants.view_proj, vk->view_proj, sizeof(constants.view_proj));
+    constants.light_offset = vk->frame_index*VULKAN_MAX_LIGHTS;
+    constants.light_count = light_count;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->handle);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->layout, 0, 1, &lights->descriptor_set, 0, 0);
+
+    // The first thread also resets the counters, so it runs without lights too.
+    constants.stage = VULKAN_LIGHT_STAGE_GATHER;
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, kabarr_max((light_count + 255) / 256, 1u), 1, 1);
+    vulkan_lights_barrier(cmd);
+    constants.stage = VULKAN_LIGHT_STAGE_ASSIGN;
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, VULKAN_LIGHT_CLUSTERS_X, VULKAN_LIGHT_CLUSTERS_Y, 1);
+    vulkan_lights_barrier(cmd);
+    constants.stage = VULKAN_LIGHT_STAGE_FINISH;
+    constants.light_offset = vk->frame_index;
+    vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, 1, 1, 1);
+    lights->stats_pending[vk->frame_index] = true;
+    lights->stats_light_count[vk->frame_index] = light_count;
+}
+
+// What the finish stage left for this slot, with the GPU time of the culling
+// and of the opaque pass that shades with it. Logged every 256 frames as an
+// average.
+void vulkan_lights_read_stats(Vulkan_State *vk) {
+    Vulkan_Lights *lights = &vk->lights;
+    if (!lights->stats_pending[vk->frame_index]) return;
+    lights->stats_pending[vk->frame_index] = false;
+    uint32_t *readback = (uint32_t *)lights->stats_readback.allocation.mapped + 2*vk->frame_index;
+    lights->stats_lights += lights->stats_light_count[vk->frame_index];
+    lights->stats_indices += readback[0];
+    lights->stats_dropped += readback[1];
+    lights->stats_cull_ns += vk->profiler.zone_ns[vk->light_cull_pass];
+    lights->stats_opaque_ns += vk->profiler.zone_ns[vk->opaque_pass];
+    if (++lights->stats_frames == 256) {
+        if (lights->stats_lights) {
+            print_info("Lights: %.0f live, %.2f per cluster, %.1f dropped, %.3f ms culling, %.3f ms opaque pass",
+                       (double)lights->stats_lights / 256.0,
+                       (double)lights->stats_indices / (256.0*VULKAN_LIGHT_CLUSTER_COUNT),
+                       (double)lights->stats_dropped / 256.0,
+                       (double)lights->stats_cull_ns / (256.0*1000000.0),
+                       (double)lights->stats_opaque_ns / (256.0*1000000.0));
+        }
+        lights->stats_lights = 0;
+        lights->stats_indices = 0;
+        lights->stats_dropped = 0;
+        lights->stats_cull_ns = 0;
+        lights->stats_opaque_ns = 0;
+        lights->stats_frames = 0;
+    }
+}
+
+void vulkan_graph_record_shadows(void *user, VkCommandBuffer cmd) {
+    vulkan_shadow_record((Vulkan_State *)user, cmd);
+}
+
+void vulkan_graph_record_cull_early(void *user, VkCommandBuffer cmd) {
+    vulkan_chunk_buffer_record_cull((Vulkan_State *)user, cmd, VULKAN_CHUNK_CULL_EARLY, false);
+}
+
+void vulkan_graph_record_depth_prepass(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vulkan_chunk_buffer_record_draws(vk, cmd, vk->chunks.depth_pipeline, VULKAN_CHUNK_CULL_EARLY);
+}
+
+void vulkan_graph_record_hiz(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vk->hiz.built = vulkan_hiz_record_build(vk, cmd);
+}
+
+// Whatever the early draws hid is culled before it reaches the resume pass.
+void vulkan_graph_record_cull_late(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vulkan_chunk_buffer_record_cull(vk, cmd, VULKAN_CHUNK_CULL_LATE, vk->hiz.built);
+}
+
+void vulkan_graph_record_depth_resume(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vulkan_chunk_buffer_record_draws(vk, cmd, vk->chunks.depth_pipeline, VULKAN_CHUNK_CULL_LATE);
+}
+
+// The lanes recorded the contents in vulkan_backend_record_lane.
+void vulkan_graph_record_opaque(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    VkCommandBuffer secondaries[VULKAN_MAX_LANES];
+    for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+        secondaries[lane_idx] = vk->lanes[lane_idx].command_buffers[vk->frame_index];
+    }
+    vkCmdExecuteCommands(cmd, vk->lane_count, secondaries);
+}
+
+void vulkan_graph_record_far_raymarch(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vk->far_field.raymarched = vulkan_far_field_record_raymarch(vk, cmd);
+}
+
+// Fills in the far field behind the meshes, before anything transparent.
+void vulkan_graph_record_far_composite(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vulkan_far_field_record_composite(vk, cmd);
+}
+
+void vulkan_graph_record_particle_simulate(void *user, VkCommandBuffer cmd) {
+    vulkan_particles_record_simulate((Vulkan_State *)user, cmd);
+}
+
+void vulkan_graph_record_light_cull(void *user, VkCommandBuffer cmd) {
+    vulkan_lights_record_cull((Vulkan_State *)user, cmd);
+}
+
+void vulkan_graph_record_particles(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vulkan_particles_record_draw(vk, cmd);
+}
+
+void vulkan_graph_record_upscale(void *user, VkCommandBuffer cmd) {
+    Vulkan_State *vk = (Vulkan_State *)user;
+    vulkan_resolution_record_upscale(vk, cmd);
+}
+
+// Declares every pass of the frame with what it touches, in the order they
+// run, and compiles the graph. Before any stage that builds pipelines against
+// the graph's render passes.
+bool vulkan_backend_create_render_graph(Vulkan_State *vk) {
+    Vulkan_Graph *graph = &vk->graph;
+    vk->swapchain_target = vulkan_graph_add_resource(graph, "swapchain", Vulkan_Graph_Resource_Swapchain);
+    vk->depth_target = vulkan_graph_add_image(graph, "depth", VULKAN_DEPTH_FORMAT, 0, 1);
+    vk->hiz_target = vulkan_graph_add_image(graph, "hiz", VK_FORMAT_R32_SFLOAT, 1, VULKAN_HIZ_MAX_MIPS);
+    vk->chunk_draws_target = vulkan_graph_add_resource(graph, "chunk draws", Vulkan_Graph_Resource_Buffer);
+    vk->chunk_draw_count_target = vulkan_graph_add_resource(graph, "chunk draw count", Vulkan_Graph_Resource_Buffer);
+    vk->chunk_visibility_target = vulkan_graph_add_resource(graph, "chunk visibility", Vulkan_Graph_Resource_Buffer);
+    vk->far_color_target = vulkan_graph_add_image(graph, "far color", VK_FORMAT_R8G8B8A8_UNORM, 0, 1);
+    vk->far_depth_target = vulkan_graph_add_image(graph, "far depth", VK_FORMAT_R32_SFLOAT, 0, 1);
+    vk->scene_color_target = vulkan_graph_add_image(graph, "scene color", VK_FORMAT_R8G8B8A8_SRGB, 0, 1);
+    vk->particle_state_target = vulkan_graph_add_resource(graph, "particle state", Vulkan_Graph_Resource_Buffer);
+    vk->particle_counters_target = vulkan_graph_add_resource(graph, "particle counters", Vulkan_Graph_Resource_Buffer);
+    vk->lights_target = vulkan_graph_add_resource(graph, "lights", Vulkan_Graph_Resource_Buffer);
+    vk->light_clusters_target = vulkan_graph_add_resource(graph, "light clusters", Vulkan_Graph_Resource_Buffer);
+
+    VkClearValue black = { .color = { .float32 = { 0.0f, 0.0f, 0.0f, 1.0f } } };
+    VkClearValue far_plane = { .depthStencil = { 1.0f, 0 } };
+    uint32_t pass;
+    // On the compute queue, next to the culling and depth passes below.
+    vk->particle_simulate_pass = pass = vulkan_graph_add_async_pass(graph, "particle simulate", vulkan_graph_record_particle_simulate, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->particle_state_target, VULKAN_GRAPH_STORAGE_WRITE);
+    vulkan_graph_use(graph, pass, vk->particle_counters_target, VULKAN_GRAPH_STORAGE_WRITE);
+
+    // Only the opaque pass reads the clusters, so this has until then.
+    vk->light_cull_pass = pass = vulkan_graph_add_async_pass(graph, "light cull", vulkan_graph_record_light_cull, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->lights_target, VULKAN_GRAPH_STORAGE_WRITE);
+    vulkan_graph_use(graph, pass, vk->light_clusters_target, VULKAN_GRAPH_STORAGE_WRITE);
+
+    // Begins its own render pass on the atlas, which stays out of the graph
+    // because its tiles have to outlive the frame.
+    vk->shadow_pass = pass = vulkan_graph_add_pass(graph, "shadows", false, vulkan_graph_record_shadows, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+
+    vk->cull_early_pass = pass = vulkan_graph_add_pass(graph, "cull early", false, vulkan_graph_record_cull_early, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->chunk_draw_count_target, VULKAN_GRAPH_TRANSFER_WRITE | VULKAN_GRAPH_STORAGE_WRITE);
+    vulkan_graph_use(graph, pass, vk->chunk_draws_target, VULKAN_GRAPH_STORAGE_WRITE);
+    vulkan_graph_use(graph, pass, vk->chunk_visibility_target, VULKAN_GRAPH_STORAGE_READ);
+
+    // A handful of indirect draws, recorded inline.
+    vk->depth_prepass = pass = vulkan_graph_add_pass(graph, "depth prepass", true, vulkan_graph_record_depth_prepass, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use_clear(graph, pass, vk->depth_target, VULKAN_GRAPH_DEPTH_ATTACHMENT, far_plane);
+    vulkan_graph_use(graph, pass, vk->chunk_draws_target, VULKAN_GRAPH_INDIRECT);
+    vulkan_graph_use(graph, pass, vk->chunk_draw_count_target, VULKAN_GRAPH_INDIRECT);
+
+    vk->hiz_pass = pass = vulkan_graph_add_pass(graph, "hiz", false, vulkan_graph_record_hiz, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->depth_target, VULKAN_GRAPH_SAMPLED);
+    vulkan_graph_use(graph, pass, vk->hiz_target, VULKAN_GRAPH_STORAGE_WRITE);
+
+    vk->cull_late_pass = pass = vulkan_graph_add_pass(graph, "cull late", false, vulkan_graph_record_cull_late, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->hiz_target, VULKAN_GRAPH_SAMPLED);
+    vulkan_graph_use(graph, pass, vk->chunk_draws_target, VULKAN_GRAPH_STORAGE_WRITE);
+    vulkan_graph_use(graph, pass, vk->chunk_draw_count_target, VULKAN_GRAPH_STORAGE_WRITE | VULKAN_GRAPH_TRANSFER_READ);
+    vulkan_graph_use(graph, pass, vk->chunk_visibility_target, VULKAN_GRAPH_STORAGE_READ | VULKAN_GRAPH_STORAGE_WRITE);
+
+    vk->depth_resume_pass = pass = vulkan_graph_add_pass(graph, "depth resume", true, vulkan_graph_record_depth_resume, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->depth_target, VULKAN_GRAPH_DEPTH_ATTACHMENT);
+    vulkan_graph_use(graph, pass, vk->chunk_draws_target, VULKAN_GRAPH_INDIRECT);
+    vulkan_graph_use(graph, pass, vk->chunk_draw_count_target, VULKAN_GRAPH_INDIRECT);
+
+    // Only pixels no mesh covered are marched.
+    vk->far_raymarch_pass = pass = vulkan_graph_add_pass(graph, "far raymarch", false, vulkan_graph_record_far_raymarch, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->depth_target, VULKAN_GRAPH_SAMPLED);
+    vulkan_graph_use(graph, pass, vk->far_color_target, VULKAN_GRAPH_STORAGE_WRITE);
+    vulkan_graph_use(graph, pass, vk->far_depth_target, VULKAN_GRAPH_STORAGE_WRITE);
+
+    vk->opaque_pass = pass = vulkan_graph_add_pass(graph, "opaque", true, vulkan_graph_record_opaque, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    graph->passes[pass].secondary = true;
+    vulkan_graph_use_clear(graph, pass, vk->scene_color_target, VULKAN_GRAPH_COLOR_ATTACHMENT, black);
+    vulkan_graph_use(graph, pass, vk->depth_target, VULKAN_GRAPH_DEPTH_READ_ONLY);
+    vulkan_graph_use(graph, pass, vk->chunk_draws_target, VULKAN_GRAPH_INDIRECT);
+    vulkan_graph_use(graph, pass, vk->chunk_draw_count_target, VULKAN_GRAPH_INDIRECT);
+    vulkan_graph_use(graph, pass, vk->lights_target, VULKAN_GRAPH_FRAGMENT_READ);
+    vulkan_graph_use(graph, pass, vk->light_clusters_target, VULKAN_GRAPH_FRAGMENT_READ);
+
+    vk->far_composite_pass = pass = vulkan_graph_add_pass(graph, "far composite", true, vulkan_graph_record_far_composite, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->scene_color_target, VULKAN_GRAPH_COLOR_ATTACHMENT);
+    vulkan_graph_use(graph, pass, vk->depth_target, VULKAN_GRAPH_DEPTH_ATTACHMENT);
+    vulkan_graph_use(graph, pass, vk->far_color_target, VULKAN_GRAPH_FRAGMENT_SAMPLED);
+    vulkan_graph_use(graph, pass, vk->far_depth_target, VULKAN_GRAPH_FRAGMENT_SAMPLED);
+
+    vk->particle_pass = pass = vulkan_graph_add_pass(graph, "particles", true, vulkan_graph_record_particles, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->scene_color_target, VULKAN_GRAPH_COLOR_ATTACHMENT);
+    vulkan_graph_use(graph, pass, vk->depth_target, VULKAN_GRAPH_DEPTH_READ_ONLY);
+    vulkan_graph_use(graph, pass, vk->particle_state_target, VULKAN_GRAPH_VERTEX_READ);
+    vulkan_graph_use(graph, pass, vk->particle_counters_target, VULKAN_GRAPH_INDIRECT);
+
+    // Everything above renders at the render extent, this stretches it onto the swapchain.
+    vk->upscale_pass = pass = vulkan_graph_add_pass(graph, "upscale", true, vulkan_graph_record_upscale, vk);
+    if (pass == VULKAN_GRAPH_NONE) return false;
+    vulkan_graph_use(graph, pass, vk->swapchain_target, VULKAN_GRAPH_COLOR_ATTACHMENT);
+    vulkan_graph_use(graph, pass, vk->scene_color_target, VULKAN_GRAPH_FRAGMENT_SAMPLED);
+
+    return vulkan_graph_compile(vk);
+}
+
+void vulkan_pacing_update_stats(Vulkan_Pacing *pacing, uint64_t frame_ns) {
+    pacing->stats_frame_ns += frame_ns;
+    pacing->stats_frame_ms_squared += ((double)frame_ns / 1000000.0)*((double)frame_ns / 1000000.0);
+    if (frame_ns > pacing->stats_worst_frame_ns) pacing->stats_worst_frame_ns = frame_ns;
+    if (++pacing->stats_frames < 256) return;
+
+    double average_ms = (double)pacing->stats_frame_ns / 256.0 / 1000000.0;
+    double variance = pacing->stats_frame_ms_squared / 256.0 - average_ms*average_ms;
+    double deviation_ms = variance > 0.0 ? sqrt(variance) : 0.0;
+    if (pacing->stats_latency_frames) {
+        print_info("Frame pacing: %.2f ms average, %.2f ms deviation, %.2f ms worst, %.2f ms input to photon",
+                   average_ms, deviation_ms, (double)pacing->stats_worst_frame_ns / 1000000.0,
+                   (double)pacing->stats_latency_ns / pacing->stats_latency_frames / 1000000.0);
+    } else {
+        print_info("Frame pacing: %.2f ms average, %.2f ms deviation, %.2f ms worst",
+                   average_ms, deviation_ms, (double)pacing->stats_worst_frame_ns / 1000000.0);
+    }
+    pacing->stats_frame_ns = 0;
+    pacing->stats_frame_ms_squared = 0.0;
+    pacing->stats_worst_frame_ns = 0;
+    pacing->stats_latency_ns = 0;
+    pacing->stats_latency_frames = 0;
+    pacing->stats_frames = 0;
+}
+
+// Lane 0, before the platform samples input. With present wait this blocks
+// until the last frame is on screen, which also measures its input to photon
+// latency, then sleeps for the part of the refresh the CPU hasn't needed.
+void vulkan_backend_pace_frame(Vulkan_State *vk) {
+    Vulkan_Pacing *pacing = &vk->pacing;
+    if (pacing->present_wait && pacing->present_id) {
+        VkResult waited = vkWaitForPresentKHR(vk->device, vk->swapchain, pacing->present_id, 100000000ull);
+        uint64_t now = get_time_ns();
+        if (waited == VK_SUCCESS) {
+            // A missed vblank shows up as two refreshes, the average follows the shorter ones.
+            uint64_t interval = now - pacing->vblank_ns;
+            if (pacing->vblank_ns && interval < 100000000ull) {
+                if (!pacing->refresh_ns || interval < pacing->refresh_ns) pacing->refresh_ns = interval;
+                else pacing->refresh_ns = (pacing->refresh_ns*15 + interval) / 16;
+            }
+            pacing->vblank_ns = now;
+            pacing->stats_latency_ns += now - pacing->frame_begin_ns;
+            pacing->stats_latency_frames += 1;
+
+            uint64_t busy_ns = pacing->cpu_frame_ns + vk->present_config.latency_slack_ns;
+            if (pacing->refresh_ns > busy_ns) sleep_ns(pacing->refresh_ns - busy_ns);
+        }
+    }
+
+    uint64_t begin_ns = get_time_ns();
+    if (pacing->frame_begin_ns) vulkan_pacing_update_stats(pacing, begin_ns - pacing->frame_begin_ns);
+    pacing->frame_begin_ns = begin_ns;
+}
+
+// Swapchain first, the targets follow its extent. Stays dirty and returns
+// false while the window has no area.
+bool vulkan_backend_resize(Vulkan_State *vk, uint32_t width, uint32_t height) {
+    if (vk->swapchain_failed) return false;
+    vk->swapchain_dirty = true;
+    if (!vulkan_backend_create_swapchain(vk, width, height)) return false;
+    if (!vulkan_backend_create_render_targets(vk)) return false;
+    vk->swapchain_dirty = false;
+    return true;
+}
+
+// Returns false when there is no image to render to this frame.
+bool vulkan_backend_begin_frame(Vulkan_State *vk, uint32_t width, uint32_t height) {
+    vk->frame_index = vk->frame_number % VULKAN_FRAMES_IN_FLIGHT;
+    Vulkan_Frame *frame = &vk->frames[vk->frame_index];
+
+    // The timeline value of a frame slot is the frame that last used it, so this only
+    // blocks once the CPU gets VULKAN_FRAMES_IN_FLIGHT frames ahead of the GPU.
+    if (!vulkan_timeline_wait(vk, frame->timeline_value)) return false;
+    vkResetCommandPool(vk->device, frame->command_pool, 0);
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(vk->device, vk->timeline, &completed);
+    vulkan_retired_destroy(vk, completed);
+    vulkan_profiler_collect(vk);
+    vulkan_shader_registry_reload(vk);
+
+    // The frames in flight finish on the old swapchain and targets while this
+    // one starts on the new ones, nothing waits for the device to go idle.
+    // A dirty swapchain brings the new render extent along with it.
+    if (vulkan_resolution_update(vk) && !vk->swapchain_dirty) {
+        if (!vulkan_backend_create_render_targets(vk)) return false;
+    }
+    if (vk->swapchain_dirty) {
+        if (!vulkan_backend_resize(vk, width, height)) return false;
+    }
+
+    VkResult acquire = vkAcquireNextImageKHR(vk->device, vk->swapchain, UINT64_MAX, vk->spare_acquire_semaphore, VK_NULL_HANDLE, &vk->image_index);
+    if (acquire == VK_ERROR_OUT_OF_DATE_KHR) {
+        // Retried once on a fresh swapchain so the frame isn't dropped.
+        if (!vulkan_backend_resize(vk, width, height)) return false;
+        acquire = vkAcquireNextImageKHR(vk->device, vk->swapchain, UINT64_MAX, vk->spare_acquire_semaphore, VK_NULL_HANDLE, &vk->image_index);
+    }
+    if (acquire == VK_SUBOPTIMAL_KHR) {
+        vk->swapchain_dirty = true;
+    } else if (acquire == VK_ERROR_OUT_OF_DATE_KHR) {
+        vk->swapchain_dirty = true;
+        return false;
+    } else if (acquire != VK_SUCCESS) {
+        print_error("Vulkan failed to acquire swapchain image");
+        return false;
+    }
+
+    // Whatever semaphore was last used to acquire this image has been waited on by now,
+    // so it becomes the spare for the next acquire.
+    VkSemaphore acquired = vk->spare_acquire_semaphore;
+    vk->spare_acquire_semaphore = vk->acquire_semaphores[vk->image_index];
+    vk->acquire_semaphores[vk->image_index] = acquired;
+
+    // The slot's previous frame is done, and so is everything it uploaded.
+    if (frame->upload_ring_end > vk->upload_ring.tail) vk->upload_ring.tail = frame->upload_ring_end;
+
+    // Only queue GPU work once the frame is certain to be submitted, so
+    // nothing can get lost to an out of date swapchain.
+    vulkan_chunk_buffer_read_stats(vk);
+    vulkan_particles_read_stats(vk);
+    vulkan_lights_read_stats(vk);
+    vulkan_chunk_buffer_update(vk);
+    vulkan_far_field_update(vk);
+    vulkan_shadow_update(vk);
+    vulkan_bindless_update(vk);
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(frame->command_buffer, &begin_info);
+    return true;
+}
+
+// Called on every lane between barriers after vulkan_backend_begin_frame.
+void vulkan_backend_record_lane(Vulkan_State *vk, uint32_t lane_index) {
+    if (lane_index >= vk->lane_count) return;
+    Vulkan_Lane *lane = &vk->lanes[lane_index];
+    lane->record_begin_ns = get_time_ns();
+
+    // Lane 0 already waited on the timeline for this slot, so the pool is free.
+    vkResetCommandPool(vk->device, lane->command_pools[vk->frame_index], 0);
+    VkCommandBuffer cmd = lane->command_buffers[vk->frame_index];
+
+    VkCommandBufferInheritanceInfo inheritance = {};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = vulkan_graph_render_pass(vk, vk->opaque_pass);
+    inheritance.subpass = 0;
+    inheritance.framebuffer = vulkan_graph_framebuffer(vk, vk->opaque_pass);
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance;
+    vkBeginCommandBuffer(cmd, &begin_info);
+
+    // Dynamic state is not inherited from the primary.
+    VkViewport viewport = { 0.0f, 0.0f, (float)vk->render_extent.width, (float)vk->render_extent.height, 0.0f, 1.0f };
+    VkRect2D scissor = { { 0, 0 }, vk->render_extent };
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor(cmd, 0, 1, &scissor);
+    Vulkan_Pipeline *final_pipeline = vulkan_pipeline_resolve(&vk->pipelines, vk->final_pipeline);
+    if (lane_index == 0 && final_pipeline) {
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, final_pipeline->handle);
+        vkCmdDraw(cmd, 3, 1, 0, 0);
+    }
+
+    // Both lists are final by the time the secondaries execute, the prepass
+    // already wrote the depth every fragment here has to match.
+    if (lane_index == 0) {
+        vulkan_chunk_buffer_record_draws(vk, cmd, vk->chunks.pipeline, VULKAN_CHUNK_CULL_EARLY);
+        vulkan_chunk_buffer_record_draws(vk, cmd, vk->chunks.pipeline, VULKAN_CHUNK_CULL_LATE);
+    }
+
+    vkEndCommandBuffer(cmd);
+    lane->record_end_ns = get_time_ns();
+}
+
+// Recorded before the graphics passes, some of them pick up state that the
+// async passes' record callbacks update.
+void vulkan_backend_record_async_compute(Vulkan_State *vk) {
+    Vulkan_Frame *frame = &vk->frames[vk->frame_index];
+    if (!vk->compute_queue || !vk->graph.async_pass_count) return;
+
+    vkResetCommandPool(vk->device, frame->compute_pool, 0);
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(frame->compute_command_buffer, &begin_info);
+    vulkan_graph_execute_async(vk, frame->compute_command_buffer);
+    vkEndCommandBuffer(frame->compute_command_buffer);
+}
+
+// The async passes go to the compute queue ahead of the frame's graphics
+// submit, which waits for them only where their results are read. Until then
+// both queues work side by side.
+bool vulkan_backend_submit_async_compute(Vulkan_State *vk) {
+    Vulkan_Frame *frame = &vk->frames[vk->frame_index];
+    frame->compute_value = 0;
+    if (!vk->compute_queue || !vk->graph.async_pass_count) return true;
+
+    // The previous frame may still read what these passes overwrite.
+    uint64_t wait_value = vk->frame_number;
+    uint64_t signal_value = vk->compute_value + 1;
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = 1;
+    timeline_info.pWaitSemaphoreValues = &wait_value;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &signal_value;
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &vk->timeline;
+    submit_info.pWaitDstStageMask = &wait_stage;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &frame->compute_command_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &vk->compute_timeline;
+    if (vkQueueSubmit(vk->compute_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+        print_error("Vulkan failed to submit async compute");
+        return false;
+    }
+    vk->compute_value = signal_value;
+    frame->compute_value = signal_value;
+    return true;
+}
+
+// Called on lane 0 once every lane has finished vulkan_backend_record_lane.
+void vulkan_backend_record_final_stage(Vulkan_State *vk, Fixed_Arena *arena, VkCommandBuffer cmd) {
+    vulkan_backend_record_async_compute(vk);
+    vulkan_profiler_begin_frame(vk, cmd);
+    vulkan_chunk_buffer_flush_infos(vk);
+    vulkan_far_field_flush_grid(vk);
+    vulkan_backend_record_uploads(vk, arena, cmd);
+    vulkan_graph_execute(vk, cmd);
+    vulkan_profiler_end_frame(vk, cmd);
+}
+
+bool vulkan_backend_end_frame(Vulkan_State *vk) {
+    Vulkan_Frame *frame = &vk->frames[vk->frame_index];
+    vkEndCommandBuffer(frame->command_buffer);
+
+    // The graphics passes read what the async ones write, so the frame can't
+    // go out without them.
+    if (!vulkan_backend_submit_async_compute(vk)) return false;
+
+    uint64_t signal_value = ++vk->frame_number;
+    frame->timeline_value = signal_value;
+
+    // The binary present semaphore ignores its value, but the arrays have to line up.
+    VkSemaphore signal_semaphores[] = { vk->present_semaphores[vk->image_index], vk->timeline };
+    uint64_t signal_values[] = { 0, signal_value };
+
+    // Uploads and async compute are only waited on when this frame submitted some.
+    VkSemaphore wait_semaphores[3] = { vk->acquire_semaphores[vk->image_index] };
+    uint64_t wait_values[3] = { 0 };
+    VkPipelineStageFlags wait_stages[3] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+    uint32_t wait_count = 1;
+    if (frame->transfer_value) {
+        wait_semaphores[wait_count] = vk->transfer_timeline;
+        wait_values[wait_count] = frame->transfer_value;
+        wait_stages[wait_count++] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    }
+    if (frame->compute_value) {
+        wait_semaphores[wait_count] = vk->compute_timeline;
+        wait_values[wait_count] = frame->compute_value;
+        wait_stages[wait_count++] = vk->graph.async_wait_stages;
+    }
+
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = wait_count;
+    timeline_info.pWaitSemaphoreValues = wait_values;
+    timeline_info.signalSemaphoreValueCount = array_count(signal_values);
+    timeline_info.pSignalSemaphoreValues = signal_values;
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = wait_count;
+    submit_info.pWaitSemaphores = wait_semaphores;
+    submit_info.pWaitDstStageMask = wait_stages;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &frame->command_buffer;
+    submit_info.signalSemaphoreCount = array_count(signal_semaphores);
+    submit_info.pSignalSemaphores = signal_semaphores;
+    if (vkQueueSubmit(vk->graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+        print_error("Vulkan failed to submit frame");
+        return false;
+    }
+
+    VkPresentInfoKHR present_info = {};
+    present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    present_info.waitSemaphoreCount = 1;
+    present_info.pWaitSemaphores = &vk->present_semaphores[vk->image_index];
+    present_info.swapchainCount = 1;
+    present_info.pSwapchains = &vk->swapchain;
+    present_info.pImageIndices = &vk->image_index;
+    VkPresentIdKHR present_id = {};
+    present_id.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    present_id.swapchainCount = 1;
+    present_id.pPresentIds = &vk->pacing.present_id;
+    if (vk->pacing.present_wait) {
+        vk->pacing.present_id += 1;
+        present_info.pNext = &present_id;
+    }
+    Vulkan_Pacing *pacing = &vk->pacing;
+    uint64_t cpu_frame_ns = get_time_ns() - pacing->frame_begin_ns;
+    pacing->cpu_frame_ns = pacing->cpu_frame_ns ? (pacing->cpu_frame_ns*7 + cpu_frame_ns) / 8 : cpu_frame_ns;
+    VkResult present = vkQueuePresentKHR(vk->present_queue, &present_info);
+    if (present == VK_SUBOPTIMAL_KHR || present == VK_ERROR_OUT_OF_DATE_KHR) {
+        vk->swapchain_dirty = true;
+    } else if (present != VK_SUCCESS) {
+        print_error("Vulkan failed to present");
+        return false;
+    }
     return true;
 }
+
+void vulkan_backend_shutdown(Vulkan_State *vk) {
+    if (!vk->device) return;
+    vkDeviceWaitIdle(vk->device);
+    vulkan_pipeline_registry_shutdown(vk);
+    vulkan_shader_registry_shutdown(&vk->shaders);
+    vulkan_backend_save_pipeline_cache(vk);
+    vulkan_bindless_shutdown(vk);
+    vulkan_backend_destroy_render_targets(vk);
+    if (vk->hiz.sampler) vkDestroySampler(vk->device, vk->hiz.sampler, 0);
+    if (vk->hiz.descriptor_pool) vkDestroyDescriptorPool(vk->device, vk->hiz.descriptor_pool, 0);
+    if (vk->hiz.set_layout) vkDestroyDescriptorSetLayout(vk->device, vk->hiz.set_layout, 0);
+    vulkan_graph_shutdown(vk);
+    vulkan_profiler_shutdown(vk);
+    Vulkan_Chunk_Buffer *chunks = &vk->chunks;
+    vulkan_buffer_destroy(vk, &chunks->quads);
+    vulkan_buffer_destroy(vk, &chunks->infos);
+    vulkan_buffer_destroy(vk, &chunks->draws);
+    vulkan_buffer_destroy(vk, &chunks->draw_count);
+    vulkan_buffer_destroy(vk, &chunks->visibility);
+    vulkan_buffer_destroy(vk, &chunks->stats_readback);
+    kabarr_free(&chunks->free_ranges);
+    kabarr_free(&chunks->pending_ranges);
+    Vulkan_Shadows *shadows = &vk->shadows;
+    if (shadows->framebuffer) vkDestroyFramebuffer(vk->device, shadows->framebuffer, 0);
+    if (shadows->render_pass) vkDestroyRenderPass(vk->device, shadows->render_pass, 0);
+    if (shadows->sampler) vkDestroySampler(vk->device, shadows->sampler, 0);
+    vulkan_image_destroy(vk, &shadows->atlas);
+    Vulkan_Far_Field *far_field = &vk->far_field;
+    vulkan_buffer_destroy(vk, &far_field->grid);
+    vulkan_buffer_destroy(vk, &far_field->positions);
+    vulkan_buffer_destroy(vk, &far_field->bricks);
+    free(far_field->grid_entries);
+    far_field->grid_entries = 0;
+    kabarr_free(&far_field->dirty_cells);
+    kabarr_free(&far_field->free_bricks);
+    kabarr_free(&far_field->pending_bricks);
+    if (far_field->sampler) vkDestroySampler(vk->device, far_field->sampler, 0);
+    if (far_field->descriptor_pool) vkDestroyDescriptorPool(vk->device, far_field->descriptor_pool, 0);
+    if (far_field->set_layout) vkDestroyDescriptorSetLayout(vk->device, far_field->set_layout, 0);
+    Vulkan_Resolution *resolution = &vk->resolution;
+    if (resolution->sampler) vkDestroySampler(vk->device, resolution->sampler, 0);
+    if (resolution->descriptor_pool) vkDestroyDescriptorPool(vk->device, resolution->descriptor_pool, 0);
+    if (resolution->set_layout) vkDestroyDescriptorSetLayout(vk->device, resolution->set_layout, 0);
+    Vulkan_Particles *particles = &vk->particles;
+    vulkan_buffer_destroy(vk, &particles->state);
+    vulkan_buffer_destroy(vk, &particles->counters);
+    vulkan_buffer_destroy(vk, &particles->emitter_buffer);
+    vulkan_buffer_destroy(vk, &particles->stats_readback);
+    if (particles->descriptor_pool) vkDestroyDescriptorPool(vk->device, particles->descriptor_pool, 0);
+    if (particles->set_layout) vkDestroyDescriptorSetLayout(vk->device, particles->set_layout, 0);
+    Vulkan_Lights *lights = &vk->lights;
+    vulkan_buffer_destroy(vk, &lights->light_uploads);
+    vulkan_buffer_destroy(vk, &lights->light_buffer);
+    vulkan_buffer_destroy(vk, &lights->ranges);
+    vulkan_buffer_destroy(vk, &lights->clusters);
+    vulkan_buffer_destroy(vk, &lights->stats_readback);
+    if (lights->descriptor_pool) vkDestroyDescriptorPool(vk->device, lights->descriptor_pool, 0);
+    if (lights->set_layout) vkDestroyDescriptorSetLayout(vk->device, lights->set_layout, 0);
+
+    for (uint32_t frame_idx = 0; frame_idx < VULKAN_FRAMES_IN_FLIGHT; ++frame_idx) {
+        vkDestroyCommandPool(vk->device, vk->frames[frame_idx].command_pool, 0);
+        if (vk->frames[frame_idx].transfer_pool) vkDestroyCommandPool(vk->device, vk->frames[frame_idx].transfer_pool, 0);
+        if (vk->frames[frame_idx].compute_pool) vkDestroyCommandPool(vk->device, vk->frames[frame_idx].compute_pool, 0);
+        for (uint32_t lane_idx = 0; lane_idx < vk->lane_count; ++lane_idx) {
+            vkDestroyCommandPool(vk->device, vk->lanes[lane_idx].command_pools[frame_idx], 0);
+        }
+    }
+    for (uint32_t image_idx = 0; image_idx < VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT; ++image_idx) {
+        vkDestroySemaphore(vk->device, vk->acquire_semaphores[image_idx], 0);
+        vkDestroySemaphore(vk->device, vk->present_semaphores[image_idx], 0);
+    }
+    vkDestroySemaphore(vk->device, vk->spare_acquire_semaphore, 0);
+    vkDestroySemaphore(vk->device, vk->timeline, 0);
+    vkDestroySemaphore(vk->device, vk->transfer_timeline, 0);
+    vkDestroySemaphore(vk->device, vk->compute_timeline, 0);
+    vulkan_buffer_destroy(vk, &vk->upload_ring.buffer);
+    for (uint32_t lane_idx = 0; lane_idx < VULKAN_MAX_LANES; ++lane_idx) {
+        kabarr_free(&vk->upload_ring.lane_uploads[lane_idx]);
+    }
+    kabarr_free(&vk->upload_ring.moves);
+    kabarr_free(&vk->upload_ring.image_uploads);
+    kabarr_free(&vk->chunks.dirty_infos);
+
+    for (uint32_t image_idx = 0; image_idx < vk->image_count; ++image_idx) {
+        vkDestroyImageView(vk->device, vk->color_image_views[image_idx], 0);
+    }
+    if (vk->swapchain) vkDestroySwapchainKHR(vk->device, vk->swapchain, 0);
+    vulkan_retired_destroy(vk, UINT64_MAX);
+    kabarr_free(&vk->retired);
+    vulkan_memory_log_stats(vk);
+    vulkan_memory_shutdown(vk);
+}
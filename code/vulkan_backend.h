@@ -10,11 +10,14 @@
 typedef enum {
     Shader_Type_Vertex,
     Shader_Type_Fragment,
+    Shader_Type_Compute,
 } Shader_Type;
 
 typedef struct {
     Shader_Type type;
     VkShaderModule handle;
+    uint64_t hash;      // of the SPIR-V, identifies the module for the pipeline registry
+    uint32_t source;    // in the shader registry, the module is rebuilt from it on reload
 } Vulkan_Shader;
 typedef struct {
     Vulkan_Shader *items;
@@ -45,6 +48,7 @@ typedef enum {
     Vulkan_Attachment_Type_Color,
     Vulkan_Attachment_Type_Resolve,
     Vulkan_Attachment_Type_Depth_Stencil,
+    Vulkan_Attachment_Type_Depth_Stencil_Read_Only,
 } Vulkan_Attachment_Type;
 typedef struct {
     VkAttachmentReference *items;
@@ -54,9 +58,14 @@ typedef struct {
     VkAttachmentDescription *items;
     size_t count, capacity;
 } Vulkan_Attachments;
+// One subpass. The source masks are the work outside the pass that touches its
+// attachments, the dest masks the pass's own. Both external dependencies are
+// made from them.
 typedef struct {
     Vulkan_Attachments          attachments;
-    Vulkan_Attachment_Refs      attachment_refs;
+    Vulkan_Attachment_Refs      attachment_refs;    // color
+    VkAttachmentReference       depth_ref;
+    bool                        has_depth;
     VkPipelineStageFlags        source_stage_mask;
     VkAccessFlags               source_access_mask;
     VkPipelineStageFlags        dest_stage_mask;
@@ -66,10 +75,16 @@ typedef struct {
 #define VULKAN_PIPELINE_CUSTOM_VIEWPORT 0x1
 #define VULKAN_PIPELINE_CUSTOM_SCISSOR  0x2
 #define VULKAN_PIPELINE_BLEND_ALPHA     0x4
+#define VULKAN_PIPELINE_NO_DEPTH_WRITE  0x8
+#define VULKAN_PIPELINE_DEPTH_ONLY      0x10
 typedef struct {
     uint32_t                flags;
     VkDevice                device;
+    VkPipelineCache         cache;
     VkRenderPass            render_pass;
+    VkDescriptorSetLayout   descriptor_set_layout;
+    VkDescriptorSetLayout   bindless_set_layout;    // set 1 when present
+    uint32_t                push_constant_size;
     Vulkan_Shaders          shaders;
     Vulkan_Vertex_Attribs   attribs;
     VkViewport              viewport;
@@ -84,19 +99,857 @@ typedef struct {
     VkPipelineLayout    layout;
 } Vulkan_Pipeline;
 
+// Pipelines are looked up by a hash of everything that ends up in the VkPipeline,
+// and a hit is confirmed against the entry's info. Misses are compiled on a
+// background compile thread and the entry's fallback is drawn with until they
+// are ready.
+#define VULKAN_MAX_PIPELINES 256
+#define VULKAN_PIPELINE_NONE UINT32_MAX
+#define VULKAN_PIPELINE_COMPILE_ARENA_SIZE (1ull<<20)
+typedef enum {
+    Vulkan_Pipeline_State_Empty,
+    Vulkan_Pipeline_State_Queued,
+    Vulkan_Pipeline_State_Compiling,
+    Vulkan_Pipeline_State_Ready,
+    Vulkan_Pipeline_State_Failed,
+} Vulkan_Pipeline_State;
+typedef struct {
+    uint64_t                key;
+    volatile uint64_t       state;
+    uint32_t                fallback;
+    VkExtent2D              extent;
+    Vulkan_Pipeline_Info    info;       // owned, without shader modules once compiled so reloads can rebuild it
+    Vulkan_Pipeline         pipeline;
+} Vulkan_Pipeline_Entry;
+typedef struct {
+    Vulkan_Pipeline_Entry   entries[VULKAN_MAX_PIPELINES];
+    volatile uint64_t       count;
+    uint64_t                hits;
+    uint64_t                misses;
+    volatile uint64_t       compiler_active;
+    Thread                  compiler;
+    Fixed_Arena             compile_arena;
+    uint32_t                batch_first;        // entries from here on belong to the startup batch
+    uint64_t                batch_begin_ns;
+} Vulkan_Pipeline_Registry;
+
+// Shaders by file name. Each starts out as <directory>/<name>.spv when nob
+// left a valid one there and as the SPIR-V embedded at build time otherwise.
+// While the directory is watched, changed files replace the SPIR-V and the
+// pipelines built from it are rebuilt.
+#define VULKAN_MAX_SHADER_SOURCES 32
+#define VULKAN_SHADER_NONE UINT32_MAX
+typedef struct {
+    char                    name[32];   // e.g. chunk.frag
+    uint8_t                *spv;        // the registry's own copy
+    size_t                  len;
+    bool                    from_file;
+    bool                    changed;    // since the last reload
+} Vulkan_Shader_Source;
+typedef struct {
+    Vulkan_Shader_Source    sources[VULKAN_MAX_SHADER_SOURCES];
+    uint32_t                count;
+    char                    directory[512]; // empty when running on the embedded SPIR-V only
+    File_Watch              watch;
+    uint32_t                reloads;
+} Vulkan_Shader_Registry;
+
+// Device memory is taken from the driver in large blocks per memory type and
+// handed out with a buddy allocator. Buffers and images never share a block so
+// bufferImageGranularity can't be violated.
+#define VULKAN_MEMORY_BLOCK_SIZE        (64ull<<20)
+#define VULKAN_MEMORY_MIN_ALLOCATION    1024ull
+#define VULKAN_MEMORY_MAX_ORDERS        32
+#define VULKAN_MEMORY_DEDICATED         UINT32_MAX
+typedef struct {
+    VkDeviceMemory      memory;
+    VkDeviceSize        size;
+    uint32_t            memory_type;
+    bool                linear;
+    void               *mapped;
+    uint32_t            order_count;
+    uint32_t            free_heads[VULKAN_MEMORY_MAX_ORDERS];
+    uint32_t           *free_next;      // per leaf, only valid on the first leaf of a free node
+    uint32_t           *free_prev;
+    uint8_t            *free_order;     // order of the free node starting at this leaf, or 0xff
+    VkDeviceSize        used;
+    uint32_t            allocation_count;
+} Vulkan_Memory_Block;
+typedef struct {
+    Vulkan_Memory_Block **items;
+    size_t count, capacity;
+} Vulkan_Memory_Blocks;
 
+typedef struct {
+    VkDeviceMemory      memory;
+    VkDeviceSize        offset;
+    VkDeviceSize        size;
+    void               *mapped;
+    uint32_t            block_index;    // VULKAN_MEMORY_DEDICATED for dedicated allocations
+    uint32_t            order;
+    uint32_t            memory_type;
+} Vulkan_Allocation;
+
+typedef struct {
+    VkBuffer            handle;
+    VkDeviceSize        size;
+    Vulkan_Allocation   allocation;
+} Vulkan_Buffer;
+
+typedef struct {
+    VkImage             handle;
+    VkImageView         view;
+    VkFormat            format;
+    VkExtent3D          extent;
+    Vulkan_Allocation   allocation;
+} Vulkan_Image;
+
+#define VULKAN_MAX_LANES 64
+
+typedef struct {
+    VkBuffer            src;
+    VkBuffer            dst;
+    VkBufferCopy        region;
+} Vulkan_Upload;
+typedef struct {
+    Vulkan_Upload *items;
+    size_t count, capacity;
+} Vulkan_Uploads;
+
+typedef struct {
+    VkBuffer            src;
+    VkImage             dst;
+    VkBufferImageCopy   region;
+} Vulkan_Image_Upload;
+typedef struct {
+    Vulkan_Image_Upload *items;
+    size_t count, capacity;
+} Vulkan_Image_Uploads;
+
+// One persistently mapped ring of staging memory. Any lane can reserve space
+// with an atomic bump of head and records its copies in its own list, so
+// nothing is locked. tail moves forward as the frames that read it retire.
+// Copies go to the transfer queue when the device has one.
+#define VULKAN_UPLOAD_RING_SIZE (64ull<<20)
+typedef struct {
+    Vulkan_Buffer       buffer;
+    volatile uint64_t   head;
+    uint64_t            tail;
+    Vulkan_Uploads      lane_uploads[VULKAN_MAX_LANES];
+    Vulkan_Uploads      moves;              // buffer to buffer copies on the graphics queue, lane 0 only
+    Vulkan_Image_Uploads image_uploads;     // graphics queue as well, lane 0 only
+    uint64_t            stats_bytes;
+    uint64_t            stats_begin_ns;
+    float               megabytes_per_second;
+} Vulkan_Upload_Ring;
+
+#define VULKAN_FRAMES_IN_FLIGHT 3
+typedef struct {
+    VkCommandPool       command_pool;
+    VkCommandBuffer     command_buffer;
+    uint64_t            timeline_value; // value signaled when this frame's work is done
+    VkCommandPool       transfer_pool;
+    VkCommandBuffer     transfer_command_buffer;
+    uint64_t            transfer_value; // transfer timeline value this frame waits on, 0 for none
+    uint64_t            upload_ring_end;
+    VkCommandPool       compute_pool;
+    VkCommandBuffer     compute_command_buffer;
+    uint64_t            compute_value;  // compute timeline value this frame waits on, 0 for none
+} Vulkan_Frame;
+
+// Objects the frames in flight may still use when they are replaced, like the
+// old swapchain after a resize. Destroyed once the timeline reaches
+// release_value instead of waiting for the device to go idle.
+typedef enum {
+    Vulkan_Retired_Swapchain,
+    Vulkan_Retired_Image,
+    Vulkan_Retired_Image_View,
+    Vulkan_Retired_Framebuffer,
+    Vulkan_Retired_Memory,
+} Vulkan_Retired_Kind;
+typedef struct {
+    Vulkan_Retired_Kind kind;
+    uint64_t            release_value;
+    union {
+        VkSwapchainKHR      swapchain;
+        VkImage             image;
+        VkImageView         view;
+        VkFramebuffer       framebuffer;
+        Vulkan_Allocation   allocation;
+    };
+} Vulkan_Retired;
+typedef struct {
+    Vulkan_Retired *items;
+    size_t count, capacity;
+} Vulkan_Retired_List;
+
+// Descriptor sets that point at the size dependent targets can't be rewritten
+// while a frame in flight reads them, so every resize writes the other
+// generation and switches over.
+#define VULKAN_TARGET_GENERATIONS 2
+
+// Chosen per deployment. Throughput keeps the GPU fed with a mailbox swapchain,
+// low latency paces every frame on VK_KHR_present_wait instead.
+typedef struct {
+    VkPresentModeKHR    present_mode;       // tried before the default order, VK_PRESENT_MODE_MAX_ENUM_KHR for none
+    uint32_t            image_count;        // 0 for 3, or 2 with low_latency
+    bool                low_latency;
+    uint64_t            latency_slack_ns;   // kept free before the vblank for the GPU's part of the frame
+} Vulkan_Present_Config;
+
+// With present wait a frame starts right after the previous one reached the
+// screen, pushed back by however much of the refresh the CPU didn't need
+// lately, so input is sampled as late as possible.
+typedef struct {
+    bool                present_wait;       // low latency was asked for and the device can wait on presents
+    uint64_t            present_id;         // of the last present on the current swapchain, 0 for none yet
+    uint64_t            refresh_ns;         // estimated from present completions
+    uint64_t            vblank_ns;          // when the last waited present completed
+    uint64_t            frame_begin_ns;     // input was sampled here
+    uint64_t            cpu_frame_ns;       // frame begin to submit, averaged
+    uint64_t            stats_frame_ns;
+    double              stats_frame_ms_squared;
+    uint64_t            stats_worst_frame_ns;
+    uint64_t            stats_latency_ns;
+    uint32_t            stats_latency_frames;
+    uint32_t            stats_frames;
+} Vulkan_Pacing;
+
+// Every lane records into its own secondary command buffer for the opaque
+// pass, so no pool is ever shared between threads. Since chunks are drawn
+// with indirect counts, lane 0 records the few opaque draws and the other
+// lanes' buffers stay empty.
+typedef struct {
+    VkCommandPool       command_pools[VULKAN_FRAMES_IN_FLIGHT];
+    VkCommandBuffer     command_buffers[VULKAN_FRAMES_IN_FLIGHT];
+    uint64_t            record_begin_ns;
+    uint64_t            record_end_ns;
+    uint32_t            pipelines_compiled;
+} Vulkan_Lane;
+
+// A voxel face. Vertices are pulled from the chunk buffer in the vertex shader.
+//   a: x:6 y:6 z:6 face:3 width-1:5 height-1:5
+//   b: material:16
+#define VULKAN_CHUNK_SIZE 32
+typedef struct {
+    uint32_t            a;
+    uint32_t            b;
+} Vulkan_Chunk_Quad;
+
+// Mirrors Chunk_Info in the chunk shaders.
+typedef struct {
+    int32_t             position[3];
+    uint32_t            quad_offset;
+    uint32_t            quad_count;
+    uint32_t            bounds_min;     // x | y << 8 | z << 16, tight around the chunk's quads
+    uint32_t            bounds_max;
+    uint32_t            pad;
+} Vulkan_Chunk_Info;
+
+// Sun shadows come from one depth atlas holding VULKAN_SHADOW_CASCADES
+// cascades in a 2x2 grid, each a square of tiles in light space. A cascade
+// only ever moves by whole tiles and its tiles wrap around its quadrant, so
+// moving redraws just the tiles that came into view. Every other tile is kept
+// until a chunk over it is remeshed.
+#define VULKAN_SHADOW_CASCADES      4
+#define VULKAN_SHADOW_TILES         4           // per cascade edge, a power of two
+#define VULKAN_SHADOW_TILE_TEXELS   512
+#define VULKAN_SHADOW_ATLAS_TEXELS  (2*VULKAN_SHADOW_TILES*VULKAN_SHADOW_TILE_TEXELS)
+#define VULKAN_SHADOW_TILE_WORLD    32.0f       // tile edge of cascade 0, every cascade after is 4x wider
+#define VULKAN_SHADOW_DEPTH_RANGE   16384.0f    // world units along the light on either side of the origin
+#define VULKAN_SHADOW_FORMAT        VK_FORMAT_D32_SFLOAT
+
+// Push constants of the chunk pipelines, only chunk.frag reads past view_proj.
+typedef struct {
+    float               view_proj[16];
+    int32_t             shadow_origins[VULKAN_SHADOW_CASCADES][2];  // lowest tile of each cascade
+    float               cluster_scale[2];   // from pixels to light cluster tiles
+} Vulkan_Chunk_Constants;
+
+// Push constants of chunk_cull.comp.
+#define VULKAN_CHUNK_CULL_EARLY 0
+#define VULKAN_CHUNK_CULL_LATE  1
+typedef struct {
+    float               view_proj[16];
+    uint32_t            chunk_count;
+    uint32_t            phase;
+    uint32_t            hiz_width;
+    uint32_t            hiz_height;
+    uint32_t            hiz_mip_count;
+} Vulkan_Chunk_Cull_Constants;
+
+// Written by chunk_cull.comp. The early and late draw lists each get their own
+// count, the triangle counts are what frustum culling alone would draw versus
+// what actually gets drawn.
+typedef struct {
+    uint32_t            early_draws;
+    uint32_t            late_draws;
+    uint32_t            frustum_triangles;
+    uint32_t            drawn_triangles;
+} Vulkan_Chunk_Draw_Counts;
+
+typedef struct {
+    uint32_t            offset;
+    uint32_t            size;
+    uint64_t            release_value; // timeline value after which a pending range is free
+} Vulkan_Range;
+typedef struct {
+    Vulkan_Range *items;
+    size_t count, capacity;
+} Vulkan_Ranges;
+
+typedef struct {
+    bool                live;
+    int32_t             position[3];
+    uint32_t            offset;     // in quads
+    uint32_t            quad_count;
+    uint32_t            capacity;   // quads reserved, so small remeshes stay in place
+    uint32_t            bounds_min;
+    uint32_t            bounds_max;
+    bool                info_dirty;
+} Vulkan_Chunk_Mesh;
+
+typedef struct {
+    uint32_t *items;
+    size_t count, capacity;
+} Vulkan_Indices;
+
+// Every chunk mesh lives in one storage buffer and is drawn with vertex pulling.
+// A compute pass culls the chunks and writes the draws, so the CPU records the
+// same few commands no matter how many chunks there are. Culling runs in two
+// phases: chunks visible last frame are drawn first, the Hi-Z pyramid is built
+// from that depth, and everything else is tested against it and drawn late.
+#define VULKAN_MAX_CHUNKS                   16384
+#define VULKAN_CHUNK_QUAD_CAPACITY          (16u<<20)
+#define VULKAN_CHUNK_QUAD_GRANULARITY       16
+#define VULKAN_CHUNK_DEFRAG_QUADS_PER_FRAME (64u<<10)
+typedef struct {
+    Vulkan_Buffer           quads;
+    Vulkan_Buffer           infos;
+    Vulkan_Ranges           free_ranges;    // sorted by offset and coalesced
+    Vulkan_Ranges           pending_ranges; // freed but maybe still read by frames in flight
+    Vulkan_Chunk_Mesh       chunks[VULKAN_MAX_CHUNKS];
+    Vulkan_Indices          dirty_infos;
+    uint32_t                chunk_high_water;
+    uint32_t                live_chunks;
+    uint32_t                live_quads;
+    Vulkan_Buffer           draws;          // early then late list, VULKAN_MAX_CHUNKS VkDrawIndirectCommands each
+    Vulkan_Buffer           draw_count;     // Vulkan_Chunk_Draw_Counts
+    Vulkan_Buffer           visibility;     // one uint per chunk, visible at the end of last frame
+    bool                    visibility_cleared;
+    Vulkan_Buffer           stats_readback; // Vulkan_Chunk_Draw_Counts per frame in flight
+    uint32_t                stats_live[VULKAN_FRAMES_IN_FLIGHT];
+    uint64_t                stats_drawn_total;
+    uint64_t                stats_live_total;
+    uint64_t                stats_frustum_triangles;
+    uint64_t                stats_drawn_triangles;
+    uint32_t                stats_frames;
+    VkDescriptorSetLayout   set_layout;
+    VkDescriptorPool        descriptor_pool;
+    VkDescriptorSet         descriptor_set;     // the current generation's
+    VkDescriptorSet         descriptor_sets[VULKAN_TARGET_GENERATIONS];
+    uint32_t                pipeline;
+    uint32_t                fallback_pipeline;
+    uint32_t                depth_pipeline;
+    uint32_t                cull_pipeline;
+} Vulkan_Chunk_Buffer;
+
+// Max depth pyramid of the early depth. Level 0 is half the depth buffer and
+// every texel holds the farthest depth under it, so a chunk whose nearest depth
+// is behind that is hidden.
+#define VULKAN_HIZ_MAX_MIPS 16
+typedef struct {
+    uint32_t            src_width;
+    uint32_t            src_height;
+    uint32_t            dst_width;
+    uint32_t            dst_height;
+    uint32_t            from_depth;
+} Vulkan_Hiz_Constants;
+typedef struct {
+    VkImageView             mip_views[VULKAN_HIZ_MAX_MIPS];
+    uint32_t                mip_count;
+    VkExtent2D              extent;
+    bool                    built;          // this frame, the late cull falls back to the frustum otherwise
+    VkSampler               sampler;
+    VkDescriptorSetLayout   set_layout;
+    VkDescriptorPool        descriptor_pool;
+    VkDescriptorSet         sets[VULKAN_TARGET_GENERATIONS][VULKAN_HIZ_MAX_MIPS];
+    uint32_t                pipeline;
+} Vulkan_Hiz;
+
+// Emitters live on the CPU, particles only on the GPU. The state is split
+// into one array per attribute inside a single buffer, and a compute pass
+// spawns from a dead list, simulates and compacts the survivors into the
+// other of two alive lists, which an indirect draw turns into camera facing
+// quads. The CPU only ever touches the emitters.
+#define VULKAN_MAX_PARTICLES            (1u<<20)
+#define VULKAN_MAX_PARTICLE_EMITTERS    256
+#define VULKAN_PARTICLE_STAGE_INIT      0
+#define VULKAN_PARTICLE_STAGE_EMIT      1
+#define VULKAN_PARTICLE_STAGE_PREPARE   2
+#define VULKAN_PARTICLE_STAGE_SIMULATE  3
+#define VULKAN_PARTICLE_STAGE_FINISH    4
+
+// Mirrors Emitter in particles.comp.
+typedef struct {
+    float               position[3];
+    float               rate;           // particles per second
+    float               velocity[3];
+    float               spread;         // random speed added in every direction
+    float               color[4];
+    float               lifetime;       // seconds
+    float               size;           // quad edge in world units
+    float               gravity;        // downward acceleration
+    uint32_t            first_spawn;    // set by the backend, where this emitter's spawns start in the frame
+} Vulkan_Particle_Emitter;
+
+// Push constants of particles.comp.
+typedef struct {
+    uint32_t            stage;
+    uint32_t            current;        // alive list emit appends to, simulate compacts into the other one
+    uint32_t            emitter_offset; // first emitter of this frame slot
+    uint32_t            emitter_count;
+    uint32_t            spawn_count;
+    uint32_t            frame_slot;
+    uint32_t            seed;
+    float               delta_time;
+} Vulkan_Particle_Constants;
+
+// Push constants of particle.vert.
+typedef struct {
+    float               view_proj[16];
+    uint32_t            alive_offset;
+} Vulkan_Particle_Draw_Constants;
+
+// Mirrors Counters in particles.comp. The simulate dispatch and the draw are
+// read from here as indirect arguments.
+typedef struct {
+    int32_t                     dead_count;
+    uint32_t                    alive_count[2];
+    uint32_t                    pad0;
+    VkDispatchIndirectCommand   simulate;
+    uint32_t                    pad1;
+    VkDrawIndirectCommand       draw;
+} Vulkan_Particle_Counters;
+
+typedef struct {
+    Vulkan_Buffer           state;          // positions, velocities, looks, dead list and both alive lists
+    VkDeviceSize            offsets[5];     // of each array in state
+    Vulkan_Buffer           counters;       // Vulkan_Particle_Counters
+    Vulkan_Buffer           emitter_buffer; // VULKAN_MAX_PARTICLE_EMITTERS per frame in flight, host visible
+    Vulkan_Buffer           stats_readback; // alive count per frame in flight, written by the finish stage
+    Vulkan_Particle_Emitter emitters[VULKAN_MAX_PARTICLE_EMITTERS];
+    bool                    emitter_live[VULKAN_MAX_PARTICLE_EMITTERS];
+    float                   spawn_carry[VULKAN_MAX_PARTICLE_EMITTERS];  // fractional spawns left over
+    uint32_t                emitter_high_water;
+    bool                    initialized;    // the dead list was filled
+    uint32_t                current;
+    uint64_t                last_update_ns;
+    bool                    stats_pending[VULKAN_FRAMES_IN_FLIGHT];
+    uint64_t                stats_alive_total;
+    uint64_t                stats_spawned_total;
+    uint64_t                stats_simulate_ns;
+    uint64_t                stats_draw_ns;
+    uint32_t                stats_frames;
+    VkDescriptorSetLayout   set_layout;
+    VkDescriptorPool        descriptor_pool;
+    VkDescriptorSet         descriptor_set;
+    uint32_t                compute_pipeline;
+    uint32_t                draw_pipeline;
+} Vulkan_Particles;
+
+// Point lights are binned into a froxel grid over the view every frame,
+// VULKAN_LIGHT_CLUSTERS_X by _Y screen tiles and _Z slices spaced
+// exponentially in view depth. An async compute pass works out the clusters
+// each light can touch and gives every cluster a compact list of them, so
+// chunk.frag only loops over the lights of its own cluster. Lights live on
+// the CPU like the particle emitters and go up once per frame.
+#define VULKAN_MAX_LIGHTS               16384
+#define VULKAN_LIGHT_CLUSTERS_X         16
+#define VULKAN_LIGHT_CLUSTERS_Y         9
+#define VULKAN_LIGHT_CLUSTERS_Z         24
+#define VULKAN_LIGHT_CLUSTER_COUNT      (VULKAN_LIGHT_CLUSTERS_X*VULKAN_LIGHT_CLUSTERS_Y*VULKAN_LIGHT_CLUSTERS_Z)
+#define VULKAN_LIGHT_CLUSTER_MAX        128         // lights per cluster, the rest are dropped
+#define VULKAN_LIGHT_INDEX_CAPACITY     (1u<<20)    // indices over all clusters
+#define VULKAN_LIGHT_DEPTH_NEAR         0.5f        // view depth where the first slice ends
+#define VULKAN_LIGHT_DEPTH_FAR          1024.0f     // and where the last one starts
+#define VULKAN_LIGHT_STAGE_GATHER       0
+#define VULKAN_LIGHT_STAGE_ASSIGN       1
+#define VULKAN_LIGHT_STAGE_FINISH       2
+
+// Mirrors Light in light_cull.comp and chunk.frag.
+typedef struct {
+    float               position[3];
+    float               radius;         // the light fades out to nothing here
+    float               color[3];       // times the intensity
+    float               pad;
+} Vulkan_Light;
+
+// Mirrors Light_Clusters in light_cull.comp and chunk.frag, followed by the
+// index lists the clusters point into.
+typedef struct {
+    uint32_t            index_count;
+    uint32_t            dropped;        // lights a full cluster had no room for
+    uint32_t            pad[2];
+    uint32_t            clusters[VULKAN_LIGHT_CLUSTER_COUNT][2];    // first index, light count
+} Vulkan_Light_Clusters;
+
+// Push constants of light_cull.comp.
+typedef struct {
+    float               view_proj[16];
+    uint32_t            stage;
+    uint32_t            light_offset;   // first light of this frame slot
+    uint32_t            light_count;
+} Vulkan_Light_Cull_Constants;
+
+typedef struct {
+    Vulkan_Light        lights[VULKAN_MAX_LIGHTS];
+    bool                light_live[VULKAN_MAX_LIGHTS];
+    uint32_t            light_high_water;
+    Vulkan_Buffer       light_uploads;  // VULKAN_MAX_LIGHTS per frame in flight, host visible
+    Vulkan_Buffer       light_buffer;   // the frame's lights, packed by the gather stage
+    Vulkan_Buffer       ranges;         // clusters each light can touch, from the gather stage
+    Vulkan_Buffer       clusters;       // Vulkan_Light_Clusters and the index lists
+    Vulkan_Buffer       stats_readback; // index count and dropped lights per frame in flight, written by the finish stage
+    uint32_t            light_count;    // packed this frame
+    bool                stats_pending[VULKAN_FRAMES_IN_FLIGHT];
+    uint32_t            stats_light_count[VULKAN_FRAMES_IN_FLIGHT];
+    uint64_t            stats_lights;
+    uint64_t            stats_indices;
+    uint64_t            stats_dropped;
+    uint64_t            stats_cull_ns;
+    uint64_t            stats_opaque_ns;
+    uint32_t            stats_frames;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool    descriptor_pool;
+    VkDescriptorSet     descriptor_set;
+    uint32_t            pipeline;
+} Vulkan_Lights;
+
+typedef struct {
+    int32_t             tile[2];    // light space tile the slot holds
+    bool                valid;      // false until drawn and after a chunk over it changed
+} Vulkan_Shadow_Slot;
+
+typedef struct {
+    Vulkan_Image            atlas;
+    bool                    atlas_ready;    // cleared and in DEPTH_STENCIL_READ_ONLY_OPTIMAL
+    VkSampler               sampler;        // compares, sampler2DShadow in chunk.frag
+    VkRenderPass            render_pass;
+    VkFramebuffer           framebuffer;
+    uint32_t                pipeline;
+    float                   light_basis[3][3];  // right, up and toward the light
+    int32_t                 origins[VULKAN_SHADOW_CASCADES][2];
+    bool                    origins_set;
+    Vulkan_Shadow_Slot      slots[VULKAN_SHADOW_CASCADES][VULKAN_SHADOW_TILES*VULKAN_SHADOW_TILES];
+    uint32_t                stats_tiles;
+    uint32_t                stats_draws;
+    uint32_t                stats_frames;
+} Vulkan_Shadows;
+
+// Chunks past the mesh radius aren't meshed. They are stored at half
+// resolution, one 16 bit color per 2x2x2 voxels, in bricks that a compute
+// pass raymarches into color and depth images wherever no mesh covered the
+// pixel. A fullscreen pass then depth tests those against the meshes. The
+// grid wraps around, so it covers any part of the world as long as the far
+// chunks stay within one grid extent of each other, each brick records its
+// chunk so the shader can tell what wrapped onto a cell.
+#define VULKAN_FAR_GRID_X       256
+#define VULKAN_FAR_GRID_Y       16
+#define VULKAN_FAR_GRID_Z       256
+#define VULKAN_FAR_MAX_CHUNKS   8192
+#define VULKAN_FAR_CELLS        16      // per brick edge
+#define VULKAN_FAR_MAX_STEPS    512     // grid cells a ray crosses before it gives up
+#define VULKAN_FAR_GRID_DIRTY   0x80000000u
+
+// Push constants of far_raymarch.comp.
+typedef struct {
+    float               inv_view_proj[16];
+    float               depth_row_z[4];     // rows of view_proj, enough for the depth of a hit
+    float               depth_row_w[4];
+    uint32_t            width;
+    uint32_t            height;
+} Vulkan_Far_Constants;
+
+typedef struct {
+    Vulkan_Buffer           grid;           // brick + 1 per grid cell, 0 for nothing
+    Vulkan_Buffer           positions;      // chunk position per brick
+    Vulkan_Buffer           bricks;         // VULKAN_FAR_CELLS^3 colors per brick, 0 for air
+    uint32_t               *grid_entries;   // what grid holds or is about to, VULKAN_FAR_GRID_DIRTY until uploaded
+    Vulkan_Indices          dirty_cells;
+    int32_t                 brick_positions[VULKAN_FAR_MAX_CHUNKS][3];
+    Vulkan_Indices          free_bricks;
+    uint32_t                brick_high_water;
+    Vulkan_Ranges           pending_bricks; // offset is the brick, freed but maybe still read by frames in flight
+    uint32_t                live_chunks;
+    bool                    grid_uploaded;  // the whole grid goes up once before single cells do
+    bool                    raymarched;     // this frame, the composite has nothing to draw otherwise
+    VkSampler               sampler;
+    VkDescriptorSetLayout   set_layout;
+    VkDescriptorPool        descriptor_pool;
+    VkDescriptorSet         descriptor_set;     // the current generation's
+    VkDescriptorSet         descriptor_sets[VULKAN_TARGET_GENERATIONS];
+    uint32_t                raymarch_pipeline;
+    uint32_t                composite_pipeline;
+} Vulkan_Far_Field;
+
+// The scene renders at render_extent, a fraction of the swapchain extent that
+// follows the GPU frame time, and the upscale pass stretches it onto the
+// swapchain with a sharpening filter. A new scale recreates the render targets
+// like a resize does, so scale changes are held back by a cooldown.
+#define VULKAN_RESOLUTION_STEP      0.05f   // scales are multiples of this
+#define VULKAN_RESOLUTION_COOLDOWN  30      // frames between scale changes
+#define VULKAN_RESOLUTION_HEADROOM  0.75f   // of the target, below it the scale goes back up
+typedef struct {
+    bool                enabled;        // otherwise the scale stays at max_scale
+    float               target_ms;      // GPU frame time to hold, 0 follows the refresh
+    float               min_scale;
+    float               max_scale;
+    float               sharpness;      // of the filter at half scale, it fades out toward native
+} Vulkan_Resolution_Config;
+
+// Push constants of upscale.frag.
+typedef struct {
+    float               output_size[2];
+    float               sharpness;
+} Vulkan_Upscale_Constants;
+
+typedef struct {
+    Vulkan_Resolution_Config config;
+    float                   scale;          // of the swapchain extent, render_extent follows it
+    float                   gpu_ms;         // smoothed frame zone of the profiler
+    uint32_t                cooldown;
+    double                  stats_scale;
+    float                   stats_lowest_scale;
+    uint32_t                stats_changes;
+    uint32_t                stats_frames;
+    VkSampler               sampler;
+    VkDescriptorSetLayout   set_layout;
+    VkDescriptorPool        descriptor_pool;
+    VkDescriptorSet         descriptor_set;     // the current generation's
+    VkDescriptorSet         descriptor_sets[VULKAN_TARGET_GENERATIONS];
+    uint32_t                pipeline;
+} Vulkan_Resolution;
+
+// Passes declare which resources they touch and how. Compiling the graph makes
+// the render passes and the barrier plan once, the images and framebuffers are
+// made again whenever the render extent changes. Graph images only live for
+// one frame, their contents are discarded at the first use, so images that are
+// never live at the same time share memory. Buffers are imported and keep
+// their contents.
+#define VULKAN_GRAPH_MAX_RESOURCES      32
+#define VULKAN_GRAPH_MAX_PASSES         32
+#define VULKAN_GRAPH_MAX_ACCESSES       8
+#define VULKAN_GRAPH_MAX_MIPS           16
+#define VULKAN_GRAPH_MAX_BARRIERS       (VULKAN_GRAPH_MAX_PASSES*VULKAN_GRAPH_MAX_ACCESSES + VULKAN_GRAPH_MAX_RESOURCES)
+#define VULKAN_GRAPH_NONE               UINT32_MAX
+
+#define VULKAN_GRAPH_COLOR_ATTACHMENT   0x001
+#define VULKAN_GRAPH_DEPTH_ATTACHMENT   0x002
+#define VULKAN_GRAPH_DEPTH_READ_ONLY    0x004   // attachment, tested but not written
+#define VULKAN_GRAPH_SAMPLED            0x008   // compute
+#define VULKAN_GRAPH_STORAGE_READ       0x010   // compute
+#define VULKAN_GRAPH_STORAGE_WRITE      0x020   // compute
+#define VULKAN_GRAPH_INDIRECT           0x040
+#define VULKAN_GRAPH_TRANSFER_READ      0x080
+#define VULKAN_GRAPH_TRANSFER_WRITE     0x100
+#define VULKAN_GRAPH_VERTEX_READ        0x200   // storage buffer pulled in the vertex shader
+#define VULKAN_GRAPH_FRAGMENT_SAMPLED   0x400
+#define VULKAN_GRAPH_FRAGMENT_READ      0x800   // storage buffer read in the fragment shader
+#define VULKAN_GRAPH_WRITES (VULKAN_GRAPH_COLOR_ATTACHMENT | VULKAN_GRAPH_DEPTH_ATTACHMENT | VULKAN_GRAPH_STORAGE_WRITE | VULKAN_GRAPH_TRANSFER_WRITE)
+#define VULKAN_GRAPH_ATTACHMENTS (VULKAN_GRAPH_COLOR_ATTACHMENT | VULKAN_GRAPH_DEPTH_ATTACHMENT | VULKAN_GRAPH_DEPTH_READ_ONLY)
+
+typedef enum {
+    Vulkan_Graph_Resource_Image,
+    Vulkan_Graph_Resource_Buffer,
+    Vulkan_Graph_Resource_Swapchain,
+} Vulkan_Graph_Resource_Type;
+typedef struct {
+    const char                 *name;
+    Vulkan_Graph_Resource_Type  type;
+    VkFormat                    format;
+    uint32_t                    size_shift;     // extent >> size_shift, at least 1
+    uint32_t                    mip_count;      // 0 for the whole chain
+    VkImageUsageFlags           usage;          // gathered from the accesses
+    uint32_t                    first_pass;
+    uint32_t                    last_pass;
+    uint32_t                    alias_group;    // resource index of the group's first image
+    bool                        lazy;           // attachment only, can sit in lazily allocated memory
+    Vulkan_Image                image;
+    uint32_t                    levels;
+    VkBuffer                    buffer;
+} Vulkan_Graph_Resource;
+typedef struct {
+    uint32_t                    resource;
+    uint32_t                    usage;
+    bool                        clear;
+    VkClearValue                clear_value;
+} Vulkan_Graph_Access;
+typedef struct {
+    uint32_t                    resource;
+    VkPipelineStageFlags        src_stage;
+    VkAccessFlags               src_access;
+    VkPipelineStageFlags        dst_stage;
+    VkAccessFlags               dst_access;
+    VkImageLayout               old_layout;
+    VkImageLayout               new_layout;
+} Vulkan_Graph_Barrier;
+typedef void (*Vulkan_Graph_Record)(void *user, VkCommandBuffer cmd);
+typedef struct {
+    const char                 *name;
+    bool                        graphics;
+    bool                        secondary;      // contents come from the lanes' secondary command buffers
+    bool                        async;          // compute on the async compute queue, buffers only
+    Vulkan_Graph_Record         record;
+    void                       *user;
+    Vulkan_Graph_Access         accesses[VULKAN_GRAPH_MAX_ACCESSES];
+    uint32_t                    access_count;
+    VkRenderPass                render_pass;
+    bool                        per_image;      // renders to the swapchain, one framebuffer per image
+    VkFramebuffer               framebuffers[VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT];
+    uint32_t                    first_barrier;
+    uint32_t                    barrier_count;
+} Vulkan_Graph_Pass;
+typedef struct {
+    Vulkan_Graph_Resource       resources[VULKAN_GRAPH_MAX_RESOURCES];
+    uint32_t                    resource_count;
+    Vulkan_Graph_Pass           passes[VULKAN_GRAPH_MAX_PASSES];
+    uint32_t                    pass_count;
+    Vulkan_Graph_Barrier        barriers[VULKAN_GRAPH_MAX_BARRIERS];
+    uint32_t                    barrier_count;
+    uint32_t                    final_barrier;  // the rest of the list runs after the last pass
+    uint32_t                    async_pass_count;
+    VkPipelineStageFlags        async_wait_stages;  // where the graphics queue waits for the async passes
+    Vulkan_Allocation           memory[VULKAN_GRAPH_MAX_RESOURCES];    // per alias group
+} Vulkan_Graph;
+
+// A timestamp pair around every graph pass and one around the whole frame.
+// Each frame slot owns a range of the query pool that is read back once the
+// slot comes around again, so the results never stall anything. Calibration
+// maps GPU ticks onto get_time_ns, which puts GPU zones next to the CPU lanes
+// in a trace.
+#define VULKAN_PROFILER_MAX_ZONES       (VULKAN_GRAPH_MAX_PASSES + 1)   // the frame zone goes after the passes
+#define VULKAN_PROFILER_STATS_FRAMES    256
+typedef struct {
+    bool                enabled;        // the graphics queue has timestamps
+    bool                calibrated;     // VK_EXT_calibrated_timestamps with a domain get_time_ns can read
+    bool                compute_timestamps; // the async compute queue has timestamps too
+    VkTimeDomainEXT     host_domain;
+    VkQueryPool         query_pool;     // 2*VULKAN_PROFILER_MAX_ZONES queries per frame slot
+    double              period_ns;      // per tick
+    uint64_t            valid_mask;
+    int64_t             gpu_offset_ns;  // get_time_ns = ticks*period_ns + gpu_offset_ns
+    bool                pending[VULKAN_FRAMES_IN_FLIGHT];
+    uint64_t            submit_ns[VULKAN_FRAMES_IN_FLIGHT];    // lines frames up when not calibrated
+    uint64_t            frame_numbers[VULKAN_FRAMES_IN_FLIGHT];
+    uint64_t            zone_ns[VULKAN_PROFILER_MAX_ZONES];    // of the last collected frame, 0 for missing zones
+    uint64_t            stats_zone_ns[VULKAN_PROFILER_MAX_ZONES];
+    uint64_t            stats_async_ns;
+    uint64_t            stats_overlap_ns;   // async zones running next to graphics zones
+    uint32_t            stats_frames;
+    FILE               *trace;          // chrome://tracing JSON, see vulkan_profiler_open_trace
+    uint64_t            trace_begin_ns;
+} Vulkan_Profiler;
+
+// Every texture and storage buffer sits in one update-after-bind descriptor set
+// that is bound once per command buffer, and shaders index it by the handle's
+// index. A handle is only valid while its generation matches the slot's, and
+// slots are reused only after the last frame that could read them retires.
+#define VULKAN_BINDLESS_MAX_TEXTURES    4096
+#define VULKAN_BINDLESS_MAX_BUFFERS     4096
+#define VULKAN_BINDLESS_SET             1
+#define VULKAN_BINDLESS_TEXTURE_BINDING 0
+#define VULKAN_BINDLESS_BUFFER_BINDING  1
+typedef struct {
+    uint32_t            index;
+    uint32_t            generation;     // 0 is never live, so a zeroed handle is invalid
+} Vulkan_Handle;
+typedef enum {
+    Vulkan_Bindless_Kind_Texture,
+    Vulkan_Bindless_Kind_Buffer,
+} Vulkan_Bindless_Kind;
+typedef struct {
+    Vulkan_Bindless_Kind    kind;
+    uint32_t                index;
+    uint64_t                release_value;
+} Vulkan_Bindless_Release;
+typedef struct {
+    Vulkan_Bindless_Release *items;
+    size_t count, capacity;
+} Vulkan_Bindless_Releases;
+typedef struct {
+    VkDescriptorSetLayout       set_layout;
+    VkDescriptorSetLayout       empty_set_layout;   // set 0 of pipelines that have no set of their own
+    VkDescriptorPool            descriptor_pool;
+    VkDescriptorSet             descriptor_set;
+    VkSampler                   sampler;
+    Vulkan_Image                textures[VULKAN_BINDLESS_MAX_TEXTURES];
+    uint32_t                    texture_generations[VULKAN_BINDLESS_MAX_TEXTURES];
+    Vulkan_Indices              free_textures;
+    uint32_t                    texture_high_water;
+    Vulkan_Buffer               buffers[VULKAN_BINDLESS_MAX_BUFFERS];
+    uint32_t                    buffer_generations[VULKAN_BINDLESS_MAX_BUFFERS];
+    Vulkan_Indices              free_buffers;
+    uint32_t                    buffer_high_water;
+    Vulkan_Bindless_Releases    pending;
+} Vulkan_Bindless;
+
+
+// What vulkan_backend_select_device knows about a GPU while ranking them.
+typedef struct {
+    VkPhysicalDevice            phys_device;
+    VkPhysicalDeviceProperties  properties;
+    uint32_t                    graphics_family;
+    uint32_t                    present_family;
+    uint32_t                    compute_family;     // compute without graphics, UINT32_MAX for none
+    uint32_t                    transfer_family;    // transfer only, UINT32_MAX for none
+    VkDeviceSize                device_local_bytes; // of the largest device local heap
+    bool                        has_present_wait;
+    bool                        has_calibrated;
+    uint32_t                    score;
+} Vulkan_Device_Candidate;
 
 typedef struct {
     VkInstance                  instance;
     VkSurfaceKHR                surface;
     VkDevice                    device;
+    // Device entry points that skip the loader trampoline. The global vk*
+    // pointers are loaded from the same device, the table is for code that
+    // has to name the device it dispatches to.
+    struct VolkDeviceTable      device_table;
     VkPhysicalDevice            phys_device;
     VkQueue                     graphics_queue;
     VkQueue                     present_queue;
+    VkQueue                     transfer_queue;     // VK_NULL_HANDLE without a transfer only family
+    VkQueue                     compute_queue;      // VK_NULL_HANDLE without a compute only family
+    uint32_t                    graphics_family;
+    uint32_t                    present_family;
+    uint32_t                    transfer_family;
+    uint32_t                    compute_family;
+
+////// memory  ///////////////////////////////////////
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkDeviceSize                buffer_image_granularity;
+    Vulkan_Memory_Blocks        memory_blocks;
+    uint32_t                    dedicated_count[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize                dedicated_bytes[VK_MAX_MEMORY_HEAPS];
+//////////////////////////////////////////////////////
+
+
+////// pipeline cache  ///////////////////////////////
+#define VULKAN_PIPELINE_CACHE_FILENAME "boxel_pipeline_cache.bin"
+    VkPipelineCache             pipeline_cache;
+    char                        pipeline_cache_path[1024];
+    bool                        pipeline_cache_warm;
+    Vulkan_Pipeline_Registry    pipelines;
+    Vulkan_Shader_Registry      shaders;
+//////////////////////////////////////////////////////
+
 
 ////// swapchain  ////////////////////////////////////
     VkSwapchainKHR              swapchain;
     VkExtent2D                  extent;
+    VkExtent2D                  render_extent;      // of everything before the upscale pass
     VkFormat                    image_format;
     VkColorSpaceKHR             color_space;
     VkPresentModeKHR            present_mode;
@@ -104,17 +957,128 @@ typedef struct {
     uint32_t                    image_count;
     VkImage                     images[VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT];
     VkImageView                 color_image_views[VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT];
-    VkFramebuffer               framebuffers[VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT];
+    bool                        swapchain_dirty;    // suboptimal or out of date, recreated by the next begin_frame
+    bool                        swapchain_failed;   // can't be recreated, begin_frame stops trying
+    Vulkan_Present_Config       present_config;
+    Vulkan_Pacing               pacing;
+    Vulkan_Retired_List         retired;
+    uint32_t                    target_generation;
+    uint64_t                    target_release_values[VULKAN_TARGET_GENERATIONS];
+//////////////////////////////////////////////////////
+
+
+////// render graph  /////////////////////////////////
+// Resource and pass ids in the graph, see vulkan_backend_create_render_graph.
+#define VULKAN_DEPTH_FORMAT VK_FORMAT_D32_SFLOAT
+    Vulkan_Graph                graph;
+    uint32_t                    swapchain_target;
+    uint32_t                    depth_target;
+    uint32_t                    hiz_target;
+    uint32_t                    chunk_draws_target;
+    uint32_t                    chunk_draw_count_target;
+    uint32_t                    chunk_visibility_target;
+    uint32_t                    far_color_target;
+    uint32_t                    far_depth_target;
+    uint32_t                    scene_color_target;
+    uint32_t                    particle_state_target;
+    uint32_t                    particle_counters_target;
+    uint32_t                    lights_target;
+    uint32_t                    light_clusters_target;
+    uint32_t                    particle_simulate_pass; // async
+    uint32_t                    light_cull_pass;        // async
+    uint32_t                    shadow_pass;    // draws into the atlas outside the graph's images
+    uint32_t                    cull_early_pass;
+    uint32_t                    depth_prepass;  // depth only, so the opaque pass shades each pixel once
+    uint32_t                    hiz_pass;
+    uint32_t                    cull_late_pass;
+    uint32_t                    depth_resume_pass;
+    uint32_t                    far_raymarch_pass;
+    uint32_t                    opaque_pass;    // tests EQUAL against the prepass depth
+    uint32_t                    far_composite_pass;
+    uint32_t                    particle_pass;
+    uint32_t                    upscale_pass;   // the only one at the swapchain extent
+//////////////////////////////////////////////////////
+
+
+////// profiler  /////////////////////////////////////
+    Vulkan_Profiler             profiler;
 //////////////////////////////////////////////////////
 
 
-#define VULKAN_FRAMES_IN_FLIGHT 3
 ////// final stage  //////////////////////////////////
-    VkRenderPass                final_render_pass;
-    Vulkan_Pipeline             final_pipeline;
-    VkImage                     final_images[VULKAN_FRAMES_IN_FLIGHT];
-    VkImageView                 final_image_views[VULKAN_FRAMES_IN_FLIGHT];
-    VkFramebuffer               final_framebuffers[VULKAN_FRAMES_IN_FLIGHT];
+    uint32_t                    final_pipeline;
+//////////////////////////////////////////////////////
+
+
+////// frame engine  /////////////////////////////////
+    Vulkan_Frame                frames[VULKAN_FRAMES_IN_FLIGHT];
+    VkSemaphore                 timeline;
+    uint64_t                    frame_number;
+    uint32_t                    frame_index;
+    uint32_t                    image_index;
+    VkSemaphore                 spare_acquire_semaphore;
+    VkSemaphore                 acquire_semaphores[VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT];
+    VkSemaphore                 present_semaphores[VULKAN_SWAPCHAIN_MAX_IMAGE_COUNT];
+//////////////////////////////////////////////////////
+
+
+////// async compute  ////////////////////////////////
+    VkSemaphore                 compute_timeline;
+    uint64_t                    compute_value;
+//////////////////////////////////////////////////////
+
+
+////// uploads  //////////////////////////////////////
+    Vulkan_Upload_Ring          upload_ring;
+    VkSemaphore                 transfer_timeline;
+    uint64_t                    transfer_value;
+//////////////////////////////////////////////////////
+
+
+////// lanes  ////////////////////////////////////////
+    uint32_t                    lane_count;
+    Vulkan_Lane                 lanes[VULKAN_MAX_LANES];
+//////////////////////////////////////////////////////
+
+
+////// chunks  ///////////////////////////////////////
+    Vulkan_Chunk_Buffer         chunks;
+    float                       view_proj[16];
+//////////////////////////////////////////////////////
+
+
+////// bindless  /////////////////////////////////////
+    Vulkan_Bindless             bindless;
+//////////////////////////////////////////////////////
+
+
+////// occlusion  ////////////////////////////////////
+    Vulkan_Hiz                  hiz;
+//////////////////////////////////////////////////////
+
+
+////// particles  ////////////////////////////////////
+    Vulkan_Particles            particles;
+//////////////////////////////////////////////////////
+
+
+////// far field  ////////////////////////////////////
+    Vulkan_Far_Field            far_field;
+//////////////////////////////////////////////////////
+
+
+////// shadows  //////////////////////////////////////
+    Vulkan_Shadows              shadows;
+//////////////////////////////////////////////////////
+
+
+////// lights  ///////////////////////////////////////
+    Vulkan_Lights               lights;
+//////////////////////////////////////////////////////
+
+
+////// resolution  ///////////////////////////////////
+    Vulkan_Resolution           resolution;
 //////////////////////////////////////////////////////
 
 } Vulkan_State;
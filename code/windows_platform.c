@@ -90,12 +90,74 @@ void process_events(Controller *cont, void *window, bool *window_should_close) {
     }
 }
 
+void window_get_size(void *window, int *width, int *height) {
+    RECT rect = {0};
+    GetClientRect((HWND)window, &rect);
+    *width = rect.right - rect.left;
+    *height = rect.bottom - rect.top;
+}
+
 int get_max_thread_count() {
     SYSTEM_INFO si;
     GetSystemInfo(&si);
     return si.dwNumberOfProcessors;
 }
 
+uint64_t host_clock_to_ns(uint64_t value) {
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    uint64_t seconds = value / frequency.QuadPart;
+    uint64_t remainder = value % frequency.QuadPart;
+    return seconds*1000000000ull + remainder*1000000000ull / frequency.QuadPart;
+}
+
+uint64_t get_time_ns() {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return host_clock_to_ns((uint64_t)counter.QuadPart);
+}
+
+// Only millisecond resolution, rounds down.
+void sleep_ns(uint64_t ns) {
+    if (ns >= 1000000ull) Sleep((DWORD)(ns / 1000000ull));
+}
+
+bool get_executable_directory(char *buffer, size_t size) {
+    DWORD len = GetModuleFileNameA(NULL, buffer, (DWORD)size);
+    if (len == 0 || len == size) return false;
+    char *slash = strrchr(buffer, '\\');
+    if (slash) *slash = 0;
+    return true;
+}
+
+bool replace_file(const char *src, const char *dst) {
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+// Change notifications only say that something in the directory changed,
+// not what. Writes can be reported before the file is complete, so writers
+// should rename finished files into place.
+bool file_watch_open(File_Watch *watch, const char *directory) {
+    HANDLE handle = FindFirstChangeNotificationA(directory, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    watch->handle = handle;
+    return true;
+}
+
+bool file_watch_changed(File_Watch *watch) {
+    bool changed = false;
+    while (WaitForSingleObject(watch->handle, 0) == WAIT_OBJECT_0) {
+        changed = true;
+        if (!FindNextChangeNotification(watch->handle)) break;
+    }
+    return changed;
+}
+
+void file_watch_close(File_Watch *watch) {
+    FindCloseChangeNotification(watch->handle);
+    watch->handle = 0;
+}
+
 Thread create_thread(pfn_thread_func entry_point, void *params) {
     HANDLE thread = CreateThread(
         NULL,           // default security
@@ -7,7 +7,8 @@
 #define GLSLC_COMMAND "bin\\glslc.exe"
 #define XXD_COMMAND "bin\\xxd.exe"
 #elif defined (__linux__)
-#error NYI
+#define GLSLC_COMMAND "glslc"
+#define XXD_COMMAND "xxd"
 #endif
 
 bool compile_shaders();
@@ -19,7 +20,10 @@ int main(int argc, char **argv) {
     NOB_GO_REBUILD_URSELF(argc, argv);
     
     if (!nob_mkdir_if_not_exists("build")) return 1;
+    if (!nob_mkdir_if_not_exists("build/shaders")) return 1;
     if (!compile_shaders()) return 1;
+    // `nob shaders` stops here, a running boxel reloads them from build/shaders.
+    if (argc > 1 && strcmp(argv[1], "shaders") == 0) return 0;
     if (!compile_program()) return 1;
     return 0;
 }
@@ -36,7 +40,7 @@ bool compile_shaders() {
         int len = strlen(filename);
         if (len > 5) {
             const char *slice = filename + len - 5;
-            if (strcmp(slice, ".frag") == 0 || strcmp(slice, ".vert") == 0)
+            if (strcmp(slice, ".frag") == 0 || strcmp(slice, ".vert") == 0 || strcmp(slice, ".comp") == 0)
                 nob_da_append(&shader_source, filename);
         }
     }
@@ -90,10 +94,18 @@ bool compile_shaders() {
 
         if (!nob_cmd_run(&convert_header)) return false;
 
-        nob_delete_file(input.items);
+        // Kept for loading at runtime. Renamed into place so the renderer
+        // never picks up a half written file.
+        Nob_String_Builder runtime = {0};
+        nob_sb_append_cstr(&runtime, "build/shaders/");
+        nob_sb_append_cstr(&runtime, shader_filename);
+        nob_sb_append_cstr(&runtime, ".spv");
+        nob_sb_append_null(&runtime);
+        if (!nob_rename(input.items, runtime.items)) return false;
 
         nob_sb_free(input);
         nob_sb_free(output);
+        nob_sb_free(runtime);
         nob_cmd_free(convert_header);
     }
 
@@ -128,7 +140,7 @@ bool compile_program() {
     nob_cmd_append(&compile, "-Icode/");
     nob_cmd_append(&compile, "-DVOLK_VULKAN_H_PATH=\"vulkan/vulkan.h\"");
     nob_cmd_append(&compile, "code/main.c");
-    nob_cmd_append(&compile, "-lxcb", "-lxcb-keysyms");
+    nob_cmd_append(&compile, "-lxcb", "-lxcb-keysyms", "-lm");
     if (!nob_cmd_run(&compile)) return false;
 #endif
     return true;